@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Arenas
+ *
+ * Memory for the many small objects of a parsed document is carved out of
+ * large blocks in turn and released all at once by emptying the arena,
+ * rather than being allocated and freed one object at a time. An emptied
+ * arena keeps a single block big enough for a document like the last one.
+ */
+
+#include <stdlib.h>
+
+#include "arena.h"
+
+/* Size of the first block of an arena; each further block is as big as
+ * all the blocks before it */
+static constexpr size_t arena_block = 0x10000;
+
+/* Most memory kept in an arena between documents */
+static constexpr size_t arena_keep = 0x400'0000;
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+  alignas(max_align_t) char data[];
+};
+
+static inline size_t align(size_t size) {
+  return (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+  struct arena_block *block = arena->head;
+  size_t want;
+  void *p;
+
+  size = align(size);
+  if (!block || block->size - block->used < size) {
+    want = arena->total > arena_block ? arena->total : arena_block;
+    if (want < size)
+      want = size;
+    if ((block = malloc(sizeof *block + want)) == nullptr)
+      return nullptr;
+    *block = (struct arena_block) { .next = arena->head, .size = want };
+    arena->head = block;
+    arena->total += want;
+  }
+
+  p = block->data + block->used;
+  block->used += size;
+  return p;
+}
+
+/* Grow the allocation at 'ptr' in place, which is possible if it was the
+ * last one made and there is room after it */
+bool arena_extend(struct arena *arena, void *ptr, size_t old_size, size_t size) {
+  struct arena_block *block = arena->head;
+
+  old_size = align(old_size);
+  size = align(size);
+  if (!block || (char *) ptr + old_size != block->data + block->used ||
+      block->size - block->used < size - old_size)
+    return false;
+
+  block->used += size - old_size;
+  return true;
+}
+
+bool arena_contains(const struct arena *arena, const void *ptr) {
+  for (const struct arena_block *block = arena->head; block; block = block->next)
+    if ((const char *) ptr >= block->data && (const char *) ptr < block->data + block->size)
+      return true;
+  return false;
+}
+
+void arena_release(struct arena *arena) {
+  struct arena_block *block, *next;
+
+  for (block = arena->head; block; block = next) {
+    next = block->next;
+    free(block);
+  }
+  arena->head = nullptr;
+  arena->total = 0;
+}
+
+/* Empty the arena, keeping a single block big enough for all that was in
+ * it, unless that would be too much to keep */
+void arena_reset(struct arena *arena) {
+  size_t total = arena->total;
+
+  if (arena->head && !arena->head->next && total <= arena_keep) {
+    arena->head->used = 0;
+    return;
+  }
+
+  arena_release(arena);
+  if (total && total <= arena_keep && (arena->head = malloc(sizeof *arena->head + total))) {
+    *arena->head = (struct arena_block) { .size = total };
+    arena->total = total;
+  }
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+struct arena_block;
+
+struct arena {
+  struct arena_block *head;
+  size_t total;
+};
+
+extern void *arena_alloc(struct arena *arena, size_t size);
+extern bool arena_extend(struct arena *arena, void *ptr, size_t old_size, size_t size);
+extern bool arena_contains(const struct arena *arena, const void *ptr);
+extern void arena_reset(struct arena *arena);
+extern void arena_release(struct arena *arena);
+
+#endif
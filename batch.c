@@ -0,0 +1,516 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Batch processing
+ *
+ * Processes a series of documents named on the command line or in a list
+ * file with a single set of initialised parsers and loaded configuration.
+ * Each document's text goes either to stdout, separated from the previous
+ * one, or to its own file beneath an output directory.
+ *
+ * With more than one job, documents are shared out among a pool of worker
+ * threads. Each renders into a private buffer that the main thread outputs
+ * either in the original order or in the order of completion.
+ *
+ * Directories may be walked for the documents beneath them. Meanwhile a
+ * thread keeps a few files ahead of those being processed, opening them and
+ * asking the kernel to read them in, so that parsing seldom waits on the
+ * disk.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unhtml.h"
+#include "load.h"
+#include "config.h"
+#include "render.h"
+#include "output.h"
+#include "batch.h"
+
+/* Output the separator, expanding %f to the name of the next document */
+void write_separator(struct output *out, const char *sep, size_t len,
+                     const char *file) {
+  const char *end = sep + len;
+
+  for (; sep < end; sep++) {
+    if (*sep == '%' && sep + 1 < end && sep[1] == 'f') {
+      output_puts(out, file);
+      sep++;
+    } else if (*sep == '%' && sep + 1 < end && sep[1] == '%') {
+      output_putc(out, '%');
+      sep++;
+    } else {
+      output_putc(out, *sep);
+    }
+  }
+}
+
+/* Open the file to contain the text of 'file' within the output directory,
+ * mirroring its relative path and replacing any extension with .txt */
+static int open_output(const char *file) {
+  const char *base, *ext;
+  char *path = nullptr;
+  int fd = -1;
+
+  while (*file == '/')
+    file++;
+
+  if (!strcmp(file, "..") || !strncmp(file, "../", 3) ||
+      strstr(file, "/../") ||
+      (strlen(file) >= 3 && !strcmp(file + strlen(file) - 3, "/.."))) {
+    fprintf(stderr, "refusing to write output outside %s for %s\n",
+            opt.outdir, file);
+    return -1;
+  }
+
+  base = strrchr(file, '/');
+  base = base ? base + 1 : file;
+  ext = strrchr(base, '.');
+  if (!ext || ext == base)
+    ext = base + strlen(base);
+
+  if (asprintf(&path, "%s/%.*s.txt", opt.outdir, (int) (ext - file), file) == -1) {
+    fprintf(stderr, "could not allocate path, %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (make_parents(path) == 0 &&
+      (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1)
+    fprintf(stderr, "could not create %s, %s\n", path, strerror(errno));
+  else if (fd != -1)
+    logv("writing %s\n", path);
+
+  free(path);
+  return fd;
+}
+
+struct job {
+  char *file;
+  bool file_needs_free;
+  /* Text rendered by a worker, awaiting output */
+  char *text;
+  size_t len;
+  int rc;
+  bool done;
+};
+
+struct batch {
+  struct job *jobs;
+  size_t num_jobs;
+  size_t max_buf;
+  struct output *out;
+
+  /* Worker pool state */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t next;
+  size_t emitted;
+  size_t window;
+  /* Indices of jobs in the order in which they completed */
+  size_t *order;
+  size_t completed;
+
+  /* Read-ahead state */
+  size_t ahead;
+  bool finished;
+};
+
+static int add_job(struct batch *batch, char *file, bool needs_free) {
+  struct job *jobs;
+
+  if ((batch->num_jobs & (batch->num_jobs - 1)) == 0) {
+    jobs = reallocarray(batch->jobs,
+                        batch->num_jobs ? batch->num_jobs << 1 : 16,
+                        sizeof *jobs);
+    if (jobs == nullptr) {
+      fprintf(stderr, "could not allocate job list, %s\n", strerror(errno));
+      return 1;
+    }
+    batch->jobs = jobs;
+  }
+
+  batch->jobs[batch->num_jobs++] = (struct job) {
+    .file = file,
+    .file_needs_free = needs_free,
+  };
+  return 0;
+}
+
+/* Whether a file or directory found by walking a tree, of the given name,
+ * passes the -include and -exclude patterns */
+static bool wanted(const char *name, bool dir) {
+  int i;
+
+  for (i = 0; i < opt.num_exclude; i++)
+    if (fnmatch(opt.exclude[i], name, 0) == 0)
+      return false;
+  if (dir || opt.num_include == 0)
+    return true;
+  for (i = 0; i < opt.num_include; i++)
+    if (fnmatch(opt.include[i], name, 0) == 0)
+      return true;
+  return false;
+}
+
+/* Add the files beneath a directory in order of name. Symbolic links to
+ * files are followed but those to directories are not. */
+static int add_tree(struct batch *batch, const char *dir) {
+  size_t len = strlen(dir);
+  struct dirent **entries;
+  int rc = 0;
+  int n;
+
+  if ((n = scandir(dir, &entries, nullptr, alphasort)) == -1) {
+    fprintf(stderr, "could not read directory %s, %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  while (len > 1 && dir[len - 1] == '/')
+    len--;
+
+  for (int i = 0; i < n; i++) {
+    const char *name = entries[i]->d_name;
+    unsigned char type = entries[i]->d_type;
+    char *path = nullptr;
+    struct stat st;
+
+    if (rc != 0 || !strcmp(name, ".") || !strcmp(name, ".."))
+      goto next;
+
+    if (asprintf(&path, "%.*s/%s", (int) len, dir, name) == -1) {
+      fprintf(stderr, "could not allocate path, %s\n", strerror(errno));
+      path = nullptr;
+      rc = 1;
+      goto next;
+    }
+
+    if (type == DT_UNKNOWN && lstat(path, &st) == 0)
+      type = IFTODT(st.st_mode);
+    if (type == DT_LNK && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+      type = DT_REG;
+
+    if (type == DT_DIR && wanted(name, true)) {
+      rc = add_tree(batch, path);
+    } else if (type == DT_REG && wanted(name, false)) {
+      if ((rc = add_job(batch, path, true)) == 0)
+        path = nullptr;
+    }
+
+next:
+    free(path);
+    free(entries[i]);
+  }
+  free(entries);
+
+  return rc;
+}
+
+/* Add a named file, or with -recursive, the files beneath a named
+ * directory. The name is taken over if it needs freeing. */
+static int add_path(struct batch *batch, char *file, bool needs_free) {
+  struct stat st;
+  int rc;
+
+  if (!opt.recursive || stat(file, &st) == -1 || !S_ISDIR(st.st_mode)) {
+    if ((rc = add_job(batch, file, needs_free)) == 0)
+      return 0;
+  } else {
+    rc = add_tree(batch, file);
+  }
+
+  if (needs_free)
+    free(file);
+  return rc;
+}
+
+/* Add each entry in a list of file names separated by NULs, if the list
+ * contains any, or else by newlines. */
+static int add_list(struct batch *batch) {
+  struct mapped_buffer list;
+  const char *next, *end;
+  char delim;
+  int rc;
+
+  if (!strcmp(opt.files_from, "-"))
+    rc = map_stream(&list, batch->max_buf, stdin);
+  else
+    rc = map_file(&list, batch->max_buf, opt.files_from);
+  if (rc != 0)
+    return 1;
+
+  end = list.data + list.length - 1;
+  delim = memchr(list.data, '\0', end - list.data) ? '\0' : '\n';
+
+  for (next = list.data; next < end && rc == 0;) {
+    const char *eol = memchr(next, delim, end - next);
+    size_t len = (eol ? eol : end) - next;
+    char *file;
+
+    if (len) {
+      if ((file = strndup(next, len)) == nullptr) {
+        fprintf(stderr, "could not allocate file name, %s\n",
+                strerror(errno));
+        rc = 1;
+      } else {
+        rc = add_path(batch, file, true);
+      }
+    }
+    next += len + 1;
+  }
+
+  free_map(&list);
+  return rc;
+}
+
+/* Render one document, either straight to its file in the output directory
+ * or, if 'buffer' is set, into memory for output later. */
+static int run_job(struct batch *batch, struct job *job, bool buffer) {
+  struct doc_stats stats;
+  struct output out;
+  int fd = -1;
+  int rc;
+
+  stats_begin(&stats, opt.stats != STATS_NONE);
+
+  if (!opt.outdir && !buffer) {
+    rc = process_document(job->file, batch->max_buf, batch->out, &stats);
+    goto finish;
+  }
+
+  if (opt.outdir && (fd = open_output(job->file)) == -1) {
+    rc = 1;
+    goto finish;
+  }
+
+  if ((rc = output_init(&out, fd)) == 0) {
+    rc = process_document(job->file, batch->max_buf, &out, &stats);
+    stats_enter(&stats, PHASE_FLUSH);
+    if (output_flush(&out) != 0)
+      rc = 1;
+    stats_enter(&stats, PHASE_NONE);
+    if (buffer)
+      job->text = output_take(&out, &job->len);
+    output_free(&out);
+  }
+
+  if (fd != -1 && close(fd) == -1) {
+    fprintf(stderr, "error writing output for %s, %s\n",
+            job->file, strerror(errno));
+    rc = 1;
+  }
+
+finish:
+  stats_add(&stats, job->file, rc);
+  return rc;
+}
+
+/* Output the text of the 'n'th job to be output */
+static int emit_job(struct batch *batch, struct job *job, size_t n) {
+  int rc;
+
+  if (n)
+    write_separator(batch->out, opt.separator, opt.separator_len, job->file);
+  output_ref(batch->out, job->text, job->len);
+  if ((rc = output_flush(batch->out)) != 0)
+    fprintf(stderr, "error writing output for %s\n", job->file);
+  free(job->text);
+  job->text = nullptr;
+  return rc;
+}
+
+/* Open the files of jobs ahead of those being processed and have the kernel
+ * start reading them into the page cache */
+static void *read_ahead(void *arg) {
+  struct batch *batch = arg;
+  const char *file;
+  int fd;
+
+  pthread_mutex_lock(&batch->lock);
+  while (!batch->finished && batch->ahead < batch->num_jobs) {
+    /* Files already being processed are no longer worth reading ahead */
+    if (batch->ahead < batch->next)
+      batch->ahead = batch->next;
+    if (batch->ahead >= batch->next + opt.read_ahead) {
+      pthread_cond_wait(&batch->cond, &batch->lock);
+      continue;
+    }
+
+    file = batch->jobs[batch->ahead++].file;
+    pthread_mutex_unlock(&batch->lock);
+
+    logvv("reading ahead %s\n", file);
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) != -1) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      close(fd);
+    }
+
+    pthread_mutex_lock(&batch->lock);
+  }
+  pthread_mutex_unlock(&batch->lock);
+
+  return nullptr;
+}
+
+static void *worker(void *arg) {
+  struct batch *batch = arg;
+  bool buffer = !opt.outdir;
+  struct job *job;
+
+  pthread_mutex_lock(&batch->lock);
+  while (batch->next < batch->num_jobs) {
+    /* Limit how far ahead of the output we get, since documents are held
+     * in memory until they can be output */
+    if (buffer && batch->next >= batch->emitted + batch->window) {
+      pthread_cond_wait(&batch->cond, &batch->lock);
+      continue;
+    }
+
+    job = batch->jobs + batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+
+    job->rc = run_job(batch, job, buffer);
+
+    pthread_mutex_lock(&batch->lock);
+    job->done = true;
+    batch->order[batch->completed++] = job - batch->jobs;
+    pthread_cond_broadcast(&batch->cond);
+  }
+  pthread_mutex_unlock(&batch->lock);
+
+  return nullptr;
+}
+
+static int run_pool(struct batch *batch) {
+  pthread_t *threads;
+  int started;
+  int failed = 0;
+  int rc;
+
+  if ((threads = calloc(opt.jobs, sizeof *threads)) == nullptr ||
+      (batch->order = calloc(batch->num_jobs, sizeof *batch->order)) == nullptr) {
+    fprintf(stderr, "could not allocate worker pool, %s\n", strerror(errno));
+    free(threads);
+    return 1;
+  }
+
+  batch->window = opt.jobs * 4;
+
+  for (started = 0; started < opt.jobs; started++) {
+    if ((rc = pthread_create(threads + started, nullptr, worker, batch)) != 0) {
+      fprintf(stderr, "could not start worker thread, %s\n", strerror(rc));
+      break;
+    }
+  }
+
+  /* Output documents as they complete, without holding the lock while
+   * writing, so that a slow reader of the output holds up only this thread
+   * and the workers carry on up to the window */
+  if (started && !opt.outdir) {
+    pthread_mutex_lock(&batch->lock);
+    for (size_t i = 0; i < batch->num_jobs; i++) {
+      struct job *job;
+
+      while (opt.unordered ? i == batch->completed : !batch->jobs[i].done)
+        pthread_cond_wait(&batch->cond, &batch->lock);
+      job = batch->jobs + (opt.unordered ? batch->order[i] : i);
+      pthread_mutex_unlock(&batch->lock);
+
+      if (emit_job(batch, job, i) != 0)
+        failed = 1;
+
+      pthread_mutex_lock(&batch->lock);
+      batch->emitted = i + 1;
+      pthread_cond_broadcast(&batch->cond);
+    }
+    pthread_mutex_unlock(&batch->lock);
+  }
+
+  while (started--)
+    pthread_join(threads[started], nullptr);
+
+  free(threads);
+  free(batch->order);
+
+  return failed || batch->next < batch->num_jobs ? 1 : 0;
+}
+
+static int run_sequential(struct batch *batch) {
+  for (size_t i = 0; i < batch->num_jobs; i++) {
+    struct job *job = batch->jobs + i;
+
+    /* Let the read-ahead know where we are */
+    pthread_mutex_lock(&batch->lock);
+    batch->next = i + 1;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+
+    if (!opt.outdir && i)
+      write_separator(batch->out, opt.separator, opt.separator_len, job->file);
+    job->rc = run_job(batch, job, false);
+    job->done = true;
+  }
+  return 0;
+}
+
+int process_batch(size_t max_buf, struct output *out) {
+  struct batch batch = { .max_buf = max_buf, .out = out };
+  pthread_t reader;
+  bool reading = false;
+  int errors = 0;
+  int rc = 0;
+  int i;
+
+  for (i = 0; i < opt.num_files && rc == 0; i++)
+    rc = add_path(&batch, opt.files[i], false);
+
+  if (opt.files_from && rc == 0)
+    rc = add_list(&batch);
+
+  pthread_mutex_init(&batch.lock, nullptr);
+  pthread_cond_init(&batch.cond, nullptr);
+
+  if (rc == 0 && opt.read_ahead && batch.num_jobs > 1)
+    reading = pthread_create(&reader, nullptr, read_ahead, &batch) == 0;
+
+  if (rc == 0) {
+    if (opt.jobs > 1 && batch.num_jobs > 1)
+      rc = run_pool(&batch);
+    else
+      rc = run_sequential(&batch);
+  }
+
+  if (reading) {
+    pthread_mutex_lock(&batch.lock);
+    batch.finished = true;
+    pthread_cond_broadcast(&batch.cond);
+    pthread_mutex_unlock(&batch.lock);
+    pthread_join(reader, nullptr);
+  }
+
+  pthread_cond_destroy(&batch.cond);
+  pthread_mutex_destroy(&batch.lock);
+
+  for (size_t j = 0; j < batch.num_jobs; j++) {
+    struct job *job = batch.jobs + j;
+
+    if (!job->done || job->rc != 0)
+      errors++;
+    if (job->file_needs_free)
+      free(job->file);
+    free(job->text);
+  }
+  free(batch.jobs);
+
+  if (errors)
+    logv("%d documents could not be processed\n", errors);
+
+  return rc || errors ? 1 : 0;
+}
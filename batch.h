@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "unhtml.h"
+
+extern int process_batch(size_t max_buf, struct output *out);
+extern void write_separator(struct output *out, const char *sep, size_t len,
+                            const char *file);
+
+#endif
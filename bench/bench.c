@@ -0,0 +1,511 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* bench: measure the throughput of unhtml over a corpus
+ *
+ * Runs unhtml in batch mode over each list of files in the corpus directory,
+ * as made by gencorpus, once for every combination of parser and render mode
+ * that unhtml reports in its help. Each combination is run several times and
+ * the fastest run reported, one record per line, in JSON or as TSV. The
+ * time in each phase comes from unhtml's own -stats report.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+enum format {
+  FORMAT_JSON,
+  FORMAT_TSV,
+};
+
+struct names {
+  char **name;
+  int num;
+};
+
+struct corpus {
+  char *name;
+  char *list;
+  long docs;
+  long long bytes;
+};
+
+struct phase {
+  char name[24];
+  double wall;
+  double cpu;
+};
+
+static constexpr int max_phases = 16;
+
+struct result {
+  int status;
+  double wall;
+  double user;
+  double sys;
+  long max_rss;
+  struct phase phase[max_phases];
+  int num_phases;
+};
+
+static struct {
+  const char *unhtml;
+  const char *confdir;
+  int repeat;
+  enum format format;
+  struct names parsers;
+  struct names render_modes;
+  char **extra;
+  int num_extra;
+  char *stats_file;
+} opt;
+
+static bool add_name(struct names *names, const char *name) {
+  char **grown = realloc(names->name, (names->num + 1) * sizeof *grown);
+
+  if (grown == nullptr)
+    return false;
+  names->name = grown;
+  if ((names->name[names->num] = strdup(name)) == nullptr)
+    return false;
+  names->num++;
+  return true;
+}
+
+static void free_names(struct names *names) {
+  for (int i = 0; i < names->num; i++)
+    free(names->name[i]);
+  free(names->name);
+  *names = (struct names) {};
+}
+
+/* Learn the available parsers and render modes from unhtml's help */
+static int query_unhtml(void) {
+  struct names *section = nullptr;
+  bool want_parsers = opt.parsers.num == 0;
+  bool want_modes = opt.render_modes.num == 0;
+  char *command = nullptr;
+  char *line = nullptr;
+  size_t size = 0;
+  ssize_t len;
+  FILE *help;
+  int rc = 0;
+
+  if (asprintf(&command, "'%s' -help", opt.unhtml) == -1)
+    return 1;
+  if ((help = popen(command, "r")) == nullptr) {
+    fprintf(stderr, "could not run %s: %s\n", opt.unhtml, strerror(errno));
+    free(command);
+    return 1;
+  }
+
+  while ((len = getline(&line, &size, help)) != -1) {
+    if (len && line[len - 1] == '\n')
+      line[--len] = '\0';
+    if (!strcmp(line, "Parsers:"))
+      section = want_parsers ? &opt.parsers : nullptr;
+    else if (!strcmp(line, "Render modes:"))
+      section = want_modes ? &opt.render_modes : nullptr;
+    else if (section && !strncmp(line, "  ", 2) && !add_name(section, line + 2))
+      rc = 1;
+    else if (strncmp(line, "  ", 2))
+      section = nullptr;
+  }
+
+  pclose(help);
+  free(line);
+  free(command);
+
+  if (rc == 0 && (opt.parsers.num == 0 || opt.render_modes.num == 0)) {
+    fprintf(stderr, "could not learn parsers and render modes from %s\n",
+            opt.unhtml);
+    rc = 1;
+  }
+  return rc;
+}
+
+/* Count the documents in a list and their total size */
+static int measure_corpus(struct corpus *corpus) {
+  char *line = nullptr;
+  size_t size = 0;
+  ssize_t len;
+  struct stat st;
+  FILE *list;
+
+  if ((list = fopen(corpus->list, "r")) == nullptr) {
+    fprintf(stderr, "could not open %s: %s\n", corpus->list, strerror(errno));
+    return 1;
+  }
+
+  while ((len = getline(&line, &size, list)) != -1) {
+    if (len && line[len - 1] == '\n')
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+    if (stat(line, &st) == -1) {
+      fprintf(stderr, "could not stat %s: %s\n", line, strerror(errno));
+      continue;
+    }
+    corpus->docs++;
+    corpus->bytes += st.st_size;
+  }
+
+  free(line);
+  fclose(list);
+  return 0;
+}
+
+static int is_list(const struct dirent *entry) {
+  size_t len = strlen(entry->d_name);
+
+  return len > 5 && !strcmp(entry->d_name + len - 5, ".list");
+}
+
+static int find_corpora(const char *dir, char **kinds, int num_kinds,
+                        struct corpus **corpora) {
+  struct dirent **entries;
+  int num, found = 0;
+
+  if ((num = scandir(dir, &entries, is_list, alphasort)) == -1) {
+    fprintf(stderr, "could not read corpus %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
+
+  if ((*corpora = calloc(num ? num : 1, sizeof **corpora)) == nullptr)
+    found = -1;
+
+  for (int i = 0; i < num && found != -1; i++) {
+    struct corpus *corpus = *corpora + found;
+    char *name = entries[i]->d_name;
+    int k;
+
+    name[strlen(name) - 5] = '\0';
+    for (k = 0; k < num_kinds && strcmp(kinds[k], name); k++);
+    if (num_kinds && k == num_kinds)
+      continue;
+
+    corpus->name = strdup(name);
+    if (asprintf(&corpus->list, "%s/%s.list", dir, name) == -1)
+      corpus->list = nullptr;
+    if (corpus->name && corpus->list && measure_corpus(corpus) == 0)
+      found++;
+  }
+
+  for (int i = 0; i < num; i++)
+    free(entries[i]);
+  free(entries);
+  return found;
+}
+
+/* Pick the per-phase times out of unhtml's JSON statistics */
+static void read_phases(struct result *result) {
+  char buf[8192];
+  const char *p;
+  size_t len;
+  FILE *f;
+  int n;
+
+  result->num_phases = 0;
+  if ((f = fopen(opt.stats_file, "r")) == nullptr)
+    return;
+  len = fread(buf, 1, sizeof buf - 1, f);
+  buf[len] = '\0';
+  fclose(f);
+
+  if ((p = strstr(buf, "\"phases\":{")) == nullptr)
+    return;
+  p += strlen("\"phases\":{");
+
+  while (result->num_phases < max_phases) {
+    struct phase *phase = result->phase + result->num_phases;
+
+    if (sscanf(p, "\"%23[^\"]\":{\"wall_s\":%lf,\"cpu_s\":%lf}%n",
+               phase->name, &phase->wall, &phase->cpu, &n) != 3)
+      break;
+    result->num_phases++;
+    p += n;
+    if (*p++ != ',')
+      break;
+  }
+}
+
+static double seconds(const struct timeval *tv) {
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* Run unhtml once over a list of documents, discarding its output */
+static int run_once(const struct corpus *corpus, const char *parser,
+                    const char *render_mode, struct result *result) {
+  const char *argv[20 + opt.num_extra];
+  struct timespec start, end;
+  struct rusage usage;
+  int argc = 0;
+  int status;
+  pid_t pid;
+
+  argv[argc++] = opt.unhtml;
+  if (opt.confdir) {
+    argv[argc++] = "-confdir";
+    argv[argc++] = opt.confdir;
+  }
+  argv[argc++] = "-parser";
+  argv[argc++] = parser;
+  argv[argc++] = "-render";
+  argv[argc++] = render_mode;
+  argv[argc++] = "-stats=json";
+  argv[argc++] = "-stats-file";
+  argv[argc++] = opt.stats_file;
+  for (int i = 0; i < opt.num_extra; i++)
+    argv[argc++] = opt.extra[i];
+  argv[argc++] = "-files-from";
+  argv[argc++] = corpus->list;
+  argv[argc] = nullptr;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if ((pid = fork()) == -1) {
+    fprintf(stderr, "could not fork: %s\n", strerror(errno));
+    return 1;
+  }
+
+  if (pid == 0) {
+    int null = open("/dev/null", O_RDWR);
+
+    if (null != -1) {
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+    }
+    execv(opt.unhtml, (char **) argv);
+    _exit(127);
+  }
+
+  if (wait4(pid, &status, 0, &usage) == -1) {
+    fprintf(stderr, "could not wait for %s: %s\n", opt.unhtml, strerror(errno));
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  *result = (struct result) {
+    .status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+    .wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+    .user = seconds(&usage.ru_utime),
+    .sys = seconds(&usage.ru_stime),
+    .max_rss = usage.ru_maxrss,
+  };
+  read_phases(result);
+  return 0;
+}
+
+/* Keep the fastest of several runs, but the worst status and peak memory */
+static int run(const struct corpus *corpus, const char *parser,
+               const char *render_mode, struct result *best) {
+  struct result result;
+
+  for (int i = 0; i < opt.repeat; i++) {
+    if (run_once(corpus, parser, render_mode, &result) != 0)
+      return 1;
+    if (i == 0) {
+      *best = result;
+      continue;
+    }
+    if (result.status > best->status)
+      best->status = result.status;
+    if (result.max_rss > best->max_rss)
+      best->max_rss = result.max_rss;
+    if (result.wall < best->wall) {
+      best->wall = result.wall;
+      best->user = result.user;
+      best->sys = result.sys;
+      memcpy(best->phase, result.phase, sizeof result.phase);
+      best->num_phases = result.num_phases;
+    }
+  }
+  return 0;
+}
+
+static void report_header(void) {
+  if (opt.format == FORMAT_TSV)
+    printf("corpus\tparser\trender\tdocs\tbytes\tstatus\twall_s\tuser_s\tsys_s"
+           "\tmb_per_s\tdocs_per_s\tpeak_rss_kb\tphase_wall_s\n");
+}
+
+static void report(const struct corpus *corpus, const char *parser,
+                   const char *render_mode, const struct result *result) {
+  double wall = result->wall > 0 ? result->wall : 1e-9;
+  double mb_per_s = corpus->bytes / 1e6 / wall;
+  double docs_per_s = corpus->docs / wall;
+
+  switch (opt.format) {
+  case FORMAT_JSON:
+    printf("{\"corpus\":\"%s\",\"parser\":\"%s\",\"render\":\"%s\","
+           "\"docs\":%ld,\"bytes\":%lld,\"status\":%d,"
+           "\"wall_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f,"
+           "\"mb_per_s\":%.3f,\"docs_per_s\":%.1f,\"peak_rss_kb\":%ld,"
+           "\"phases\":{",
+           corpus->name, parser, render_mode,
+           corpus->docs, corpus->bytes, result->status,
+           result->wall, result->user, result->sys,
+           mb_per_s, docs_per_s, result->max_rss);
+    for (int i = 0; i < result->num_phases; i++)
+      printf("%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f}", i ? "," : "",
+             result->phase[i].name, result->phase[i].wall, result->phase[i].cpu);
+    printf("}}\n");
+    break;
+  case FORMAT_TSV:
+    printf("%s\t%s\t%s\t%ld\t%lld\t%d\t%.6f\t%.6f\t%.6f\t%.3f\t%.1f\t%ld\t",
+           corpus->name, parser, render_mode,
+           corpus->docs, corpus->bytes, result->status,
+           result->wall, result->user, result->sys,
+           mb_per_s, docs_per_s, result->max_rss);
+    for (int i = 0; i < result->num_phases; i++)
+      printf("%s%s=%.6f", i ? "," : "", result->phase[i].name, result->phase[i].wall);
+    printf("\n");
+    break;
+  }
+  fflush(stdout);
+}
+
+static void usage(FILE *out) {
+  fprintf(out,
+          "usage: %s [OPTIONS] CORPUS [KIND...] [-- UNHTML-OPTIONS]\n\n"
+          "OPTIONS\n"
+          "  -unhtml=PATH    unhtml executable to run (default ./unhtml)\n"
+          "  -confdir=DIR    configuration directory to pass to unhtml\n"
+          "  -repeat=N       run each combination N times (default 3)\n"
+          "  -parser=PARSER  only run PARSER; may be repeated\n"
+          "  -render=MODE    only run render MODE; may be repeated\n"
+          "  -format=FORMAT  output json (default) or tsv\n",
+          program_invocation_short_name);
+}
+
+int main(int argc, char *argv[]) {
+  const struct option options[] = {
+    { "unhtml",  required_argument, 0, 'u' },
+    { "confdir", required_argument, 0, 'c' },
+    { "repeat",  required_argument, 0, 'n' },
+    { "parser",  required_argument, 0, 'p' },
+    { "render",  required_argument, 0, 'r' },
+    { "format",  required_argument, 0, 'f' },
+    { "help",    no_argument,       0, 'h' },
+    { nullptr }
+  };
+  struct corpus *corpora = nullptr;
+  int num_corpora;
+  int num_kinds;
+  int end_args;
+  int rc = 0;
+  int c;
+
+  opt.unhtml = "./unhtml";
+  opt.repeat = 3;
+
+  /* Options after -- are passed through to unhtml */
+  for (end_args = 1; end_args < argc && strcmp(argv[end_args], "--"); end_args++);
+  if (end_args < argc) {
+    opt.extra = argv + end_args + 1;
+    opt.num_extra = argc - end_args - 1;
+  }
+
+  while ((c = getopt_long_only(end_args, argv, "", options, nullptr)) != -1) {
+    switch (c) {
+    case 'u':
+      opt.unhtml = optarg;
+      break;
+    case 'c':
+      opt.confdir = optarg;
+      break;
+    case 'n':
+      if ((opt.repeat = atoi(optarg)) < 1) {
+        usage(stderr);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'p':
+      if (!add_name(&opt.parsers, optarg))
+        return EXIT_FAILURE;
+      break;
+    case 'r':
+      if (!add_name(&opt.render_modes, optarg))
+        return EXIT_FAILURE;
+      break;
+    case 'f':
+      if (!strcmp(optarg, "json"))
+        opt.format = FORMAT_JSON;
+      else if (!strcmp(optarg, "tsv"))
+        opt.format = FORMAT_TSV;
+      else {
+        usage(stderr);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'h':
+      usage(stdout);
+      return EXIT_SUCCESS;
+    default:
+      usage(stderr);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind >= end_args) {
+    usage(stderr);
+    return EXIT_FAILURE;
+  }
+
+  if (query_unhtml() != 0)
+    return EXIT_FAILURE;
+
+  {
+    const char *tmpdir = getenv("TMPDIR");
+    int fd;
+
+    if (asprintf(&opt.stats_file, "%s/unhtml-bench-XXXXXX",
+                 tmpdir ? tmpdir : "/tmp") == -1 ||
+        (fd = mkstemp(opt.stats_file)) == -1) {
+      fprintf(stderr, "could not create temporary file: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+    close(fd);
+  }
+
+  num_kinds = end_args - optind - 1;
+  num_corpora = find_corpora(argv[optind], argv + optind + 1, num_kinds, &corpora);
+  if (num_corpora <= 0) {
+    fprintf(stderr, "no corpus lists found in %s\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  report_header();
+  for (int i = 0; i < num_corpora && rc == 0; i++) {
+    for (int p = 0; p < opt.parsers.num && rc == 0; p++) {
+      for (int r = 0; r < opt.render_modes.num && rc == 0; r++) {
+        struct result result = {};
+
+        rc = run(corpora + i, opt.parsers.name[p], opt.render_modes.name[r], &result);
+        if (rc == 0)
+          report(corpora + i, opt.parsers.name[p], opt.render_modes.name[r], &result);
+      }
+    }
+  }
+
+  for (int i = 0; i < num_corpora; i++) {
+    free(corpora[i].name);
+    free(corpora[i].list);
+  }
+  free(corpora);
+  free_names(&opt.parsers);
+  free_names(&opt.render_modes);
+  unlink(opt.stats_file);
+  free(opt.stats_file);
+
+  return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
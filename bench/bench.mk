@@ -0,0 +1,35 @@
+# SPDX-License-Identifier: MIT
+# SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk>
+
+# Benchmarks run unhtml over a synthetic corpus generated locally. The
+# corpus is made once per scale; results are printed one per line.
+#   make bench BENCH_SCALE=4 BENCH_FORMAT=tsv BENCH_ARGS=-stream
+
+BENCH_DIR ?= bench/corpus
+BENCH_SCALE ?= 1
+BENCH_REPEAT ?= 3
+BENCH_FORMAT ?= json
+BENCH_KINDS ?=
+BENCH_ARGS ?=
+BENCH_TOOLS = bench/gencorpus bench/bench
+
+.PHONY: bench bench-corpus clean-bench
+
+$(BENCH_TOOLS): %: %.c
+	$(LINK.c) $< -o $@
+
+$(BENCH_DIR)/.scale-$(BENCH_SCALE): bench/gencorpus
+	./bench/gencorpus -scale $(BENCH_SCALE) $(BENCH_DIR)
+	$(RM) $(BENCH_DIR)/.scale-*
+	touch $@
+
+bench-corpus: $(BENCH_DIR)/.scale-$(BENCH_SCALE)
+
+bench: $(name) bench/bench bench-corpus
+	./bench/bench -unhtml ./$(name) -confdir default \
+	  -repeat $(BENCH_REPEAT) -format $(BENCH_FORMAT) \
+	  $(BENCH_DIR) $(BENCH_KINDS) $(if $(BENCH_ARGS),-- $(BENCH_ARGS))
+
+clean-bench:
+	$(RM) $(BENCH_TOOLS) $(BENCH_TOOLS:=.d)
+	$(RM) -r $(BENCH_DIR)
@@ -0,0 +1,380 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* gencorpus: generate a synthetic corpus of documents for benchmarking
+ *
+ * Each kind of document goes in its own subdirectory of the corpus
+ * directory, with a list of its files alongside for use with -files-from.
+ * The content comes from a fixed-seed generator so that every run produces
+ * the same corpus for a given scale.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct gen {
+  FILE *out;
+  uint64_t seed;
+};
+
+struct kind {
+  const char *name;
+  const char *ext;
+  /* Number of documents at scale 1 */
+  int count;
+  void (*write_fn)(struct gen *g, int scale);
+};
+
+static const char *words[] = {
+  "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was",
+  "with", "be", "by", "on", "not", "he", "this", "are", "or", "his", "from",
+  "at", "which", "but", "have", "an", "had", "they", "you", "were", "their",
+  "one", "all", "we", "can", "her", "has", "there", "been", "if", "more",
+  "when", "will", "would", "who", "so", "no", "document", "markup", "text",
+  "element", "parser", "render", "space", "paragraph", "heading", "table",
+  "extraction", "benchmark", "throughput", "corpus", "utility", "character",
+};
+static constexpr size_t num_words = sizeof words / sizeof *words;
+
+static const char *entities[] = {
+  "&amp;", "&lt;", "&gt;", "&quot;", "&nbsp;", "&eacute;", "&copy;",
+  "&mdash;", "&hellip;", "&euro;", "&#8217;", "&#x20AC;", "&#169;",
+  "&rarr;", "&frac12;", "&szlig;",
+};
+static constexpr size_t num_entities = sizeof entities / sizeof *entities;
+
+/* xorshift64* */
+static uint32_t rnd(struct gen *g) {
+  g->seed ^= g->seed >> 12;
+  g->seed ^= g->seed << 25;
+  g->seed ^= g->seed >> 27;
+  return (g->seed * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+static uint32_t between(struct gen *g, uint32_t lo, uint32_t hi) {
+  return lo + rnd(g) % (hi - lo + 1);
+}
+
+static void sentence(struct gen *g, int min, int max) {
+  int n = between(g, min, max);
+
+  for (int i = 0; i < n; i++)
+    fprintf(g->out, i ? " %s" : "%s", words[rnd(g) % num_words]);
+  fputc('.', g->out);
+}
+
+static void paragraph(struct gen *g) {
+  int n = between(g, 2, 6);
+
+  fputs("<p>", g->out);
+  for (int i = 0; i < n; i++) {
+    if (i)
+      fputc(' ', g->out);
+    if (rnd(g) % 4 == 0) {
+      fputs("<a href=\"#\">", g->out);
+      sentence(g, 2, 5);
+      fputs("</a>", g->out);
+    } else if (rnd(g) % 4 == 0) {
+      fputs("<em>", g->out);
+      sentence(g, 3, 10);
+      fputs("</em>", g->out);
+    } else {
+      sentence(g, 5, 20);
+    }
+  }
+  fputs("</p>\n", g->out);
+}
+
+static void html_head(struct gen *g, const char *charset) {
+  fprintf(g->out,
+          "<!DOCTYPE html>\n"
+          "<html>\n<head>\n<meta charset=\"%s\">\n<title>", charset);
+  sentence(g, 3, 8);
+  fputs("</title>\n</head>\n<body>\n", g->out);
+}
+
+static void html_tail(struct gen *g) {
+  fputs("</body>\n</html>\n", g->out);
+}
+
+/* Typical small pages with a mixture of block elements */
+static void write_small(struct gen *g, int scale) {
+  int blocks = between(g, 4, 24);
+
+  html_head(g, "utf-8");
+  fputs("<h1>", g->out);
+  sentence(g, 2, 6);
+  fputs("</h1>\n", g->out);
+  for (int i = 0; i < blocks; i++) {
+    switch (rnd(g) % 6) {
+    case 0:
+      fputs("<ul>\n", g->out);
+      for (int j = between(g, 2, 8); j; j--) {
+        fputs("<li>", g->out);
+        sentence(g, 2, 10);
+        fputs("</li>\n", g->out);
+      }
+      fputs("</ul>\n", g->out);
+      break;
+    case 1:
+      fputs("<table>\n", g->out);
+      for (int j = between(g, 2, 6); j; j--) {
+        fputs("<tr>", g->out);
+        for (int k = 0; k < 4; k++) {
+          fputs("<td>", g->out);
+          sentence(g, 1, 3);
+          fputs("</td>", g->out);
+        }
+        fputs("</tr>\n", g->out);
+      }
+      fputs("</table>\n", g->out);
+      break;
+    case 2:
+      fputs("<h2>", g->out);
+      sentence(g, 2, 6);
+      fputs("</h2>\n", g->out);
+      break;
+    default:
+      paragraph(g);
+    }
+  }
+  html_tail(g);
+}
+
+/* Very large documents of many sibling paragraphs */
+static void write_flat(struct gen *g, int scale) {
+  html_head(g, "utf-8");
+  for (int i = 0; i < 10000 * scale; i++)
+    paragraph(g);
+  html_tail(g);
+}
+
+/* Pathologically deep nesting */
+static void write_deep(struct gen *g, int scale) {
+  int depth = 20000 * scale;
+
+  html_head(g, "utf-8");
+  for (int i = 0; i < depth; i++) {
+    fputs(i % 2 ? "<span>" : "<div>", g->out);
+    if (rnd(g) % 8 == 0)
+      sentence(g, 1, 4);
+  }
+  for (int i = depth - 1; i >= 0; i--)
+    fputs(i % 2 ? "</span>" : "</div>", g->out);
+  fputc('\n', g->out);
+  html_tail(g);
+}
+
+/* Text dense with named and numeric character references */
+static void write_entities(struct gen *g, int scale) {
+  html_head(g, "utf-8");
+  for (int i = 0; i < 200; i++) {
+    fputs("<p>", g->out);
+    for (int j = between(g, 20, 60); j; j--) {
+      if (rnd(g) % 2)
+        fputs(entities[rnd(g) % num_entities], g->out);
+      else
+        fprintf(g->out, "%s ", words[rnd(g) % num_words]);
+    }
+    fputs("</p>\n", g->out);
+  }
+  html_tail(g);
+}
+
+/* Pages that are mostly script and style, which are skipped */
+static void write_script(struct gen *g, int scale) {
+  html_head(g, "utf-8");
+  fputs("<style>\n", g->out);
+  for (int i = between(g, 100, 400); i; i--)
+    fprintf(g->out, ".c%u { margin: %upx; color: #%06x; }\n",
+            rnd(g) % 1000, rnd(g) % 40, rnd(g) & 0xffffff);
+  fputs("</style>\n", g->out);
+  for (int i = between(g, 2, 6); i; i--) {
+    fputs("<script>\n", g->out);
+    for (int j = between(g, 50, 200); j; j--)
+      fprintf(g->out, "var v%u = document.getElementById(\"e%u\") && %u < %u;\n",
+              rnd(g) % 1000, rnd(g) % 1000, rnd(g) % 100, rnd(g) % 100);
+    fputs("</script>\n", g->out);
+    paragraph(g);
+  }
+  html_tail(g);
+}
+
+/* Well-formed XHTML with an internal DTD subset declaring entities */
+static void write_xhtml(struct gen *g, int scale) {
+  fputs("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+        "<!DOCTYPE html [\n"
+        "  <!ENTITY nbsp \"&#160;\">\n"
+        "  <!ENTITY eacute \"&#233;\">\n"
+        "  <!ENTITY product \"unhtml\">\n"
+        "]>\n"
+        "<html xmlns=\"http://www.w3.org/1999/xhtml\">\n"
+        "<head><title>", g->out);
+  sentence(g, 3, 8);
+  fputs("</title></head>\n<body>\n", g->out);
+  for (int i = between(g, 20, 80); i; i--) {
+    fputs("<p>", g->out);
+    sentence(g, 5, 20);
+    fputs(" &product;&nbsp;caf&eacute; <![CDATA[a < b && c > d]]> ", g->out);
+    sentence(g, 5, 20);
+    fputs("</p>\n", g->out);
+  }
+  fputs("</body>\n</html>\n", g->out);
+}
+
+/* ISO-8859-1 pages declaring their charset */
+static void write_latin1(struct gen *g, int scale) {
+  html_head(g, "iso-8859-1");
+  for (int i = between(g, 4, 16); i; i--) {
+    fputs("<p>", g->out);
+    for (int j = between(g, 10, 40); j; j--) {
+      fputs(words[rnd(g) % num_words], g->out);
+      /* Accented letters in the upper half of Latin-1 */
+      if (rnd(g) % 3 == 0)
+        fputc(0xe0 + rnd(g) % 0x1f, g->out);
+      fputc(' ', g->out);
+    }
+    fputs("</p>\n", g->out);
+  }
+  html_tail(g);
+}
+
+static const struct kind kinds[] = {
+  { "small",    "html",  2000, write_small },
+  { "flat",     "html",     4, write_flat },
+  { "deep",     "html",     8, write_deep },
+  { "entities", "html",   200, write_entities },
+  { "script",   "html",   500, write_script },
+  { "xhtml",    "xhtml",  200, write_xhtml },
+  { "latin1",   "html",   500, write_latin1 },
+};
+static constexpr size_t num_kinds = sizeof kinds / sizeof *kinds;
+
+static int write_kind(const char *dir, const struct kind *kind, int scale) {
+  struct gen g = { .seed = 0x9e3779b97f4a7c15ull };
+  char *path = nullptr;
+  FILE *list = nullptr;
+  int count = kind->count;
+  int size = scale;
+  int rc = 1;
+
+  /* Small documents scale in number, large ones in size */
+  if (kind->count > 100) {
+    count *= scale;
+    size = 1;
+  }
+
+  if (asprintf(&path, "%s/%s", dir, kind->name) == -1) {
+    path = nullptr;
+    goto fail;
+  }
+  if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+  free(path);
+
+  if (asprintf(&path, "%s/%s.list", dir, kind->name) == -1) {
+    path = nullptr;
+    goto fail;
+  }
+  if ((list = fopen(path, "w")) == nullptr) {
+    fprintf(stderr, "could not create %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  for (int i = 0; i < count; i++) {
+    free(path);
+    if (asprintf(&path, "%s/%s/%05d.%s", dir, kind->name, i, kind->ext) == -1) {
+      path = nullptr;
+      goto fail;
+    }
+    if ((g.out = fopen(path, "w")) == nullptr) {
+      fprintf(stderr, "could not create %s: %s\n", path, strerror(errno));
+      goto fail;
+    }
+    kind->write_fn(&g, size);
+    if (fclose(g.out) == EOF) {
+      fprintf(stderr, "error writing %s: %s\n", path, strerror(errno));
+      goto fail;
+    }
+    fprintf(list, "%s\n", path);
+  }
+  rc = 0;
+
+fail:
+  if (list && fclose(list) == EOF)
+    rc = 1;
+  free(path);
+  return rc;
+}
+
+static void usage(FILE *out) {
+  fprintf(out, "usage: %s [-scale=N] [-kind=KIND]... DIR\n", program_invocation_short_name);
+  fprintf(out, "Kinds:\n");
+  for (size_t i = 0; i < num_kinds; i++)
+    fprintf(out, "  %s\n", kinds[i].name);
+}
+
+int main(int argc, char *argv[]) {
+  const struct option options[] = {
+    { "scale", required_argument, 0, 's' },
+    { "kind",  required_argument, 0, 'k' },
+    { "help",  no_argument,       0, 'h' },
+    { nullptr }
+  };
+  bool selected[num_kinds] = {};
+  bool any = false;
+  int scale = 1;
+  int rc = 0;
+  int c;
+
+  while ((c = getopt_long_only(argc, argv, "", options, nullptr)) != -1) {
+    switch (c) {
+    case 's':
+      if ((scale = atoi(optarg)) < 1) {
+        usage(stderr);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'k':
+      {
+        size_t i;
+        for (i = 0; i < num_kinds && strcmp(kinds[i].name, optarg); i++);
+        if (i == num_kinds) {
+          usage(stderr);
+          return EXIT_FAILURE;
+        }
+        selected[i] = any = true;
+      }
+      break;
+    case 'h':
+      usage(stdout);
+      return EXIT_SUCCESS;
+    default:
+      usage(stderr);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind + 1 != argc) {
+    usage(stderr);
+    return EXIT_FAILURE;
+  }
+
+  if (mkdir(argv[optind], 0777) == -1 && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", argv[optind], strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < num_kinds && rc == 0; i++)
+    if (!any || selected[i])
+      rc = write_kind(argv[optind], kinds + i, scale);
+
+  return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,740 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Character encodings
+ *
+ * Input is converted to UTF-8 before it is parsed, so that every parser may
+ * rely on it. The encoding is determined much as HTML5 does: from a byte
+ * order mark, else from a charset given by the user as if by the
+ * Content-Type header, else from a <meta> element or XML declaration near
+ * the start. Undeclared input is taken to be UTF-8 if it is mostly valid
+ * UTF-8 and Windows-1252 otherwise.
+ *
+ * UTF-8 is validated 16 bytes at a time while it is ASCII, and is copied
+ * only to replace invalid sequences with U+FFFD. Windows-1252, which also
+ * stands for ISO-8859-1 and ASCII, is converted by table, again copying
+ * ASCII 16 bytes at a time. Any other encoding is converted with iconv.
+ */
+
+#include <errno.h>
+#include <iconv.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <uchar.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "unhtml.h"
+#include "load.h"
+#include "charset.h"
+
+/* Amount of input searched for a declaration of its encoding */
+static constexpr size_t prescan_window = 1024;
+
+static const char utf8_name[] = "UTF-8";
+static const char windows_1252_name[] = "windows-1252";
+
+static const char replacement[] = "\xef\xbf\xbd";
+
+/* Code points of the bytes 0x80 to 0x9f in Windows-1252; other bytes stand
+ * for the code points of the same value */
+static const char16_t windows_1252[32] = {
+  0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+  0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+  0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+  0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178,
+};
+
+/* Labels of the encodings not left to iconv, and of those iconv knows by
+ * another name, following the WHATWG Encoding Standard */
+static const struct {
+  const char *label;
+  const char *name;
+} labels[] = {
+  { "utf-8",             utf8_name },
+  { "utf8",              utf8_name },
+  { "unicode-1-1-utf-8", utf8_name },
+  { "windows-1252",      windows_1252_name },
+  { "cp1252",            windows_1252_name },
+  { "x-cp1252",          windows_1252_name },
+  { "iso-8859-1",        windows_1252_name },
+  { "iso8859-1",         windows_1252_name },
+  { "iso_8859-1",        windows_1252_name },
+  { "latin1",            windows_1252_name },
+  { "l1",                windows_1252_name },
+  { "ascii",             windows_1252_name },
+  { "us-ascii",          windows_1252_name },
+  { "utf-16",            "UTF-16LE" },
+  { "utf-16le",          "UTF-16LE" },
+  { "utf-16be",          "UTF-16BE" },
+  { "shift_jis",         "CP932" },
+  { "shift-jis",         "CP932" },
+  { "sjis",              "CP932" },
+  { "x-sjis",            "CP932" },
+  { "ms_kanji",          "CP932" },
+  { "windows-31j",       "CP932" },
+  { "gb2312",            "GBK" },
+  { "gbk",               "GBK" },
+  { "x-gbk",             "GBK" },
+  { "euc-kr",            "CP949" },
+  { "ks_c_5601-1987",    "CP949" },
+  { "iso-8859-8-i",      "ISO-8859-8" },
+};
+
+static inline bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+static inline bool is_alpha(char c) {
+  return (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+}
+
+static inline bool is_utf16(const char *name) {
+  return !strncmp(name, "UTF-16", 6);
+}
+
+static const char *skip_space(const char *p, const char *end) {
+  for (; p < end && is_space(*p); p++);
+  return p;
+}
+
+/* Name the encoding with the given label, using 'buf' for any name left to
+ * iconv, or return null if the label is not plausible */
+static const char *normalise(const char *label, size_t len, char *buf) {
+  size_t i;
+
+  for (; len && is_space(*label); label++, len--);
+  for (; len && is_space(label[len - 1]); len--);
+  if (len == 0 || len >= CHARSET_MAX_LABEL)
+    return nullptr;
+
+  for (i = 0; i < len; i++) {
+    if ((unsigned char) label[i] <= ' ' || (unsigned char) label[i] >= 0x7f)
+      return nullptr;
+    buf[i] = label[i] >= 'A' && label[i] <= 'Z' ? label[i] | 0x20 : label[i];
+  }
+  buf[i] = '\0';
+
+  for (i = 0; i < sizeof labels / sizeof *labels; i++)
+    if (!strcmp(buf, labels[i].label))
+      return labels[i].name;
+  return buf;
+}
+
+/* Read the attribute at 'p' of a tag, as the HTML5 prescan does, returning
+ * false at the end of the tag */
+static bool attribute(const char **pp, const char *end,
+                      const char **name, size_t *name_len,
+                      const char **value, size_t *value_len) {
+  const char *p = *pp;
+
+  for (; p < end && (is_space(*p) || *p == '/'); p++);
+  if (p == end || *p == '>') {
+    *pp = p;
+    return false;
+  }
+
+  /* An attribute's name may start with '=' */
+  *name = p++;
+  for (; p < end && !is_space(*p) && *p != '=' && *p != '/' && *p != '>'; p++);
+  *name_len = p - *name;
+  *value = p;
+  *value_len = 0;
+
+  p = skip_space(p, end);
+  if (p < end && *p == '=') {
+    p = skip_space(p + 1, end);
+    if (p < end && (*p == '"' || *p == '\'')) {
+      char quote = *p++;
+
+      *value = p;
+      for (; p < end && *p != quote; p++);
+      *value_len = p - *value;
+      if (p < end)
+        p++;
+    } else {
+      *value = p;
+      for (; p < end && !is_space(*p) && *p != '>'; p++);
+      *value_len = p - *value;
+    }
+  }
+
+  *pp = p;
+  return true;
+}
+
+static inline bool is(const char *str, size_t len, const char *lit) {
+  return len == strlen(lit) && !strncasecmp(str, lit, len);
+}
+
+/* Find the charset given in the content of a Content-Type pragma */
+static bool content_charset(const char *p, const char *end,
+                            const char **charset, size_t *len) {
+  const char *q;
+
+  while ((q = memmem(p, end - p, "charset", 7)) ||
+         (q = memmem(p, end - p, "CHARSET", 7))) {
+    p = skip_space(q + 7, end);
+    if (p == end || *p != '=')
+      continue;
+    p = skip_space(p + 1, end);
+    if (p < end && (*p == '"' || *p == '\'')) {
+      if ((q = memchr(p + 1, *p, end - p - 1)) == nullptr)
+        return false;
+      *charset = p + 1;
+      *len = q - p - 1;
+    } else {
+      for (q = p; q < end && !is_space(*q) && *q != ';'; q++);
+      *charset = p;
+      *len = q - p;
+    }
+    return *len != 0;
+  }
+  return false;
+}
+
+/* Look at the attributes of a <meta> element for its charset, returning
+ * where to continue */
+static const char *meta(const char *p, const char *end, char *label,
+                        const char **name) {
+  const char *attr, *value, *charset = nullptr, *content = nullptr;
+  size_t attr_len, value_len, charset_len = 0, content_len = 0;
+  bool pragma = false;
+
+  while (attribute(&p, end, &attr, &attr_len, &value, &value_len)) {
+    if (is(attr, attr_len, "http-equiv"))
+      pragma = pragma || is(value, value_len, "content-type");
+    else if (is(attr, attr_len, "charset") && !charset)
+      charset = value, charset_len = value_len;
+    else if (is(attr, attr_len, "content") && !content)
+      content_charset(value, value + value_len, &content, &content_len);
+  }
+
+  if (charset)
+    *name = normalise(charset, charset_len, label);
+  else if (pragma && content)
+    *name = normalise(content, content_len, label);
+
+  return p < end ? p + 1 : end;
+}
+
+/* The encoding declared in an XML declaration at the very start */
+static const char *xml_declaration(const char *p, const char *end, char *label) {
+  const char *decl_end, *attr, *value;
+  size_t attr_len, value_len;
+
+  if ((decl_end = memmem(p, end - p, "?>", 2)) == nullptr)
+    return nullptr;
+
+  for (p += 5; attribute(&p, decl_end, &attr, &attr_len, &value, &value_len);)
+    if (is(attr, attr_len, "encoding"))
+      return normalise(value, value_len, label);
+  return nullptr;
+}
+
+/* Search the start of the input for a declaration of its encoding, much as
+ * the HTML5 prescan does */
+static const char *prescan(const char *p, size_t len, char *label) {
+  const char *end = p + (len < prescan_window ? len : prescan_window);
+  const char *name = nullptr;
+  const char *q;
+
+  if (end - p >= 6 && !memcmp(p, "<?xml", 5) && is_space(p[5]))
+    return xml_declaration(p, end, label);
+
+  while (p < end && !name) {
+    if (*p != '<') {
+      if ((p = memchr(p, '<', end - p)) == nullptr)
+        break;
+      continue;
+    }
+
+    if (end - p >= 4 && !memcmp(p, "<!--", 4)) {
+      q = memmem(p + 2, end - p - 2, "-->", 3);
+      p = q ? q + 3 : end;
+    } else if (end - p >= 6 && !strncasecmp(p, "<meta", 5) &&
+               (is_space(p[5]) || p[5] == '/')) {
+      p = meta(p + 5, end, label, &name);
+    } else if (end - p >= 3 && (is_alpha(p[1]) || (p[1] == '/' && is_alpha(p[2])))) {
+      const char *attr, *value;
+      size_t attr_len, value_len;
+
+      for (p += 2; p < end && !is_space(*p) && *p != '>'; p++);
+      while (attribute(&p, end, &attr, &attr_len, &value, &value_len));
+      p = p < end ? p + 1 : end;
+    } else if (end - p >= 2 && (p[1] == '!' || p[1] == '/' || p[1] == '?')) {
+      q = memchr(p, '>', end - p);
+      p = q ? q + 1 : end;
+    } else {
+      p++;
+    }
+  }
+
+  return name;
+}
+
+/* Determine the encoding of the input, if it is known, and the length of
+ * any byte order mark. 'label' holds the name of an encoding left to
+ * iconv. */
+const char *sniff_charset(const char *data, size_t len, const char *hint,
+                          size_t *bom_len, char *label) {
+  const char *name;
+
+  *bom_len = 0;
+  if (len >= 3 && !memcmp(data, "\xef\xbb\xbf", 3)) {
+    *bom_len = 3;
+    return utf8_name;
+  }
+  if (len >= 2 && !memcmp(data, "\xff\xfe", 2)) {
+    *bom_len = 2;
+    return "UTF-16LE";
+  }
+  if (len >= 2 && !memcmp(data, "\xfe\xff", 2)) {
+    *bom_len = 2;
+    return "UTF-16BE";
+  }
+
+  if (hint && (name = normalise(hint, strlen(hint), label)))
+    return name;
+
+  /* A declaration that could be read as ASCII cannot have been UTF-16 */
+  if ((name = prescan(data, len, label)) && is_utf16(name))
+    name = utf8_name;
+  return name;
+}
+
+/* Converted text accumulating in a buffer */
+struct sink {
+  struct mapped_buffer map;
+  size_t len;
+  size_t max;
+};
+
+static int grow(struct sink *s, size_t want) {
+  size_t size = s->map.mapped;
+  void *data;
+
+  while (size < want)
+    size = size ? size << 1 : 0x10000;
+  if (size > s->max)
+    size = s->max;
+  if (size < want) {
+    fprintf(stderr, "input too big once converted to UTF-8 (>%zd)\n", s->max);
+    return 1;
+  }
+
+  if (s->map.data)
+    data = mremap(s->map.data, s->map.mapped, size, MREMAP_MAYMOVE);
+  else
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "failed to map buffer for converted input, %s\n",
+            strerror(errno));
+    return 1;
+  }
+
+  s->map.data = data;
+  s->map.mapped = size;
+  return 0;
+}
+
+/* Make room for 'n' more bytes and the zero terminator */
+static inline int reserve(struct sink *s, size_t n) {
+  return s->len + n + 1 > s->map.mapped ? grow(s, s->len + n + 1) : 0;
+}
+
+static inline void put(struct sink *s, const void *data, size_t len) {
+  memcpy(s->map.data + s->len, data, len);
+  s->len += len;
+}
+
+/* Length of the valid UTF-8 sequence at 'p', or else zero with the length
+ * of the invalid part of it to replace at 'skip' */
+static size_t utf8_sequence(const unsigned char *p, const unsigned char *end,
+                            size_t *skip) {
+  unsigned char lo = 0x80, hi = 0xbf;
+  size_t n;
+
+  if (*p < 0x80)
+    return 1;
+  if (*p >= 0xc2 && *p <= 0xdf) {
+    n = 2;
+  } else if (*p >= 0xe0 && *p <= 0xef) {
+    n = 3;
+    if (*p == 0xe0)
+      lo = 0xa0;
+    else if (*p == 0xed)
+      hi = 0x9f;
+  } else if (*p >= 0xf0 && *p <= 0xf4) {
+    n = 4;
+    if (*p == 0xf0)
+      lo = 0x90;
+    else if (*p == 0xf4)
+      hi = 0x8f;
+  } else {
+    *skip = 1;
+    return 0;
+  }
+
+  for (size_t i = 1; i < n; i++) {
+    if (p + i == end || p[i] < lo || p[i] > hi) {
+      *skip = i;
+      return 0;
+    }
+    lo = 0x80;
+    hi = 0xbf;
+  }
+  return n;
+}
+
+/* Find the end of the valid UTF-8 at the start of the text */
+static const char *valid_utf8(const char *text, const char *text_end) {
+  const unsigned char *p = (const unsigned char *) text;
+  const unsigned char *end = (const unsigned char *) text_end;
+  size_t n, skip;
+
+  while (p < end) {
+#ifdef __SSE2__
+    if (end - p >= 16 &&
+        !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *) p))) {
+      p += 16;
+      continue;
+    }
+#endif
+    if ((n = utf8_sequence(p, end, &skip)) == 0)
+      break;
+    p += n;
+  }
+  return (const char *) p;
+}
+
+/* Whether there are more valid multi-byte sequences than invalid ones */
+static bool mostly_utf8(const char *text, const char *text_end) {
+  const unsigned char *p = (const unsigned char *) text;
+  const unsigned char *end = (const unsigned char *) text_end;
+  size_t valid = 0, invalid = 0;
+  size_t n, skip;
+
+  while (p < end) {
+#ifdef __SSE2__
+    if (end - p >= 16 &&
+        !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *) p))) {
+      p += 16;
+      continue;
+    }
+#endif
+    if ((n = utf8_sequence(p, end, &skip)) == 0) {
+      invalid++;
+      p += skip;
+    } else {
+      valid += n > 1;
+      p += n;
+    }
+  }
+  return valid > invalid;
+}
+
+/* The encoding of input for a parser that decodes it itself as it arrives,
+ * judged as by charset_to_utf8() but from only as much as has been read */
+const char *stream_charset(const struct mapped_buffer *input,
+                           const char *hint, size_t *bom_len, char *label) {
+  const char *data = input->data;
+  const char *end = data + (input->length ? input->length - 1 : 0);
+  const char *name;
+
+  if ((name = sniff_charset(data, end - data, hint, bom_len, label)))
+    return name;
+
+  /* What has been read may end part way through a character */
+  return end - valid_utf8(data, end) < 4 || mostly_utf8(data, end) ?
+         utf8_name : windows_1252_name;
+}
+
+static int repair_utf8(struct sink *s, const char *p, const char *end) {
+  const char *valid;
+  size_t skip;
+
+  while (p < end) {
+    valid = valid_utf8(p, end);
+    if (reserve(s, valid - p + sizeof replacement - 1) != 0)
+      return 1;
+    put(s, p, valid - p);
+    if (valid == end)
+      break;
+    utf8_sequence((const unsigned char *) valid, (const unsigned char *) end, &skip);
+    put(s, replacement, sizeof replacement - 1);
+    p = valid + skip;
+  }
+  return 0;
+}
+
+/* Convert as much of 'in' as fits in 'out', replacing invalid sequences as
+ * repair_utf8() does, in the manner of a libxml input conversion function.
+ * A sequence cut short by the end of 'in' is left for the next call. */
+int utf8_repair_decode(unsigned char *out, int *out_len,
+                       const unsigned char *in, int *in_len) {
+  const unsigned char *p = in;
+  const unsigned char *end = in + *in_len;
+  unsigned char *q = out;
+  unsigned char *q_end = out + *out_len;
+  size_t n, skip;
+
+  while (p < end) {
+#ifdef __SSE2__
+    if (end - p >= 16 && q_end - q >= 16 &&
+        !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *) p))) {
+      memcpy(q, p, 16);
+      p += 16;
+      q += 16;
+      continue;
+    }
+#endif
+    if ((n = utf8_sequence(p, end, &skip)) == 0) {
+      if (p + skip == end && *p >= 0xc2 && *p <= 0xf4)
+        break;
+      if (q_end - q < (ptrdiff_t) sizeof replacement - 1)
+        break;
+      memcpy(q, replacement, sizeof replacement - 1);
+      q += sizeof replacement - 1;
+      p += skip;
+    } else {
+      if (q_end - q < (ptrdiff_t) n)
+        break;
+      memcpy(q, p, n);
+      q += n;
+      p += n;
+    }
+  }
+
+  *in_len = p - in;
+  *out_len = q - out;
+  return *out_len;
+}
+
+/* Write the UTF-8 for the byte 'b' in Windows-1252, of at most 3 bytes,
+ * returning its length */
+static inline size_t windows_1252_char(unsigned char *out, unsigned char b) {
+  char16_t c = b >= 0x80 && b < 0xa0 ? windows_1252[b - 0x80] : b;
+
+  if (c < 0x80) {
+    out[0] = c;
+    return 1;
+  } else if (c < 0x800) {
+    out[0] = 0xc0 | c >> 6;
+    out[1] = 0x80 | (c & 0x3f);
+    return 2;
+  } else {
+    out[0] = 0xe0 | c >> 12;
+    out[1] = 0x80 | (c >> 6 & 0x3f);
+    out[2] = 0x80 | (c & 0x3f);
+    return 3;
+  }
+}
+
+static int from_windows_1252(struct sink *s, const char *text, const char *text_end) {
+  const unsigned char *p = (const unsigned char *) text;
+  const unsigned char *end = (const unsigned char *) text_end;
+
+  while (p < end) {
+    /* Enough for 16 bytes of input */
+    if (reserve(s, 48) != 0)
+      return 1;
+
+#ifdef __SSE2__
+    if (end - p >= 16 &&
+        !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *) p))) {
+      put(s, p, 16);
+      p += 16;
+      continue;
+    }
+#endif
+
+    s->len += windows_1252_char((unsigned char *) s->map.data + s->len, *p++);
+  }
+  return 0;
+}
+
+/* Convert as much of the Windows-1252 'in' as fits in 'out', in the manner
+ * of a libxml input conversion function, updating the lengths to those
+ * converted. Unlike iconv, this takes every byte, as does conversion of
+ * the whole input. */
+int windows_1252_decode(unsigned char *out, int *out_len,
+                        const unsigned char *in, int *in_len) {
+  const unsigned char *p = in;
+  const unsigned char *end = in + *in_len;
+  unsigned char *q = out;
+
+  while (p < end && out + *out_len - q >= 3)
+    q += windows_1252_char(q, *p++);
+
+  *in_len = p - in;
+  *out_len = q - out;
+  return *out_len;
+}
+
+/* The reverses of the above, which libxml uses to count how much of the
+ * input it has consumed. Replacements of invalid UTF-8 are counted as if
+ * they had been valid, and characters not in Windows-1252 become '?'. */
+int utf8_encode(unsigned char *out, int *out_len,
+                const unsigned char *in, int *in_len) {
+  if (*in_len > *out_len)
+    *in_len = *out_len;
+  memcpy(out, in, *in_len);
+  *out_len = *in_len;
+  return *out_len;
+}
+
+int windows_1252_encode(unsigned char *out, int *out_len,
+                        const unsigned char *in, int *in_len) {
+  const unsigned char *p = in;
+  const unsigned char *end = in + *in_len;
+  unsigned char *q = out;
+  unsigned char *q_end = out + *out_len;
+  size_t n, skip;
+
+  while (p < end && q < q_end) {
+    char32_t c;
+
+    if ((n = utf8_sequence(p, end, &skip)) == 0) {
+      if (p + skip == end && *p >= 0xc2 && *p <= 0xf4)
+        break;
+      *q++ = '?';
+      p += skip;
+      continue;
+    }
+
+    c = n == 1 ? p[0] :
+        n == 2 ? (p[0] & 0x1f) << 6 | (p[1] & 0x3f) :
+        n == 3 ? (p[0] & 0x0f) << 12 | (p[1] & 0x3f) << 6 | (p[2] & 0x3f) :
+        0x10000;
+    p += n;
+
+    *q = c < 0x80 || (c >= 0xa0 && c < 0x100) ? c : '?';
+    for (int i = 0; c >= 0x80 && c < 0x10000 && i < 32; i++)
+      if (windows_1252[i] == c)
+        *q = 0x80 + i;
+    q++;
+  }
+
+  *in_len = p - in;
+  *out_len = q - out;
+  return *out_len;
+}
+
+/* Convert with iconv, returning -1 if it does not know the encoding */
+static int from_iconv(struct sink *s, const char *name, const char *p, size_t len) {
+  size_t unit = is_utf16(name) ? 2 : 1;
+  char *in = (char *) p;
+  size_t left = len;
+  bool flushed = false;
+  iconv_t cd;
+  int rc = 1;
+
+  if ((cd = iconv_open(utf8_name, name)) == (iconv_t) -1)
+    return -1;
+
+  while (!flushed) {
+    char *out = s->map.data + s->len;
+    size_t room = s->map.mapped - s->len - 1;
+    size_t done;
+
+    /* Finish by returning to the initial shift state */
+    if (left) {
+      done = iconv(cd, &in, &left, &out, &room);
+    } else {
+      done = iconv(cd, nullptr, nullptr, &out, &room);
+      flushed = done != (size_t) -1;
+    }
+    s->len = out - s->map.data;
+    if (done != (size_t) -1)
+      continue;
+
+    if (errno == E2BIG) {
+      if (grow(s, s->map.mapped + 1) != 0)
+        goto finish;
+      continue;
+    }
+
+    /* An invalid sequence, or an incomplete one at the end */
+    if (reserve(s, sizeof replacement - 1) != 0)
+      goto finish;
+    put(s, replacement, sizeof replacement - 1);
+    done = left < unit ? left : unit;
+    in += done;
+    left -= done;
+  }
+  rc = 0;
+
+finish:
+  iconv_close(cd);
+  return rc;
+}
+
+/* Provide the input as UTF-8 at 'utf8', which is either a view of the input
+ * or, if '*converted' is set, a new buffer to be freed by the caller */
+int charset_to_utf8(const struct mapped_buffer *input, size_t max,
+                    const char *hint, struct mapped_buffer *utf8,
+                    bool *converted) {
+  const char *data = input->data;
+  size_t len = input->length ? input->length - 1 : 0;
+  char label[CHARSET_MAX_LABEL];
+  struct sink s = { .max = max };
+  const char *name;
+  size_t bom_len;
+  int rc;
+
+  name = sniff_charset(data, len, hint, &bom_len, label);
+  data += bom_len;
+  len -= bom_len;
+
+  if (!name || name == utf8_name) {
+    if (valid_utf8(data, data + len) == data + len) {
+      logvv("input is valid UTF-8\n");
+      *utf8 = (struct mapped_buffer) {
+        .data = (char *) data,
+        .length = len + 1,
+        .fd = -1,
+        .uri = input->uri,
+        .utf8 = true,
+      };
+      *converted = false;
+      return 0;
+    }
+    if (!name)
+      name = mostly_utf8(data, data + len) ? utf8_name : windows_1252_name;
+  }
+
+  /* Most input converts to about its own length */
+  s.map.fd = -1;
+  if (grow(&s, len + len / 2 + 1) != 0)
+    return 1;
+
+  if (name == utf8_name) {
+    rc = repair_utf8(&s, data, data + len);
+  } else if (name == windows_1252_name) {
+    rc = from_windows_1252(&s, data, data + len);
+  } else if ((rc = from_iconv(&s, name, data, len)) == -1) {
+    logv("unknown charset %s, assuming %s\n", name, windows_1252_name);
+    name = windows_1252_name;
+    rc = from_windows_1252(&s, data, data + len);
+  }
+
+  if (rc != 0) {
+    free_map(&s.map);
+    return 1;
+  }
+
+  logv("converted input from %s to UTF-8\n", name);
+  s.map.data[s.len] = '\0';
+  s.map.length = s.len + 1;
+  s.map.uri = input->uri;
+  s.map.utf8 = true;
+  *utf8 = s.map;
+  *converted = true;
+  return 0;
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _CHARSET_H
+#define _CHARSET_H
+
+#include "load.h"
+
+/* Longest character encoding label recognised */
+#define CHARSET_MAX_LABEL 40
+
+extern const char *sniff_charset(const char *data, size_t len, const char *hint,
+                                 size_t *bom_len, char *label);
+extern const char *stream_charset(const struct mapped_buffer *input,
+                                  const char *hint, size_t *bom_len,
+                                  char *label);
+extern int utf8_repair_decode(unsigned char *out, int *out_len,
+                              const unsigned char *in, int *in_len);
+extern int windows_1252_decode(unsigned char *out, int *out_len,
+                               const unsigned char *in, int *in_len);
+extern int utf8_encode(unsigned char *out, int *out_len,
+                       const unsigned char *in, int *in_len);
+extern int windows_1252_encode(unsigned char *out, int *out_len,
+                               const unsigned char *in, int *in_len);
+extern int charset_to_utf8(const struct mapped_buffer *input, size_t max,
+                           const char *hint, struct mapped_buffer *utf8,
+                           bool *converted);
+
+#endif
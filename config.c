@@ -10,7 +10,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <uchar.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
@@ -21,6 +24,59 @@ struct config config;
 
 static const char8_t *config_ns = u8"tag:sw.cdefg.uk,2024:unhtml/config";
 
+/* Compiled configuration
+ *
+ * The merged element rules are compiled into a flat table that is cached on
+ * disk and mapped read-only by subsequent runs while none of the config
+ * files it was compiled from have changed. The layout is native to the host
+ * and the table is only valid for the version of unhtml that wrote it, with
+ * the same size and alignment of element records, and is checked throughout
+ * before it is used.
+ *
+ *   header
+ *   sources     struct cache_source and path for each config file
+ *   index       offsets of element records, sorted by tag
+ *   elements    struct render_elem records
+ */
+
+static const char cache_magic[8] = "UNHTMLC";
+static constexpr uint32_t cache_format = 2;
+static constexpr size_t cache_align = alignof(struct render_elem) > 8 ?
+                                      alignof(struct render_elem) : 8;
+
+struct cache_header {
+  char magic[sizeof cache_magic];
+  uint32_t format;
+  uint32_t num_sources;
+  uint32_t num_elems;
+  uint32_t index_offset;
+  /* Layout of struct render_elem */
+  uint32_t elem_size;
+  uint32_t elem_align;
+  uint64_t size;
+  char version[32];
+};
+
+struct cache_source {
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+  uint32_t path_len;
+  char path[];
+};
+
+static inline size_t cache_aligned(size_t size) {
+  return (size + cache_align - 1) & ~(cache_align - 1);
+}
+
+static inline size_t cache_source_size(size_t path_len) {
+  return cache_aligned(sizeof(struct cache_source) + path_len + 1);
+}
+
+static inline size_t cache_elem_size(size_t tag_len) {
+  return cache_aligned(sizeof(struct render_elem) + tag_len + 1);
+}
+
 static int element_compar(const void *a, const void *b) {
   struct render_elem *aa = (struct render_elem *) a;
   struct render_elem *bb = (struct render_elem *) b;
@@ -41,8 +97,10 @@ static enum spacing get_spacing(xmlNode *node) {
     return SPACING_PARA;
   else if (!xmlStrcmp(attr, u8"newline"))
     return SPACING_NEWLINE;
+  else if (!xmlStrcmp(attr, u8"space"))
+    return SPACING_SPACE;
   else
-    return OP_ADD;
+    return SPACING_NONE;
 }
 
 static bool get_skip(xmlNode *node) {
@@ -53,23 +111,15 @@ static bool get_skip(xmlNode *node) {
     return false;
 }
 
-static void print_action(const void *node, VISIT which, int depth) {
-  struct render_elem *r;
-
-  switch (which) {
-  case postorder:
-  case leaf:
-    r = *((struct render_elem **) node);
-    logvv(" - element: %s\n", r->tag);
-  default:
-    break;
-  }
+static inline const struct render_elem *table_elem(size_t i) {
+  return (const struct render_elem *) ((const char *) config.table +
+                                       config.index[i]);
 }
 
 void print_config(void) {
   logvv("loaded config:\n");
-  if (opt.verbosity >= 2)
-    twalk(config.elements, print_action);
+  for (size_t i = 0; i < config.num_elems; i++)
+    logvv(" - element: %s\n", table_elem(i)->tag);
 }
 
 int load_config_file(xmlParserCtxtPtr ctx, const char *file) {
@@ -94,8 +144,10 @@ int load_config_file(xmlParserCtxtPtr ctx, const char *file) {
       if (node->type == XML_ELEMENT_NODE &&
           !xmlStrcmp(node->name, u8"elements")) {
         op = get_op(node);
-        if (op == OP_REPLACE)
+        if (op == OP_REPLACE) {
           tdestroy(config.elements, free);
+          config.elements = nullptr;
+        }
         for (atom = node->children; atom; atom = atom->next) {
           if (atom->type == XML_ELEMENT_NODE &&
               !xmlStrcmp(atom->name, u8"element")) {
@@ -134,34 +186,328 @@ fail1:
   if (rc != 0)
     fprintf(stderr, "xml parsing failed\n");
 
-  print_config();
-
   return rc;
 }
 
-int load_config(struct config_dir *dirs) {
+/* State for flattening the tree of rules into the table */
+struct compile_state {
+  char *table;
+  uint32_t *index;
+  size_t num_elems;
+  size_t next;
+};
+
+static thread_local struct compile_state *compiling;
+
+static void count_action(const void *node, VISIT which, int depth) {
+  const struct render_elem *r;
+
+  switch (which) {
+  case postorder:
+  case leaf:
+    r = *((struct render_elem **) node);
+    compiling->num_elems++;
+    compiling->next += cache_elem_size(xmlStrlen(r->tag));
+  default:
+    break;
+  }
+}
+
+static void copy_action(const void *node, VISIT which, int depth) {
+  const struct render_elem *r;
+  size_t tag_len;
+
+  switch (which) {
+  case postorder:
+  case leaf:
+    r = *((struct render_elem **) node);
+    tag_len = xmlStrlen(r->tag);
+    compiling->index[compiling->num_elems++] = compiling->next;
+    memcpy(compiling->table + compiling->next, r,
+           sizeof *r + tag_len + 1);
+    compiling->next += cache_elem_size(tag_len);
+  default:
+    break;
+  }
+}
+
+/* Compile the sources and the rules in the tree into a table. The tree is
+ * walked in order, so the index comes out sorted by tag. */
+static void *compile_table(glob_t *sources, struct stat *stats, size_t *size) {
+  struct compile_state state = {};
+  struct cache_header *header;
+  size_t sources_size = 0;
+  size_t index_offset;
+  char *table;
+  size_t i;
+
+  for (i = 0; i < sources->gl_pathc; i++)
+    sources_size += cache_source_size(strlen(sources->gl_pathv[i]));
+
+  compiling = &state;
+  twalk(config.elements, count_action);
+  index_offset = sizeof *header + sources_size;
+  *size = cache_aligned(index_offset + state.num_elems * sizeof *state.index) +
+          state.next;
+
+  if ((table = calloc(1, *size)) == nullptr) {
+    fprintf(stderr, "could not allocate config table, %s\n", strerror(errno));
+    compiling = nullptr;
+    return nullptr;
+  }
+
+  header = (struct cache_header *) table;
+  memcpy(header->magic, cache_magic, sizeof header->magic);
+  header->format = cache_format;
+  header->num_sources = sources->gl_pathc;
+  header->num_elems = state.num_elems;
+  header->index_offset = index_offset;
+  header->elem_size = sizeof(struct render_elem);
+  header->elem_align = alignof(struct render_elem);
+  header->size = *size;
+  strncpy(header->version, STRINGIFY(UNHTML_VERSION), sizeof header->version - 1);
+
+  sources_size = sizeof *header;
+  for (i = 0; i < sources->gl_pathc; i++) {
+    struct cache_source *source = (struct cache_source *) (table + sources_size);
+    size_t path_len = strlen(sources->gl_pathv[i]);
+
+    source->mtime_sec = stats[i].st_mtim.tv_sec;
+    source->mtime_nsec = stats[i].st_mtim.tv_nsec;
+    source->size = stats[i].st_size;
+    source->path_len = path_len;
+    memcpy(source->path, sources->gl_pathv[i], path_len + 1);
+    sources_size += cache_source_size(path_len);
+  }
+
+  state.table = table;
+  state.index = (uint32_t *) (table + index_offset);
+  state.next = cache_aligned(index_offset + state.num_elems * sizeof *state.index);
+  state.num_elems = 0;
+  twalk(config.elements, copy_action);
+  compiling = nullptr;
+
+  return table;
+}
+
+/* Check a compiled table is intact and was compiled by this version of
+ * unhtml from the current versions of the given sources. */
+static bool table_fresh(const void *table, size_t size,
+                        glob_t *sources, struct stat *stats) {
+  const struct cache_header *header = table;
+  size_t offset = sizeof *header;
+  const uint32_t *index;
+  size_t elems;
+  size_t i;
+
+  if (size < sizeof *header ||
+      memcmp(header->magic, cache_magic, sizeof header->magic) ||
+      header->format != cache_format ||
+      header->elem_size != sizeof(struct render_elem) ||
+      header->elem_align != alignof(struct render_elem) ||
+      header->size != size ||
+      strncmp(header->version, STRINGIFY(UNHTML_VERSION), sizeof header->version) ||
+      header->num_sources != sources->gl_pathc ||
+      header->index_offset > size ||
+      header->index_offset % alignof(uint32_t) ||
+      header->num_elems > (size - header->index_offset) / sizeof(uint32_t))
+    return false;
+
+  for (i = 0; i < sources->gl_pathc; i++) {
+    const struct cache_source *source;
+
+    if (offset + sizeof *source > header->index_offset)
+      return false;
+    source = (const struct cache_source *) ((const char *) table + offset);
+    if (source->mtime_sec != stats[i].st_mtim.tv_sec ||
+        source->mtime_nsec != stats[i].st_mtim.tv_nsec ||
+        source->size != stats[i].st_size ||
+        source->path_len != strlen(sources->gl_pathv[i]) ||
+        offset + cache_source_size(source->path_len) > header->index_offset ||
+        memcmp(source->path, sources->gl_pathv[i], source->path_len))
+      return false;
+    offset += cache_source_size(source->path_len);
+  }
+
+  /* Each element record must lie after the index, within the table, with
+   * its tag terminated there */
+  elems = cache_aligned(header->index_offset +
+                        header->num_elems * sizeof(uint32_t));
+  if (elems > size)
+    return false;
+  index = (const uint32_t *) ((const char *) table + header->index_offset);
+  for (i = 0; i < header->num_elems; i++) {
+    const struct render_elem *elem;
+
+    if (index[i] < elems || index[i] % cache_align || index[i] >= size ||
+        size - index[i] <= sizeof *elem)
+      return false;
+    elem = (const struct render_elem *) ((const char *) table + index[i]);
+    if (elem->spacing > SPACING_SPACE ||
+        *(const unsigned char *) &elem->skip > 1 ||
+        !memchr(elem->tag, '\0', size - index[i] - sizeof *elem))
+      return false;
+  }
+
+  return true;
+}
+
+static int build_hash(void);
+
+static void use_table(const void *table, size_t size, bool mapped) {
+  const struct cache_header *header = table;
+  size_t elems = cache_aligned(header->index_offset +
+                               header->num_elems * sizeof *config.index);
+
+  config.table = table;
+  config.table_size = size;
+  config.table_mapped = mapped;
+  config.index = (const uint32_t *) ((const char *) table + header->index_offset);
+  config.num_elems = header->num_elems;
+  /* The element records, unlike the sources, do not depend on where the
+   * config files are or when they were changed */
+  hash_digest(&config.digest, (const char *) table + elems, size - elems, nullptr);
+  build_hash();
+}
+
+/* Name the cache after the config search path, so that runs with different
+ * search paths do not keep replacing each other's cache. */
+static char *cache_path(struct config_dir *dirs) {
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
   struct config_dir *dir;
+  uint32_t hash = 2166136261u;
+  char *path = nullptr;
+  int rc;
+
+  for (dir = dirs; dir; dir = dir->next) {
+    for (const char *c = dir->dir; c && *c; c++)
+      hash = (hash ^ (unsigned char) *c) * 16777619u;
+    hash = (hash ^ '\0') * 16777619u;
+  }
+
+  if (cache_home && *cache_home)
+    rc = asprintf(&path, "%s/" UNHTML "/config-%08x.cache", cache_home, hash);
+  else if (home && *home)
+    rc = asprintf(&path, "%s/.cache/" UNHTML "/config-%08x.cache", home, hash);
+  else
+    return nullptr;
+
+  return rc == -1 ? nullptr : path;
+}
+
+static bool map_cache(const char *path, glob_t *sources, struct stat *stats) {
+  struct stat statbuf;
+  void *table;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return false;
+
+  if (fstat(fd, &statbuf) == -1 || statbuf.st_size == 0 ||
+      (table = mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  close(fd);
+
+  if (!table_fresh(table, statbuf.st_size, sources, stats)) {
+    logv("config cache %s is stale\n", path);
+    munmap(table, statbuf.st_size);
+    return false;
+  }
+
+  logv("using config cache %s\n", path);
+  use_table(table, statbuf.st_size, true);
+  return true;
+}
+
+/* Write the cache to a temporary file and rename it into place, so that
+ * concurrent readers only ever see a complete cache. */
+static void write_cache(const char *path, const void *table, size_t size) {
+  char *tmp = nullptr;
+  ssize_t written = 0;
+  int fd;
+
+  if (asprintf(&tmp, "%s.XXXXXX", path) == -1)
+    return;
+
+  if (make_parents(tmp) != 0 || (fd = mkstemp(tmp)) == -1) {
+    logv("could not create config cache %s, %s\n", tmp, strerror(errno));
+    free(tmp);
+    return;
+  }
+
+  while (written < size) {
+    ssize_t rc = write(fd, (const char *) table + written, size - written);
+    if (rc == -1 && errno == EINTR)
+      continue;
+    if (rc == -1)
+      break;
+    written += rc;
+  }
+
+  if (close(fd) == 0 && written == size && rename(tmp, path) == 0) {
+    logv("wrote config cache %s\n", path);
+  } else {
+    logv("could not write config cache %s, %s\n", path, strerror(errno));
+    unlink(tmp);
+  }
+  free(tmp);
+}
+
+/* Find the config files in each directory from the end of the search path,
+ * so that those in directories earlier on it are read later and so may
+ * override or supplement the rest */
+static void find_config_files(struct config_dir *dir, glob_t *glob_buf,
+                              int *flags) {
+  char *path;
+  int rc;
+
+  if (dir == nullptr)
+    return;
+  find_config_files(dir->next, glob_buf, flags);
+
+  asprintf(&path, "%s/*.xml", dir->dir);
+  logv("looking for config files: %s\n", path);
+  rc = glob(path, *flags, NULL, glob_buf);
+  if (rc != 0 && rc != GLOB_NOMATCH) {
+    perror("glob(): reading configs");
+    exit(1);
+  }
+  *flags |= GLOB_APPEND;
+  free(path);
+}
+
+int load_config(struct config_dir *dirs) {
+  struct stat *stats = nullptr;
   xmlParserCtxtPtr ctx;
-  glob_t glob_buf;
+  glob_t glob_buf = {};
+  char *cache = nullptr;
+  void *table;
+  size_t size;
   int flags = 0;
   int rc = 1;
   int i;
 
-  for (dir = dirs; dir; dir = dir->next) {
-    char *path;
-
-    asprintf(&path, "%s/*.xml", dir->dir);
-    logv("looking for config files: %s\n", path);
-    rc = glob(path, flags, NULL, &glob_buf);
-    if (rc != 0 && rc != GLOB_NOMATCH) {
-      perror("glob(): reading configs");
-      exit(1);
-    }
-    flags |= GLOB_APPEND;
+  find_config_files(dirs, &glob_buf, &flags);
+
+  if (glob_buf.gl_pathc == 0)
+    goto fail;
+
+  if ((stats = calloc(glob_buf.gl_pathc, sizeof *stats)) == nullptr)
+    goto fail;
+
+  for (i = 0; i < glob_buf.gl_pathc; i++) {
+    if (stat(glob_buf.gl_pathv[i], stats + i) == -1)
+      memset(stats + i, '\0', sizeof *stats);
   }
 
-  if (glob_buf.gl_pathc == 0 ||
-      (ctx = xmlNewParserCtxt()) == NULL)
+  if (!opt.no_config_cache && (cache = cache_path(dirs)) &&
+      map_cache(cache, &glob_buf, stats))
+    goto done;
+
+  if ((ctx = xmlNewParserCtxt()) == NULL)
     goto fail;
 
   for (i = 0; i < glob_buf.gl_pathc; i++) {
@@ -170,16 +516,87 @@ int load_config(struct config_dir *dirs) {
 
   xmlFreeParserCtxt(ctx);
 
+  if ((table = compile_table(&glob_buf, stats, &size)) == nullptr)
+    goto fail;
+
+  use_table(table, size, false);
+  if (cache)
+    write_cache(cache, table, size);
+
+done:
+  print_config();
+  rc = 0;
+
 fail:
+  free(cache);
+  free(stats);
   globfree(&glob_buf);
 
   return rc;
 };
 
+/* Release the loaded configuration, so that it may be loaded afresh */
+void free_config(void) {
+  if (config.elements)
+    tdestroy(config.elements, free);
+  if (config.table_mapped)
+    munmap((void *) config.table, config.table_size);
+  else
+    free((void *) config.table);
+  free(config.hash);
+  config = (struct config) {};
+}
+
+static inline uint32_t hash_tag(const char8_t *tag) {
+  uint32_t hash = 2166136261u;
+
+  while (*tag)
+    hash = (hash ^ *tag++) * 16777619u;
+  return hash;
+}
+
+/* Build an open-addressed hash table over the compiled rules, at most half
+ * full, mapping each tag to its index in the table plus one. */
+static int build_hash(void) {
+  size_t size = 16;
+  uint32_t *slots;
+
+  while (size < config.num_elems * 2)
+    size <<= 1;
+
+  if ((slots = calloc(size, sizeof *slots)) == nullptr) {
+    fprintf(stderr, "could not allocate config hash, %s\n", strerror(errno));
+    return 1;
+  }
+
+  for (size_t i = 0; i < config.num_elems; i++) {
+    uint32_t slot = hash_tag(table_elem(i)->tag) & (size - 1);
+
+    while (slots[slot])
+      slot = (slot + 1) & (size - 1);
+    slots[slot] = i + 1;
+  }
+
+  free(config.hash);
+  config.hash = slots;
+  config.hash_mask = size - 1;
+  return 0;
+}
+
 struct render_elem *get_rendering(const char8_t *tag) {
-  /* The following object is only safe to use to refer to the key field, 'tag'.
-   * any other usage risks reading invalid or unmapped data. */
-  struct render_elem *dummy = ((struct render_elem *) (tag - offsetof(struct render_elem, tag)));
-  void *node = tfind(dummy, &config.elements, element_compar);
-  return node ? *((struct render_elem **) node) : nullptr;
+  uint32_t slot;
+
+  if (tag == nullptr || config.hash == nullptr)
+    return nullptr;
+
+  for (slot = hash_tag(tag) & config.hash_mask;
+       config.hash[slot];
+       slot = (slot + 1) & config.hash_mask) {
+    const struct render_elem *r = table_elem(config.hash[slot] - 1);
+
+    if (!xmlStrcmp(tag, r->tag))
+      return (struct render_elem *) r;
+  }
+
+  return nullptr;
 }
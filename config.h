@@ -5,6 +5,8 @@
 #define _CONFIG_H
 
 #include "unhtml.h"
+#include "hash.h"
+#include <stdint.h>
 #include <uchar.h>
 #include <libxml/xmlstring.h>
 
@@ -27,7 +29,20 @@ struct render_elem {
 };
 
 struct config {
+  /* Tree of element rules while loading config files */
   void *elements;
+  /* Compiled table of element rules, built or mapped from the cache */
+  const void *table;
+  size_t table_size;
+  bool table_mapped;
+  const uint32_t *index;
+  size_t num_elems;
+  /* Hash of tags to table index plus one */
+  uint32_t *hash;
+  uint32_t hash_mask;
+  /* Hash of the rules, for telling whether text rendered with them may be
+   * reused */
+  struct digest digest;
 };
 
 struct config_dir {
@@ -58,6 +73,7 @@ static inline struct config_dir *get_defconf(void) {
 extern struct config config;
 
 extern int load_config(struct config_dir *dirs);
+extern void free_config(void);
 
 extern struct render_elem *get_rendering(const char8_t *tag);
 
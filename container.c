@@ -0,0 +1,507 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Container formats
+ *
+ * Web archives (WARC) and mailboxes (mbox) hold many documents in one file.
+ * The records in the mapped input are scanned in turn and each one holding
+ * HTML is passed to the parser as a slice of the input, without copying it
+ * out, and rendered after the separator, in which %f is replaced with the
+ * record's ID. Only content that is encoded for transfer, such as a chunked
+ * HTTP response or a base64 mail part, is decoded into a buffer of its own,
+ * as is a compressed HTTP response.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "unhtml.h"
+#include "load.h"
+#include "output.h"
+#include "batch.h"
+#include "decompress.h"
+#include "container.h"
+
+/* Longest record ID output, in bytes */
+static constexpr size_t max_id = 256;
+
+/* Deepest nesting of multipart mail followed */
+static constexpr int max_mime_depth = 8;
+
+struct scan {
+  const char *start;
+  size_t max_buf;
+  struct options opt;
+  struct output *out;
+  struct doc_stats *stats;
+  size_t bytes_in;
+  unsigned long records;
+  int rc;
+};
+
+static const char *html_types[] = {
+  "text/html",
+  "application/xhtml+xml",
+};
+
+/* Find the start of the next line */
+static const char *next_line(const char *p, const char *end) {
+  const char *nl = memchr(p, '\n', end - p);
+
+  return nl ? nl + 1 : end;
+}
+
+/* Step back over the line break before 'p', which belongs to the line that
+ * follows it in MIME */
+static const char *before_break(const char *start, const char *p) {
+  if (p > start && p[-1] == '\n')
+    p--;
+  if (p > start && p[-1] == '\r')
+    p--;
+  return p;
+}
+
+static bool blank_line(const char *p, const char *end) {
+  return (p < end && *p == '\n') ||
+         (end - p >= 2 && p[0] == '\r' && p[1] == '\n');
+}
+
+/* Find the end of the headers starting at 'p', leaving 'body' at the
+ * content after the blank line that ends them */
+static const char *end_of_headers(const char *p, const char *end,
+                                  const char **body) {
+  for (; p < end; p = next_line(p, end)) {
+    if (blank_line(p, end)) {
+      *body = next_line(p, end);
+      return p;
+    }
+  }
+  *body = end;
+  return end;
+}
+
+/* Find the value of the named header, which may continue over following
+ * lines, without its surrounding space */
+static bool header(const char *p, const char *end, const char *name,
+                   const char **value, const char **value_end) {
+  size_t len = strlen(name);
+
+  for (; p < end; p = next_line(p, end)) {
+    const char *v, *e;
+
+    if (end - p <= len || p[len] != ':' || strncasecmp(p, name, len))
+      continue;
+
+    for (v = p + len + 1; v < end && (*v == ' ' || *v == '\t'); v++);
+    for (e = next_line(v, end);
+         e < end && (*e == ' ' || *e == '\t');
+         e = next_line(e, end));
+    while (e > v && (e[-1] == '\r' || e[-1] == '\n' ||
+                     e[-1] == ' ' || e[-1] == '\t'))
+      e--;
+
+    *value = v;
+    *value_end = e;
+    return true;
+  }
+  return false;
+}
+
+/* Check the media type at the start of a Content-Type value */
+static bool is_type(const char *v, const char *end, const char *type) {
+  size_t len = strlen(type);
+
+  return end - v >= len && !strncasecmp(v, type, len) &&
+         (end - v == len || v[len] == ';' || v[len] == ' ' || v[len] == '\t');
+}
+
+static bool is_html(const char *v, const char *end) {
+  for (size_t i = 0; i < sizeof html_types / sizeof *html_types; i++)
+    if (is_type(v, end, html_types[i]))
+      return true;
+  return false;
+}
+
+/* Find the value of the named parameter of a header value */
+static bool parameter(const char *v, const char *end, const char *name,
+                      const char **param, const char **param_end) {
+  size_t len = strlen(name);
+
+  while ((v = memchr(v, ';', end - v))) {
+    for (v++; v < end && (*v == ' ' || *v == '\t' || *v == '\r' || *v == '\n'); v++);
+    if (end - v > len && v[len] == '=' && !strncasecmp(v, name, len)) {
+      v += len + 1;
+      if (v < end && *v == '"') {
+        *param = ++v;
+        *param_end = memchr(v, '"', end - v);
+        if (!*param_end)
+          *param_end = end;
+      } else {
+        *param = v;
+        for (; v < end && *v != ';' && *v != ' ' && *v != '\t' &&
+               *v != '\r' && *v != '\n'; v++);
+        *param_end = v;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Render a record's HTML, which may be a slice of the input */
+static void render_record(struct scan *scan, const char *id, size_t id_len,
+                          const char *data, size_t len) {
+  struct mapped_buffer slice = {
+    .data = (char *) data,
+    /* As if zero-terminated, but the parsers keep within the length */
+    .length = len + 1,
+    .fd = -1,
+  };
+  char name[max_id];
+  size_t i;
+
+  if (id_len > sizeof name - 1)
+    id_len = sizeof name - 1;
+  for (i = 0; i < id_len; i++)
+    name[i] = (unsigned char) id[i] < 0x20 ? ' ' : id[i];
+  name[i] = '\0';
+  slice.uri = name;
+
+  logv("rendering record %s\n", name);
+  write_separator(scan->out, scan->opt.record_separator,
+                  scan->opt.record_separator_len, name);
+  if (process_input(&slice, scan->max_buf, &scan->opt, scan->out, scan->stats) != 0)
+    scan->rc = 1;
+  scan->bytes_in += len;
+  scan->records++;
+}
+
+/* Undo the chunked transfer coding of an HTTP message body */
+static char *dechunk(const char *p, const char *end, size_t *len) {
+  char *buf = malloc(end - p + 1);
+  size_t n = 0;
+
+  if (!buf)
+    return nullptr;
+
+  while (p < end) {
+    char *size_end;
+    size_t size = strtoul(p, &size_end, 16);
+
+    if (size_end == p || size == 0 || size > end - next_line(p, end))
+      break;
+    p = next_line(p, end);
+    memcpy(buf + n, p, size);
+    n += size;
+    p = next_line(p + size, end);
+  }
+
+  buf[n] = '\0';
+  *len = n;
+  return buf;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+    return (c | 0x20) - 'a' + 10;
+  return -1;
+}
+
+static char *decode_quoted_printable(const char *p, const char *end, size_t *len) {
+  char *buf = malloc(end - p + 1);
+  size_t n = 0;
+
+  if (!buf)
+    return nullptr;
+
+  while (p < end) {
+    if (*p != '=') {
+      buf[n++] = *p++;
+    } else if (end - p >= 3 && hex_value(p[1]) >= 0 && hex_value(p[2]) >= 0) {
+      buf[n++] = hex_value(p[1]) << 4 | hex_value(p[2]);
+      p += 3;
+    } else if (end - p >= 2 && (p[1] == '\n' || p[1] == '\r')) {
+      /* Soft line break */
+      p = next_line(p, end);
+    } else {
+      buf[n++] = *p++;
+    }
+  }
+
+  buf[n] = '\0';
+  *len = n;
+  return buf;
+}
+
+static int base64_value(char c) {
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 52;
+  if (c == '+')
+    return 62;
+  if (c == '/')
+    return 63;
+  return -1;
+}
+
+static char *decode_base64(const char *p, const char *end, size_t *len) {
+  char *buf = malloc((end - p) / 4 * 3 + 4);
+  uint32_t bits = 0;
+  int have = 0;
+  size_t n = 0;
+
+  if (!buf)
+    return nullptr;
+
+  for (; p < end && *p != '='; p++) {
+    int v = base64_value(*p);
+
+    if (v < 0)
+      continue;
+    bits = bits << 6 | v;
+    if ((have += 6) >= 8) {
+      have -= 8;
+      buf[n++] = bits >> have;
+    }
+  }
+
+  buf[n] = '\0';
+  *len = n;
+  return buf;
+}
+
+/* Render the HTML in a mail message or one of its parts, decoding it first
+ * if it is encoded for transfer */
+static void scan_part(struct scan *scan, const char *id, size_t id_len,
+                      const char *p, const char *end, int depth) {
+  const char *headers = p;
+  const char *headers_end = end_of_headers(p, end, &p);
+  const char *type = nullptr, *type_end = nullptr;
+  const char *enc, *enc_end;
+  const char *boundary, *boundary_end;
+  char *decoded = nullptr;
+  size_t len;
+
+  if (!header(headers, headers_end, "Content-Type", &type, &type_end))
+    return;
+
+  if (is_html(type, type_end)) {
+    if (!header(headers, headers_end, "Content-Transfer-Encoding", &enc, &enc_end) ||
+        is_type(enc, enc_end, "7bit") || is_type(enc, enc_end, "8bit") ||
+        is_type(enc, enc_end, "binary")) {
+      render_record(scan, id, id_len, p, end - p);
+      return;
+    }
+
+    if (is_type(enc, enc_end, "quoted-printable"))
+      decoded = decode_quoted_printable(p, end, &len);
+    else if (is_type(enc, enc_end, "base64"))
+      decoded = decode_base64(p, end, &len);
+    else
+      logv("skipping part in unknown encoding %.*s\n", (int) (enc_end - enc), enc);
+
+    if (decoded)
+      render_record(scan, id, id_len, decoded, len);
+    free(decoded);
+    return;
+  }
+
+  if (!is_type(type, type_end, "multipart/alternative") &&
+      !is_type(type, type_end, "multipart/mixed") &&
+      !is_type(type, type_end, "multipart/related"))
+    return;
+
+  if (depth == max_mime_depth ||
+      !parameter(type, type_end, "boundary", &boundary, &boundary_end))
+    return;
+
+  /* Parts begin after lines of two dashes and the boundary */
+  for (const char *part = nullptr; p < end; p = next_line(p, end)) {
+    size_t blen = boundary_end - boundary;
+
+    if (end - p < blen + 2 || p[0] != '-' || p[1] != '-' ||
+        memcmp(p + 2, boundary, blen))
+      continue;
+
+    if (part)
+      scan_part(scan, id, id_len, part, before_break(part, p), depth + 1);
+    if (end - p >= blen + 4 && p[blen + 2] == '-' && p[blen + 3] == '-')
+      break;
+    part = next_line(p, end);
+  }
+}
+
+/* Messages in an mbox start with a line beginning "From ", which is quoted
+ * within the messages themselves */
+static void scan_mbox(struct scan *scan, const char *p, const char *end) {
+  unsigned long messages = 0;
+
+  while (p < end) {
+    const char *message = next_line(p, end);
+    const char *next = memmem(message, end - message, "\nFrom ", 6);
+    const char *headers_end, *body;
+    const char *id, *id_end;
+    char number[32];
+
+    next = next ? next + 1 : end;
+    messages++;
+    headers_end = end_of_headers(message, next, &body);
+    if (!header(message, headers_end, "Message-ID", &id, &id_end)) {
+      snprintf(number, sizeof number, "message %lu", messages);
+      id = number;
+      id_end = number + strlen(number);
+    }
+    scan_part(scan, id, id_end - id, message, next, 0);
+    p = next;
+  }
+}
+
+/* Render the HTML in the block of a WARC response or resource record */
+static void scan_warc_block(struct scan *scan, const char *id, size_t id_len,
+                            const char *type, const char *type_end,
+                            const char *p, const char *end) {
+  const char *headers, *headers_end;
+  const char *v, *v_end;
+  enum compression compression;
+  struct mapped_buffer plain;
+  char *decoded = nullptr;
+  size_t len;
+
+  if (is_html(type, type_end)) {
+    render_record(scan, id, id_len, p, end - p);
+    return;
+  }
+
+  if (!is_type(type, type_end, "application/http"))
+    return;
+
+  /* An HTTP response, after its status line */
+  headers = next_line(p, end);
+  headers_end = end_of_headers(headers, end, &p);
+  if (!header(headers, headers_end, "Content-Type", &v, &v_end) ||
+      !is_html(v, v_end))
+    return;
+
+  if (!header(headers, headers_end, "Content-Encoding", &v, &v_end) ||
+      is_type(v, v_end, "identity")) {
+    compression = COMPRESSION_NONE;
+  } else if (is_type(v, v_end, "gzip") || is_type(v, v_end, "x-gzip") ||
+             is_type(v, v_end, "deflate")) {
+    /* zlib tells the gzip and zlib wrappers apart itself */
+    compression = COMPRESSION_GZIP;
+  } else if (is_type(v, v_end, "zstd")) {
+    compression = COMPRESSION_ZSTD;
+  } else if (is_type(v, v_end, "xz")) {
+    compression = COMPRESSION_XZ;
+  } else {
+    logv("skipping record with content encoding %.*s\n", (int) (v_end - v), v);
+    return;
+  }
+
+  if (header(headers, headers_end, "Transfer-Encoding", &v, &v_end) &&
+      is_type(v, v_end, "chunked")) {
+    if (!(decoded = dechunk(p, end, &len)))
+      return;
+    p = decoded;
+    end = decoded + len;
+  }
+
+  if (compression == COMPRESSION_NONE) {
+    render_record(scan, id, id_len, p, end - p);
+  } else if (decompress(&plain, scan->max_buf, compression, p, end - p, -1) == 0) {
+    render_record(scan, id, id_len, plain.data, plain.length - 1);
+    free_map(&plain);
+  } else {
+    logv("skipping record %.*s that failed to decompress\n", (int) id_len, id);
+  }
+  free(decoded);
+}
+
+static void scan_warc(struct scan *scan, const char *p, const char *end) {
+  while (p < end) {
+    const char *headers, *headers_end, *block;
+    const char *v, *v_end;
+    const char *id = "", *id_end = id;
+    const char *type, *type_end;
+    size_t length;
+
+    /* Records are separated by blank lines */
+    while (p < end && (*p == '\r' || *p == '\n'))
+      p++;
+    if (p == end)
+      break;
+
+    if (end - p < 5 || memcmp(p, "WARC/", 5)) {
+      fprintf(stderr, "expected WARC record at offset %zu\n",
+              (size_t) (p - scan->start));
+      scan->rc = 1;
+      return;
+    }
+
+    headers = next_line(p, end);
+    headers_end = end_of_headers(headers, end, &block);
+
+    if (!header(headers, headers_end, "Content-Length", &v, &v_end) ||
+        (length = strtoull(v, nullptr, 10)) > end - block) {
+      fprintf(stderr, "WARC record without valid length\n");
+      scan->rc = 1;
+      return;
+    }
+
+    header(headers, headers_end, "WARC-Record-ID", &id, &id_end);
+    if (header(headers, headers_end, "WARC-Type", &v, &v_end) &&
+        (is_type(v, v_end, "response") || is_type(v, v_end, "resource")) &&
+        header(headers, headers_end, "Content-Type", &type, &type_end))
+      scan_warc_block(scan, id, id_end - id, type, type_end,
+                      block, block + length);
+
+    p = block + length;
+  }
+}
+
+enum container detect_container(const struct mapped_buffer *input) {
+  size_t len = input->length - 1;
+
+  if (len >= 5 && !memcmp(input->data, "WARC/", 5))
+    return CONTAINER_WARC;
+  if (len >= 5 && !memcmp(input->data, "From ", 5))
+    return CONTAINER_MBOX;
+  return CONTAINER_NONE;
+}
+
+/* Render each record of HTML in a container. The measurements of each are
+ * added to 'stats', which then describe the container as a whole. */
+int process_container(struct mapped_buffer *input, enum container container,
+                      size_t max_buf, const struct options *o,
+                      struct output *out, struct doc_stats *stats) {
+  struct scan scan = {
+    .start = input->data,
+    .max_buf = max_buf,
+    .opt = *o,
+    .out = out,
+    .stats = stats,
+  };
+  const char *end = input->data + input->length - 1;
+  size_t out_start = out->total;
+
+  /* The whole container is already in memory */
+  scan.opt.stream = false;
+
+  if (container == CONTAINER_WARC)
+    scan_warc(&scan, input->data, end);
+  else
+    scan_mbox(&scan, input->data, end);
+
+  logv("rendered %lu records\n", scan.records);
+  stats->bytes_in = scan.bytes_in;
+  stats->bytes_out = out->total - out_start;
+  return scan.rc;
+}
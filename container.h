@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _CONTAINER_H
+#define _CONTAINER_H
+
+#include "unhtml.h"
+
+struct output;
+
+extern enum container detect_container(const struct mapped_buffer *input);
+extern int process_container(struct mapped_buffer *input, enum container container,
+                             size_t max_buf, const struct options *o,
+                             struct output *out, struct doc_stats *stats);
+
+#endif
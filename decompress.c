@@ -0,0 +1,352 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Compressed input
+ *
+ * Input compressed with gzip, zstd or xz is recognised by its magic number
+ * and decompressed straight into a zero-terminated buffer, as if it had been
+ * read uncompressed. For a file, the buffer is sized from the uncompressed
+ * size recorded in the gzip trailer or zstd frame header, so that it seldom
+ * needs to grow. Concatenated members or frames are decompressed in turn.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_XZ
+#include <lzma.h>
+#endif
+
+#include "unhtml.h"
+#include "load.h"
+#include "decompress.h"
+
+/* Size of reads of compressed input from a stream */
+static constexpr size_t read_chunk = 0x10000;
+
+/* Expected ratio of uncompressed to compressed size, where the former is
+ * not recorded */
+static constexpr size_t expected_ratio = 4;
+
+static const struct {
+  enum compression compression;
+  const char *name;
+  const char *magic;
+  size_t magic_len;
+} formats[] = {
+  { COMPRESSION_GZIP, "gzip", "\x1f\x8b", 2 },
+  { COMPRESSION_ZSTD, "zstd", "\x28\xb5\x2f\xfd", 4 },
+  { COMPRESSION_XZ,   "xz",   "\xfd" "7zXZ\0", 6 },
+};
+
+struct decoder {
+  enum compression compression;
+  const unsigned char *in;
+  size_t in_len;
+  unsigned char *out;
+  size_t out_len;
+  /* Set at the end of a gzip member or zstd frame, where the input may
+   * end or another may follow */
+  bool boundary;
+  union {
+#ifdef WITH_ZLIB
+    z_stream z;
+#endif
+#ifdef WITH_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+#ifdef WITH_XZ
+    lzma_stream xz;
+#endif
+  };
+};
+
+enum step {
+  STEP_MORE,
+  STEP_DONE,
+  STEP_ERROR,
+};
+
+enum compression sniff_compression(const void *data, size_t len) {
+  for (size_t i = 0; i < sizeof formats / sizeof *formats; i++)
+    if (len >= formats[i].magic_len &&
+        !memcmp(data, formats[i].magic, formats[i].magic_len))
+      return formats[i].compression;
+  return COMPRESSION_NONE;
+}
+
+static const char *compression_name(enum compression compression) {
+  for (size_t i = 0; i < sizeof formats / sizeof *formats; i++)
+    if (formats[i].compression == compression)
+      return formats[i].name;
+  return "none";
+}
+
+/* Guess the size of the input once uncompressed */
+static size_t size_hint(enum compression compression, const unsigned char *in,
+                        size_t len) {
+  size_t hint = len * expected_ratio;
+
+  switch (compression) {
+  case COMPRESSION_GZIP:
+    /* The trailer holds the size modulo 4GB of the last member only */
+    if (len >= 18) {
+      const unsigned char *t = in + len - 4;
+      size_t isize = t[0] | t[1] << 8 | t[2] << 16 | (size_t) t[3] << 24;
+
+      if (isize > len)
+        hint = isize;
+    }
+    break;
+#ifdef WITH_ZSTD
+  case COMPRESSION_ZSTD:
+    {
+      unsigned long long size = ZSTD_getFrameContentSize(in, len);
+
+      if (size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR)
+        hint = size;
+    }
+    break;
+#endif
+  default:
+    break;
+  }
+
+  return hint;
+}
+
+static int decoder_init(struct decoder *d) {
+  switch (d->compression) {
+#ifdef WITH_ZLIB
+  case COMPRESSION_GZIP:
+    /* Accept the gzip or zlib wrapper */
+    return inflateInit2(&d->z, 15 + 32) == Z_OK ? 0 : 1;
+#endif
+#ifdef WITH_ZSTD
+  case COMPRESSION_ZSTD:
+    return (d->zstd = ZSTD_createDStream()) == nullptr ||
+           ZSTD_isError(ZSTD_initDStream(d->zstd)) ? 1 : 0;
+#endif
+#ifdef WITH_XZ
+  case COMPRESSION_XZ:
+    d->xz = (lzma_stream) LZMA_STREAM_INIT;
+    return lzma_stream_decoder(&d->xz, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK ? 0 : 1;
+#endif
+  default:
+    fprintf(stderr, "%s decompression not supported\n",
+            compression_name(d->compression));
+    return 1;
+  }
+}
+
+static void decoder_end(struct decoder *d) {
+  switch (d->compression) {
+#ifdef WITH_ZLIB
+  case COMPRESSION_GZIP:
+    inflateEnd(&d->z);
+    break;
+#endif
+#ifdef WITH_ZSTD
+  case COMPRESSION_ZSTD:
+    ZSTD_freeDStream(d->zstd);
+    break;
+#endif
+#ifdef WITH_XZ
+  case COMPRESSION_XZ:
+    lzma_end(&d->xz);
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+/* Decompress as much of the input as fits in the output, advancing both.
+ * 'eof' is set once there will be no more input. */
+static enum step decoder_step(struct decoder *d, bool eof) {
+  if (d->boundary && d->in_len == 0 && eof)
+    return STEP_DONE;
+
+  switch (d->compression) {
+#ifdef WITH_ZLIB
+  case COMPRESSION_GZIP:
+    {
+      int rc;
+
+      d->z.next_in = (unsigned char *) d->in;
+      d->z.avail_in = d->in_len > UINT32_MAX ? UINT32_MAX : d->in_len;
+      d->z.next_out = d->out;
+      d->z.avail_out = d->out_len > UINT32_MAX ? UINT32_MAX : d->out_len;
+      rc = inflate(&d->z, Z_NO_FLUSH);
+      d->in_len -= d->z.next_in - d->in;
+      d->in = d->z.next_in;
+      d->out_len -= d->z.next_out - d->out;
+      d->out = d->z.next_out;
+
+      /* Carry on with the next member, if any, ignoring trailing garbage
+       * as gzip does */
+      d->boundary = rc == Z_STREAM_END;
+      if (rc == Z_STREAM_END)
+        return d->in_len && *d->in != 0x1f ? STEP_DONE :
+               inflateReset(&d->z) == Z_OK ? STEP_MORE : STEP_ERROR;
+      if (rc == Z_BUF_ERROR && d->in_len == 0 && eof)
+        return STEP_ERROR;
+      return rc == Z_OK || rc == Z_BUF_ERROR ? STEP_MORE : STEP_ERROR;
+    }
+#endif
+#ifdef WITH_ZSTD
+  case COMPRESSION_ZSTD:
+    {
+      ZSTD_inBuffer in = { d->in, d->in_len, 0 };
+      ZSTD_outBuffer out = { d->out, d->out_len, 0 };
+      size_t rc = ZSTD_decompressStream(d->zstd, &out, &in);
+
+      d->in += in.pos;
+      d->in_len -= in.pos;
+      d->out += out.pos;
+      d->out_len -= out.pos;
+      if (ZSTD_isError(rc))
+        return STEP_ERROR;
+      /* Zero when a frame is complete and flushed */
+      d->boundary = rc == 0;
+      if (rc != 0 && d->in_len == 0 && eof && out.pos == 0)
+        return STEP_ERROR;
+      return STEP_MORE;
+    }
+#endif
+#ifdef WITH_XZ
+  case COMPRESSION_XZ:
+    {
+      lzma_ret rc;
+
+      d->xz.next_in = d->in;
+      d->xz.avail_in = d->in_len;
+      d->xz.next_out = d->out;
+      d->xz.avail_out = d->out_len;
+      rc = lzma_code(&d->xz, eof ? LZMA_FINISH : LZMA_RUN);
+      d->in_len -= d->xz.next_in - d->in;
+      d->in = d->xz.next_in;
+      d->out_len -= d->xz.next_out - d->out;
+      d->out = d->xz.next_out;
+      if (rc == LZMA_STREAM_END)
+        return STEP_DONE;
+      return rc == LZMA_OK || (rc == LZMA_BUF_ERROR && !eof) ? STEP_MORE : STEP_ERROR;
+    }
+#endif
+  default:
+    return STEP_ERROR;
+  }
+}
+
+static int grow_buffer(struct mapped_buffer *map, size_t max, size_t want) {
+  void *data;
+
+  if (map->mapped >= max) {
+    fprintf(stderr, "input too big once decompressed (>%zd)\n", max);
+    return 1;
+  }
+  if (want > max)
+    want = max;
+
+  if (map->data)
+    data = mremap(map->data, map->mapped, want, MREMAP_MAYMOVE);
+  else
+    data = mmap(nullptr, want, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "failed to map buffer for decompressed input, %s\n",
+            strerror(errno));
+    return 1;
+  }
+
+  map->data = data;
+  map->mapped = want;
+  return 0;
+}
+
+/* Decompress 'in' followed by anything more that can be read from 'fd',
+ * unless it is -1, into a new zero-terminated buffer at 'map_ret' */
+int decompress(struct mapped_buffer *map_ret, size_t max,
+               enum compression compression,
+               const void *in, size_t in_len, int fd) {
+  struct mapped_buffer map = { .fd = -1 };
+  struct decoder d = {
+    .compression = compression,
+    .in = in,
+    .in_len = in_len,
+  };
+  unsigned char *chunk = nullptr;
+  bool eof = fd == -1;
+  enum step step = STEP_MORE;
+  size_t have = 0;
+
+  if (decoder_init(&d) != 0)
+    return 1;
+
+  /* Leave room for the zero terminator */
+  if (grow_buffer(&map, max, (fd == -1 ? size_hint(compression, in, in_len) :
+                                         read_chunk * expected_ratio) + 1) != 0)
+    goto fail;
+
+  while (step == STEP_MORE) {
+    if (d.in_len == 0 && !eof) {
+      ssize_t got;
+
+      if (!chunk && (chunk = malloc(read_chunk)) == nullptr) {
+        fprintf(stderr, "could not allocate input buffer, %s\n", strerror(errno));
+        goto fail;
+      }
+      got = read(fd, chunk, read_chunk);
+      if (got == -1 && errno == EINTR)
+        continue;
+      if (got == -1) {
+        fprintf(stderr, "error reading input, %s\n", strerror(errno));
+        goto fail;
+      }
+      eof = got == 0;
+      d.in = chunk;
+      d.in_len = got;
+    }
+
+    if (have + 1 >= map.mapped && grow_buffer(&map, max, map.mapped << 1) != 0)
+      goto fail;
+
+    d.out = (unsigned char *) map.data + have;
+    d.out_len = map.mapped - have - 1;
+    step = decoder_step(&d, eof);
+    have = (char *) d.out - map.data;
+  }
+
+  if (step == STEP_ERROR) {
+    fprintf(stderr, "%s input is corrupt or truncated\n",
+            compression_name(compression));
+    goto fail;
+  }
+
+  logv("decompressed %s input to %zu bytes\n", compression_name(compression), have);
+
+  map.data[have] = '\0';
+  map.length = have + 1;
+  *map_ret = map;
+  decoder_end(&d);
+  free(chunk);
+  return 0;
+
+fail:
+  decoder_end(&d);
+  free(chunk);
+  if (map.data)
+    munmap(map.data, map.mapped);
+  return 1;
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _DECOMPRESS_H
+#define _DECOMPRESS_H
+
+#include "load.h"
+
+enum compression {
+  COMPRESSION_NONE,
+  COMPRESSION_GZIP,
+  COMPRESSION_ZSTD,
+  COMPRESSION_XZ,
+};
+
+/* Length of input enough to recognise any compressed format */
+#define COMPRESSION_MAGIC_MAX 6
+
+extern enum compression sniff_compression(const void *data, size_t len);
+extern int decompress(struct mapped_buffer *map_ret, size_t max,
+                      enum compression compression,
+                      const void *in, size_t in_len, int fd);
+
+#endif
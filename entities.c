@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Character references
+ *
+ * Decodes HTML character references to UTF-8. Named references are looked
+ * up in a perfect hash table of the full HTML5 set, generated at build time
+ * from entities.txt, so a lookup costs one hash of the name and a single
+ * comparison.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <uchar.h>
+
+#include "output.h"
+#include "entities.h"
+#include "entities-table.h"
+
+/* Longest named reference recognised without a semicolon */
+static constexpr size_t max_legacy_name = 6;
+
+/* Code points for references to C1 controls, taken to mean Windows-1252 */
+static const char16_t windows_1252[32] = {
+  0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+  0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+  0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+  0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178,
+};
+
+static inline bool is_alnum(char c) {
+  return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || (c >= '0' && c <= '9');
+}
+
+static inline int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+    return (c | 0x20) - 'a' + 10;
+  return -1;
+}
+
+static size_t encode_utf8(char32_t c, char *out) {
+  if (c < 0x80) {
+    out[0] = c;
+    return 1;
+  } else if (c < 0x800) {
+    out[0] = 0xc0 | c >> 6;
+    out[1] = 0x80 | (c & 0x3f);
+    return 2;
+  } else if (c < 0x10000) {
+    out[0] = 0xe0 | c >> 12;
+    out[1] = 0x80 | (c >> 6 & 0x3f);
+    out[2] = 0x80 | (c & 0x3f);
+    return 3;
+  } else {
+    out[0] = 0xf0 | c >> 18;
+    out[1] = 0x80 | (c >> 12 & 0x3f);
+    out[2] = 0x80 | (c >> 6 & 0x3f);
+    out[3] = 0x80 | (c & 0x3f);
+    return 4;
+  }
+}
+
+static const struct entity *lookup(const char *name, size_t len) {
+  uint32_t hash = entity_hash(name, len);
+  const struct entity *e = entity_table +
+    entity_slot(hash, entity_disp[hash % entity_buckets], entity_slots);
+
+  return e->name_len == len && !memcmp(entity_names + e->name, name, len) ?
+    e : nullptr;
+}
+
+static size_t decode_numeric(const char *text, size_t len, char *utf8,
+                             size_t *utf8_len) {
+  bool hex = len > 2 && (text[2] | 0x20) == 'x';
+  size_t i = hex ? 3 : 2;
+  size_t digits = i;
+  char32_t code = 0;
+  int d;
+
+  for (; i < len && (d = hex ? hex_digit(text[i]) :
+                         text[i] >= '0' && text[i] <= '9' ? text[i] - '0' : -1) >= 0; i++) {
+    if (code <= 0x10ffff)
+      code = code * (hex ? 16 : 10) + d;
+  }
+  if (i == digits)
+    return 0;
+  if (i < len && text[i] == ';')
+    i++;
+
+  if (code >= 0x80 && code < 0xa0)
+    code = windows_1252[code - 0x80];
+  else if (code == 0 || code > 0x10ffff || (code >= 0xd800 && code < 0xe000))
+    code = 0xfffd;
+
+  *utf8_len = encode_utf8(code, utf8);
+  return i;
+}
+
+/* Decode the character reference at the start of 'text', which begins with
+ * '&', into at most ENTITY_MAX_UTF8 bytes of UTF-8 at 'utf8'. Returns the
+ * length of the reference, or zero if the text does not start with one. */
+size_t entity_decode(const char *text, size_t len, char *utf8, size_t *utf8_len) {
+  const struct entity *e = nullptr;
+  size_t n;
+
+  if (len > 1 && text[1] == '#')
+    return decode_numeric(text, len, utf8, utf8_len);
+
+  for (n = 1; n < len && n <= ENTITY_MAX_NAME && is_alnum(text[n]); n++);
+
+  /* The name with its semicolon, or else the longest legacy name that
+   * prefixes it */
+  if (!(n < len && text[n] == ';' && (e = lookup(text + 1, n))))
+    for (n = n - 1 < max_legacy_name ? n - 1 : max_legacy_name;
+         n >= 2 && !(e = lookup(text + 1, n)); n--);
+
+  if (!e)
+    return 0;
+
+  memcpy(utf8, e->utf8, e->utf8_len);
+  *utf8_len = e->utf8_len;
+  return n + 1;
+}
+
+/* Write the text to the output with its character references decoded */
+void entity_decode_span(struct output *out, const char *text, size_t len) {
+  const char *end = text + len;
+  char utf8[ENTITY_MAX_UTF8];
+  size_t utf8_len;
+
+  while (text < end) {
+    const char *amp = memchr(text, '&', end - text);
+    size_t n;
+
+    if (!amp) {
+      output_write(out, text, end - text);
+      break;
+    }
+    output_write(out, text, amp - text);
+    if ((n = entity_decode(amp, end - amp, utf8, &utf8_len))) {
+      output_write(out, utf8, utf8_len);
+      text = amp + n;
+    } else {
+      output_putc(out, '&');
+      text = amp + 1;
+    }
+  }
+}
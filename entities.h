@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _ENTITIES_H
+#define _ENTITIES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Longest name of a named character reference, including the semicolon */
+#define ENTITY_MAX_NAME 32
+
+/* Most UTF-8 that a character reference decodes to */
+#define ENTITY_MAX_UTF8 8
+
+struct entity {
+  uint16_t name;
+  uint8_t name_len;
+  uint8_t utf8_len;
+  char utf8[ENTITY_MAX_UTF8];
+};
+
+struct output;
+
+extern size_t entity_decode(const char *text, size_t len, char *utf8, size_t *utf8_len);
+extern void entity_decode_span(struct output *out, const char *text, size_t len);
+
+/* Hash functions shared with genentities, which chooses each bucket's
+ * displacement such that entity_slot() is a perfect hash */
+static inline uint32_t entity_hash(const char *name, size_t len) {
+  uint32_t hash = 0x811c9dc5;
+
+  while (len--)
+    hash = (hash ^ (unsigned char) *name++) * 0x01000193;
+  return hash;
+}
+
+static inline size_t entity_slot(uint32_t hash, uint32_t disp, size_t slots) {
+  uint32_t x = hash ^ (disp * 0x9e3779b9);
+
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x % slots;
+}
+
+#endif
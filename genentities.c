@@ -0,0 +1,216 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* genentities: compile the named character references into C
+ *
+ * Reads the list of references in entities.txt on stdin and writes on stdout
+ * a perfect hash table of them, together with their UTF-8 encodings, for
+ * inclusion by entities.c. Each name hashes to a bucket whose displacement
+ * is chosen so that every name in the bucket lands in a slot of its own.
+ * The hash functions must match those in entities.h.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "entities.h"
+
+static constexpr size_t max_entities = 4096;
+static constexpr uint32_t max_displacement = 0xffff;
+
+struct entry {
+  char name[ENTITY_MAX_NAME + 1];
+  size_t name_len;
+  unsigned char utf8[ENTITY_MAX_UTF8];
+  size_t utf8_len;
+  uint32_t hash;
+  size_t offset;
+};
+
+static struct entry entries[max_entities];
+static size_t num_entries;
+
+static size_t encode_utf8(uint32_t c, unsigned char *out) {
+  if (c < 0x80) {
+    out[0] = c;
+    return 1;
+  } else if (c < 0x800) {
+    out[0] = 0xc0 | c >> 6;
+    out[1] = 0x80 | (c & 0x3f);
+    return 2;
+  } else if (c < 0x10000) {
+    out[0] = 0xe0 | c >> 12;
+    out[1] = 0x80 | (c >> 6 & 0x3f);
+    out[2] = 0x80 | (c & 0x3f);
+    return 3;
+  } else {
+    out[0] = 0xf0 | c >> 18;
+    out[1] = 0x80 | (c >> 12 & 0x3f);
+    out[2] = 0x80 | (c >> 6 & 0x3f);
+    out[3] = 0x80 | (c & 0x3f);
+    return 4;
+  }
+}
+
+static int read_entities(FILE *in) {
+  char line[256];
+  int lineno = 0;
+
+  while (fgets(line, sizeof line, in)) {
+    struct entry *e = entries + num_entries;
+    char *tok, *save;
+
+    lineno++;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+
+    if (num_entries == max_entities) {
+      fprintf(stderr, "too many entities\n");
+      return 1;
+    }
+
+    if ((tok = strtok_r(line, "\t\n", &save)) == nullptr ||
+        (e->name_len = strlen(tok)) > ENTITY_MAX_NAME) {
+      fprintf(stderr, "line %d: bad name\n", lineno);
+      return 1;
+    }
+    memcpy(e->name, tok, e->name_len);
+
+    while ((tok = strtok_r(nullptr, " \t\n", &save))) {
+      uint32_t code = strtoul(tok, nullptr, 16);
+
+      if (e->utf8_len + 4 > ENTITY_MAX_UTF8) {
+        fprintf(stderr, "line %d: expansion too long\n", lineno);
+        return 1;
+      }
+      e->utf8_len += encode_utf8(code, e->utf8 + e->utf8_len);
+    }
+
+    if (e->utf8_len == 0) {
+      fprintf(stderr, "line %d: no code points\n", lineno);
+      return 1;
+    }
+
+    e->hash = entity_hash(e->name, e->name_len);
+    num_entries++;
+  }
+
+  return 0;
+}
+
+static size_t *bucket_of;
+static size_t *bucket_size;
+
+static int by_bucket_size(const void *a, const void *b) {
+  size_t x = bucket_size[*(const size_t *) a];
+  size_t y = bucket_size[*(const size_t *) b];
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int main(void) {
+  size_t num_buckets, num_slots;
+  size_t *order, *slots, *slot_of;
+  uint32_t *disp;
+  size_t names_len = 0;
+
+  if (read_entities(stdin) != 0)
+    return EXIT_FAILURE;
+
+  num_buckets = num_entries / 4 + 1;
+  num_slots = num_entries + num_entries / 4;
+
+  bucket_of = calloc(num_entries, sizeof *bucket_of);
+  bucket_size = calloc(num_buckets, sizeof *bucket_size);
+  order = calloc(num_buckets, sizeof *order);
+  disp = calloc(num_buckets, sizeof *disp);
+  slots = calloc(num_slots, sizeof *slots);
+  slot_of = calloc(num_entries, sizeof *slot_of);
+  if (!bucket_of || !bucket_size || !order || !disp || !slots || !slot_of) {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < num_entries; i++) {
+    bucket_of[i] = entries[i].hash % num_buckets;
+    bucket_size[bucket_of[i]]++;
+  }
+  for (size_t b = 0; b < num_buckets; b++)
+    order[b] = b;
+  qsort(order, num_buckets, sizeof *order, by_bucket_size);
+
+  /* Place the largest buckets first, while there is most room; slots
+   * hold the entry index plus one */
+  for (size_t o = 0; o < num_buckets && bucket_size[order[o]]; o++) {
+    size_t b = order[o];
+    uint32_t d;
+
+    for (d = 0; d <= max_displacement; d++) {
+      bool ok = true;
+      size_t i;
+
+      for (i = 0; i < num_entries && ok; i++) {
+        size_t s = entity_slot(entries[i].hash, d, num_slots);
+
+        if (bucket_of[i] != b)
+          continue;
+        if (slots[s])
+          ok = false;
+        else
+          slots[s] = i + 1;
+      }
+
+      if (ok)
+        break;
+
+      /* Undo the partial placement */
+      for (size_t j = 0; j < i; j++)
+        if (bucket_of[j] == b && slots[entity_slot(entries[j].hash, d, num_slots)] == j + 1)
+          slots[entity_slot(entries[j].hash, d, num_slots)] = 0;
+    }
+
+    if (d > max_displacement) {
+      fprintf(stderr, "could not place bucket %zu\n", b);
+      return EXIT_FAILURE;
+    }
+    disp[b] = d;
+  }
+
+  printf("/* Generated by genentities from entities.txt. Do not edit. */\n\n"
+         "static constexpr size_t entity_buckets = %zu;\n"
+         "static constexpr size_t entity_slots = %zu;\n\n",
+         num_buckets, num_slots);
+
+  printf("static const uint16_t entity_disp[entity_buckets] = {");
+  for (size_t b = 0; b < num_buckets; b++)
+    printf("%s%u,", b % 12 ? " " : "\n  ", disp[b]);
+  printf("\n};\n\n");
+
+  printf("static const char entity_names[] =");
+  for (size_t i = 0; i < num_entries; i++) {
+    entries[i].offset = names_len;
+    names_len += entries[i].name_len;
+    printf("%s\"%s\"", i % 6 ? " " : "\n  ", entries[i].name);
+  }
+  printf(";\n\n");
+
+  printf("static const struct entity entity_table[entity_slots] = {\n");
+  for (size_t s = 0; s < num_slots; s++) {
+    const struct entry *e;
+
+    if (!slots[s]) {
+      printf("  {},\n");
+      continue;
+    }
+    e = entries + slots[s] - 1;
+    printf("  { %zu, %zu, %zu, \"", e->offset, e->name_len, e->utf8_len);
+    for (size_t j = 0; j < e->utf8_len; j++)
+      printf("\\x%02x", e->utf8[j]);
+    printf("\" },\n");
+  }
+  printf("};\n");
+
+  return EXIT_SUCCESS;
+}
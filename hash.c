@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Hashing
+ *
+ * A fast 128-bit hash of arbitrary data for recognising content seen
+ * before. Four lanes of 64 bits each consume 32 bytes at a time, mixed in
+ * the manner of xxHash, and are combined two ways into the two halves of the
+ * digest. It is not a cryptographic hash. FNV-1a is provided as well, to
+ * check independently that content whose digest matches is the same.
+ */
+
+#include <string.h>
+
+#include "hash.h"
+
+static constexpr uint64_t prime1 = 0x9e3779b185ebca87ull;
+static constexpr uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+static constexpr uint64_t prime3 = 0x165667b19e3779f9ull;
+static constexpr uint64_t prime4 = 0x85ebca77c2b2ae63ull;
+static constexpr uint64_t prime5 = 0x27d4eb2f165667c5ull;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+  return x << r | x >> (64 - r);
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+  uint64_t v;
+
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t lane) {
+  return rotl(acc + lane * prime2, 31) * prime1;
+}
+
+static inline uint64_t merge(uint64_t h, uint64_t acc) {
+  return (h ^ round64(0, acc)) * prime1 + prime4;
+}
+
+static inline uint64_t avalanche(uint64_t h) {
+  h ^= h >> 33;
+  h *= prime2;
+  h ^= h >> 29;
+  h *= prime3;
+  h ^= h >> 32;
+  return h;
+}
+
+void hash_digest(struct digest *digest, const void *data, size_t len,
+                 const struct digest *seed) {
+  const unsigned char *p = data;
+  const unsigned char *end = p + len;
+  uint64_t s0 = seed ? seed->lo : 0;
+  uint64_t s1 = seed ? seed->hi : 0;
+  uint64_t v[4] = { s0 + prime1 + prime2, s0 + prime2, s1, s1 - prime1 };
+  uint64_t h0, h1;
+
+  for (; end - p >= 32; p += 32) {
+    v[0] = round64(v[0], read64(p));
+    v[1] = round64(v[1], read64(p + 8));
+    v[2] = round64(v[2], read64(p + 16));
+    v[3] = round64(v[3], read64(p + 24));
+  }
+
+  h0 = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+  h1 = rotl(v[3], 5) + rotl(v[2], 11) + rotl(v[1], 23) + rotl(v[0], 41);
+  for (int i = 0; i < 4; i++) {
+    h0 = merge(h0, v[i]);
+    h1 = merge(h1, v[3 - i] ^ prime5);
+  }
+
+  for (; end - p >= 8; p += 8) {
+    uint64_t lane = read64(p);
+
+    h0 = rotl(h0 ^ round64(0, lane), 27) * prime1 + prime4;
+    h1 = rotl(h1 ^ round64(prime5, lane), 29) * prime2 + prime3;
+  }
+  for (; p < end; p++) {
+    h0 = rotl(h0 ^ *p * prime5, 11) * prime1;
+    h1 = rotl(h1 ^ *p * prime1, 13) * prime5;
+  }
+
+  h0 += len;
+  h1 += len * prime3;
+  digest->lo = avalanche(h0 ^ rotl(h1, 17));
+  digest->hi = avalanche(h1 + h0 * prime3);
+}
+
+/* 64-bit FNV-1a, continuing from 'seed', which is fnv1a_basis to start.
+ * Slower, but unrelated to the above, so that it can check it. */
+uint64_t hash_fnv1a(const void *data, size_t len, uint64_t seed) {
+  const unsigned char *p = data;
+  uint64_t h = seed;
+
+  while (len--)
+    h = (h ^ *p++) * 0x100000001b3ull;
+  return h;
+}
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct digest {
+  uint64_t lo;
+  uint64_t hi;
+};
+
+extern void hash_digest(struct digest *digest, const void *data, size_t len,
+                        const struct digest *seed);
+extern uint64_t hash_fnv1a(const void *data, size_t len, uint64_t seed);
+
+static constexpr uint64_t fnv1a_basis = 0xcbf29ce484222325ull;
+
+#endif
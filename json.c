@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* JSON strings
+ *
+ * Text is written to the output as a quoted JSON string. Runs of characters
+ * that need no escaping, which is nearly all of them in extracted text, are
+ * found sixteen at a time and copied into the output buffer whole.
+ */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "output.h"
+#include "json.h"
+
+static const char hex[] = "0123456789abcdef";
+
+static inline bool needs_escape(unsigned char c) {
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+#ifdef __SSE2__
+/* Mask of the characters among 16 bytes that must be escaped */
+static inline unsigned int escape_mask(const char *p) {
+  __m128i c = _mm_loadu_si128((const __m128i *) p);
+  __m128i ctrl = _mm_cmpeq_epi8(_mm_max_epu8(c, _mm_set1_epi8(0x1f)),
+                                _mm_set1_epi8(0x1f));
+  __m128i quote = _mm_cmpeq_epi8(c, _mm_set1_epi8('"'));
+  __m128i backslash = _mm_cmpeq_epi8(c, _mm_set1_epi8('\\'));
+  return _mm_movemask_epi8(_mm_or_si128(ctrl, _mm_or_si128(quote, backslash)));
+}
+#endif
+
+/* Length of the run of characters at the start of the text that need no
+ * escaping */
+static size_t plain_span(const char *text, size_t len) {
+  size_t n = 0;
+
+#ifdef __SSE2__
+  for (; n + 16 <= len; n += 16) {
+    unsigned int mask = escape_mask(text + n);
+
+    if (mask)
+      return n + __builtin_ctz(mask);
+  }
+#endif
+
+  for (; n < len && !needs_escape(text[n]); n++);
+  return n;
+}
+
+static void escape_char(struct output *out, unsigned char c) {
+  char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+
+  switch (c) {
+  case '"':
+  case '\\':
+    esc[1] = c;
+    break;
+  case '\n':
+    esc[1] = 'n';
+    break;
+  case '\t':
+    esc[1] = 't';
+    break;
+  case '\r':
+    esc[1] = 'r';
+    break;
+  case '\b':
+    esc[1] = 'b';
+    break;
+  case '\f':
+    esc[1] = 'f';
+    break;
+  default:
+    output_write(out, esc, sizeof esc);
+    return;
+  }
+  output_write(out, esc, 2);
+}
+
+/* Write the text as a quoted JSON string */
+void json_escape(struct output *out, const char *str, size_t len) {
+  const char *end = str + len;
+  size_t n;
+
+  output_putc(out, '"');
+  while (str < end) {
+    if ((n = plain_span(str, end - str))) {
+      output_write(out, str, n);
+      str += n;
+    }
+    if (str < end)
+      escape_char(out, *str++);
+  }
+  output_putc(out, '"');
+}
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _JSON_H
+#define _JSON_H
+
+#include <stddef.h>
+
+struct output;
+
+extern void json_escape(struct output *out, const char *str, size_t len);
+
+#endif
@@ -7,26 +7,48 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <stdarg.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 
 #include "unhtml.h"
 #include "load.h"
+#include "decompress.h"
 
-static void write_resource_uri(struct mapped_buffer *map, const char *fmt, ...) {
-  va_list args;
-  char *result;
+/* Give the input the file URI of the canonical path of 'file', or of
+ * 'file' itself if that is absolute but cannot be resolved, such as a
+ * pipe's /dev/stdin, with characters not allowed in a path percent-encoded */
+static void write_resource_uri(struct mapped_buffer *map, const char *file) {
+  static const char hex[] = "0123456789ABCDEF";
+  char *path = realpath(file, nullptr);
+  const unsigned char *p;
+  char *uri, *q;
 
-  va_start(args);
-  vasprintf(&result, fmt, args);
-  va_end(args);
-  map->uri = strdup(result);
+  if (!path && (*file != '/' || !(path = strdup(file))))
+    return;
+
+  if ((uri = malloc(sizeof "file://" + 3 * strlen(path))) != nullptr) {
+    q = stpcpy(uri, "file://");
+    for (p = (const unsigned char *) path; *p; p++) {
+      if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+          (*p >= '0' && *p <= '9') || strchr("/-._~!$&'()*+,;=:@", *p)) {
+        *q++ = *p;
+      } else {
+        *q++ = '%';
+        *q++ = hex[*p >> 4];
+        *q++ = hex[*p & 0xf];
+      }
+    }
+    *q = '\0';
+  }
+  map->uri = uri;
+  free(path);
 }
 
 int map_file(struct mapped_buffer *map_ret, size_t max, const char *file) {
   struct mapped_buffer map = { };
+  struct mapped_buffer plain;
+  enum compression compression;
   struct stat statbuf;
   int rc;
 
@@ -55,7 +77,20 @@ int map_file(struct mapped_buffer *map_ret, size_t max, const char *file) {
     goto fail;
   }
 
-  write_resource_uri(&map, "file:///%s", file);
+  /* Replace compressed input with its decompressed form */
+  compression = sniff_compression(map.data, statbuf.st_size);
+  if (compression != COMPRESSION_NONE) {
+    rc = decompress(&plain, max, compression, map.data, statbuf.st_size, -1);
+    munmap(map.data, map.mapped);
+    if (rc != 0) {
+      fprintf(stderr, "could not decompress %s\n", file);
+      goto fail;
+    }
+    close(map.fd);
+    map = plain;
+  }
+
+  write_resource_uri(&map, file);
 
   *map_ret = map;
   return 0;
@@ -66,35 +101,183 @@ finish:
   return 1;
 }
 
-int map_stream(struct mapped_buffer *map_ret, size_t max, FILE *stream) {
+/* Allocate a zero-terminated buffer for 'len' bytes of input that the caller
+ * will fill in itself */
+int map_alloc(struct mapped_buffer *map_ret, size_t max, size_t len) {
   struct mapped_buffer map = { .fd = -1 };
 
-  map.data = mmap(nullptr, map.mapped = max,
+  /* Zero-terminate the input */
+  map.length = len + 1;
+
+  if (map.length > max) {
+    fprintf(stderr, "input too big (%zd)\n", map.length);
+    return 1;
+  }
+  map.data = mmap(nullptr, map.mapped = map.length,
                   PROT_READ | PROT_WRITE,
                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   if (map.data == MAP_FAILED) {
+    fprintf(stderr, "failed to map buffer for input, %s\n", strerror(errno));
+    return 1;
+  }
+
+  *map_ret = map;
+  return 0;
+}
+
+/* Initial size of buffer for input read from a stream; it is doubled each
+ * time more space is required, up to the maximum input size. */
+static constexpr size_t stream_chunk = 0x10000;
+
+static int grow_stream_buffer(struct mapped_buffer *map, size_t max) {
+  size_t want = map->mapped ? map->mapped << 1 : stream_chunk;
+  void *data;
+
+  if (map->mapped >= max) {
+    fprintf(stderr, "input too big (>%zd)\n", max);
+    return 1;
+  }
+  if (want > max)
+    want = max;
+
+  if (map->data)
+    data = mremap(map->data, map->mapped, want, MREMAP_MAYMOVE);
+  else
+    data = mmap(nullptr, want,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
     fprintf(stderr, "failed to map buffer to stash input, %s\n",
             strerror(errno));
     return 1;
   }
 
-  map.length = fread(map.data, 1, max, stdin);
-  if (ferror(stdin)) {
-    fprintf(stderr, "error reading input, %s\n", strerror(errno));
-    return 1;
+  map->data = data;
+  map->mapped = want;
+  return 0;
+}
+
+/* Read from the stream until the buffer holds at least 'want' bytes or the
+ * stream is exhausted. The length includes the zero terminator. */
+static int fill_stream(struct mapped_buffer *map, size_t max, size_t want) {
+  size_t have = map->length ? map->length - 1 : 0;
+  bool eof = false;
+
+  while (have < want && !eof) {
+    ssize_t got;
+
+    /* Leave room for the zero terminator */
+    if (have + 1 >= map->mapped && grow_stream_buffer(map, max) != 0)
+      return 1;
+
+    got = read(fileno(map->stream), map->data + have, map->mapped - have - 1);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got == -1) {
+      fprintf(stderr, "error reading input, %s\n", strerror(errno));
+      return 1;
+    }
+    eof = got == 0;
+    have += got;
   }
 
   /* Zero-terminate the input */
-  map.data[map.length++] = '\0';
+  map->data[have] = '\0';
+  map->length = have + 1;
 
-  write_resource_uri(&map, "file:///%s", "/dev/stdin");
+  if (eof)
+    map->stream = nullptr;
+
+  return 0;
+}
+
+int map_stream_head(struct mapped_buffer *map_ret, size_t max, FILE *stream,
+                    size_t want) {
+  struct mapped_buffer map = { .fd = -1, .stream = stream };
+  struct mapped_buffer plain;
+  enum compression compression;
+  int rc;
+
+  /* Look for compressed input, which is decompressed in full */
+  if (fill_stream(&map, max, COMPRESSION_MAGIC_MAX) != 0)
+    goto fail;
+  compression = sniff_compression(map.data, map.length - 1);
+  if (compression != COMPRESSION_NONE) {
+    rc = decompress(&plain, max, compression, map.data, map.length - 1,
+                    map.stream ? fileno(map.stream) : -1);
+    free_map(&map);
+    if (rc != 0)
+      return 1;
+    map = plain;
+  } else if (fill_stream(&map, max, want) != 0) {
+    goto fail;
+  }
+
+  write_resource_uri(&map, "/dev/stdin");
 
   *map_ret = map;
   return 0;
+
+fail:
+  free_map(&map);
+  return 1;
+}
+
+int map_stream_rest(struct mapped_buffer *map, size_t max) {
+  return map->stream ? fill_stream(map, max, SIZE_MAX) : 0;
+}
+
+int map_stream(struct mapped_buffer *map_ret, size_t max, FILE *stream) {
+  return map_stream_head(map_ret, max, stream, SIZE_MAX);
+}
+
+/* Replace the contents of the buffer with the next input from the stream,
+ * for consumers that have finished with what was there. Returns the number
+ * of bytes now in the buffer, zero at the end of the stream or -1 on
+ * error. */
+ssize_t refill_stream(struct mapped_buffer *map) {
+  ssize_t got;
+
+  if (!map->stream)
+    return 0;
+
+  map->consumed += map->length ? map->length - 1 : 0;
+  do
+    got = read(fileno(map->stream), map->data, map->mapped - 1);
+  while (got == -1 && errno == EINTR);
+
+  if (got == -1) {
+    fprintf(stderr, "error reading input, %s\n", strerror(errno));
+    return -1;
+  }
+  if (got == 0)
+    map->stream = nullptr;
+
+  map->data[got] = '\0';
+  map->length = got + 1;
+  return got;
+}
+
+/* Create any missing parent directories of 'path' */
+int make_parents(char *path) {
+  char *slash;
+
+  for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+      fprintf(stderr, "could not create directory %s, %s\n",
+              path, strerror(errno));
+      *slash = '/';
+      return 1;
+    }
+    *slash = '/';
+  }
+  return 0;
 }
 
 void free_map(struct mapped_buffer *map) {
-  munmap(map->data, map->mapped);
+  if (map->data)
+    munmap(map->data, map->mapped);
   if (map->fd != -1)
     close(map->fd);
 
@@ -23,10 +23,21 @@ struct mapped_buffer {
   size_t mapped;
   int fd;
   char *uri;
+  /* Source of further input not yet read into the buffer */
+  FILE *stream;
+  /* Amount of input replaced by refill_stream() */
+  size_t consumed;
+  /* The data is known to be UTF-8 */
+  bool utf8;
 };
 
 extern int map_file(struct mapped_buffer *map_ret, size_t max, const char *file);
+extern int map_alloc(struct mapped_buffer *map_ret, size_t max, size_t len);
 extern int map_stream(struct mapped_buffer *map_ret, size_t max, FILE *stream);
+extern int map_stream_head(struct mapped_buffer *map_ret, size_t max, FILE *stream, size_t want);
+extern int map_stream_rest(struct mapped_buffer *map, size_t max);
+extern ssize_t refill_stream(struct mapped_buffer *map);
 extern void free_map(struct mapped_buffer *map);
+extern int make_parents(char *path);
 
 #endif
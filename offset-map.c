@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Offset map
+ *
+ * Records where each run of text in the output came from in the input, as
+ * a side file of unsigned LEB128 varints, three to a run: the distance of
+ * the run's output offset from that of the previous run, the signed
+ * distance of its input offset from that of the previous run in zigzag
+ * encoding, and the length of the input. A run with an input length of
+ * zero starts a new document, from whose start both offsets then count.
+ * The map is written through its own output buffer, so recording a run
+ * costs no allocation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "offset-map.h"
+
+int offset_map_open(struct offset_map *map, const char *file) {
+  int fd;
+
+  *map = (struct offset_map) { };
+  if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+    fprintf(stderr, "could not open offset map %s, %s\n", file, strerror(errno));
+    return 1;
+  }
+  if (output_init(&map->out, fd) != 0) {
+    close(fd);
+    return 1;
+  }
+  return 0;
+}
+
+int offset_map_close(struct offset_map *map) {
+  int rc = output_flush(&map->out);
+
+  if (close(map->out.fd) == -1) {
+    fprintf(stderr, "error closing offset map, %s\n", strerror(errno));
+    rc = 1;
+  }
+  output_free(&map->out);
+  return rc;
+}
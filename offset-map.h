@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _OFFSET_MAP_H
+#define _OFFSET_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "output.h"
+
+struct offset_map {
+  struct output out;
+  /* Offsets of the previous run, from which the next is encoded */
+  size_t last_out;
+  size_t last_in;
+};
+
+extern int offset_map_open(struct offset_map *map, const char *file);
+extern int offset_map_close(struct offset_map *map);
+
+static inline void offset_map_varint(struct offset_map *map, uint64_t v) {
+  char buf[10];
+  size_t n = 0;
+
+  do {
+    buf[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+    v >>= 7;
+  } while (v);
+  output_write(&map->out, buf, n);
+}
+
+/* Record that the text output at 'out_offset' came from 'in_len' bytes of
+ * input at 'in_offset' */
+static inline void offset_map_run(struct offset_map *map, size_t out_offset,
+                                  size_t in_offset, size_t in_len) {
+  int64_t in_delta = (int64_t) (in_offset - map->last_in);
+
+  offset_map_varint(map, out_offset - map->last_out);
+  offset_map_varint(map, (uint64_t) in_delta << 1 ^ (uint64_t) (in_delta >> 63));
+  offset_map_varint(map, in_len);
+  map->last_out = out_offset;
+  map->last_in = in_offset;
+}
+
+/* Start a new document, from which both offsets count afresh */
+static inline void offset_map_begin(struct offset_map *map) {
+  map->last_out = map->last_in = 0;
+  offset_map_run(map, 0, 0, 0);
+}
+
+#endif
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Buffered output
+ *
+ * Rendered text is copied into a large buffer that is written out with
+ * writev() when full, instead of passing through stdio a fragment at a
+ * time. Long runs of text that stay put until the next flush, such as the
+ * content of nodes in a parsed tree, are gathered by reference rather than
+ * copied. Output to memory, for rendering documents concurrently, uses the
+ * same buffer but grows it instead of flushing it.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "output.h"
+
+/* Size of buffer for output to a file */
+static constexpr size_t output_buffer = 0x20000;
+
+/* Initial size of buffer for output to memory */
+static constexpr size_t output_memory = 0x4000;
+
+/* Text shorter than this is copied rather than referred to, as it is cheap
+ * to copy and would waste a segment */
+static constexpr size_t min_ref = 512;
+
+int output_init(struct output *out, int fd) {
+  *out = (struct output) { .fd = fd };
+  out->size = fd == -1 ? output_memory : output_buffer;
+  if ((out->buf = malloc(out->size)) == nullptr) {
+    fprintf(stderr, "could not allocate output buffer, %s\n", strerror(errno));
+    out->size = 0;
+    out->error = true;
+    return 1;
+  }
+  return 0;
+}
+
+void output_free(struct output *out) {
+  free(out->buf);
+  out->buf = nullptr;
+  out->size = out->len = 0;
+}
+
+/* Hand over the text accumulated in memory to the caller */
+char *output_take(struct output *out, size_t *len) {
+  char *text = out->buf;
+
+  *len = out->len;
+  out->buf = nullptr;
+  out->size = out->len = 0;
+  return text;
+}
+
+/* Close off the text copied into the buffer since the last segment */
+static void gather(struct output *out) {
+  if (out->len > out->gathered) {
+    out->seg[out->num_segs++] = (struct iovec) {
+      .iov_base = out->buf + out->gathered,
+      .iov_len = out->len - out->gathered,
+    };
+    out->gathered = out->len;
+  }
+}
+
+int output_flush(struct output *out) {
+  struct iovec *seg = out->seg;
+  int num_segs;
+
+  if (out->fd == -1)
+    return out->error ? 1 : 0;
+
+  gather(out);
+  num_segs = out->num_segs;
+
+  while (num_segs && !out->error) {
+    ssize_t written = writev(out->fd, seg, num_segs);
+
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written == -1) {
+      fprintf(stderr, "error writing output, %s\n", strerror(errno));
+      out->error = true;
+      break;
+    }
+
+    /* Skip whatever was written, which may end part way into a segment */
+    while (num_segs && written >= seg->iov_len) {
+      written -= seg->iov_len;
+      seg++;
+      num_segs--;
+    }
+    if (num_segs) {
+      seg->iov_base = (char *) seg->iov_base + written;
+      seg->iov_len -= written;
+    }
+  }
+
+  out->num_segs = 0;
+  out->len = out->gathered = 0;
+  return out->error ? 1 : 0;
+}
+
+/* Make room in the buffer for at least 'len' more bytes, by flushing it if
+ * writing to a file or otherwise by enlarging it. */
+void output_grow(struct output *out, size_t len) {
+  size_t size;
+  char *buf;
+
+  if (out->error)
+    return;
+
+  if (out->fd != -1) {
+    output_flush(out);
+    if (len <= out->size)
+      return;
+  }
+
+  for (size = out->size ? out->size : output_memory; size < out->len + len; size <<= 1);
+  if ((buf = realloc(out->buf, size)) == nullptr) {
+    fprintf(stderr, "could not allocate output buffer, %s\n", strerror(errno));
+    out->error = true;
+    return;
+  }
+  out->buf = buf;
+  out->size = size;
+}
+
+void output_ref(struct output *out, const void *data, size_t len) {
+  if (out->fd == -1 || len < min_ref) {
+    output_write(out, data, len);
+    return;
+  }
+
+  /* Leave room for the buffered text that follows */
+  if (out->num_segs >= OUTPUT_SEGMENTS - 2)
+    output_flush(out);
+
+  gather(out);
+  out->seg[out->num_segs++] = (struct iovec) {
+    .iov_base = (void *) data,
+    .iov_len = len,
+  };
+  out->total += len;
+}
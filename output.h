@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+
+/* Maximum number of segments gathered for a single writev() */
+#define OUTPUT_SEGMENTS 64
+
+struct output {
+  /* Destination file descriptor, or -1 to accumulate output in memory */
+  int fd;
+  char *buf;
+  size_t len;
+  size_t size;
+  /* Start of the text in buf not yet gathered into a segment */
+  size_t gathered;
+  /* Segments awaiting writing, referring either to buf or to text owned
+   * by the caller, which must remain valid until the next flush */
+  struct iovec seg[OUTPUT_SEGMENTS];
+  int num_segs;
+  size_t total;
+  bool error;
+};
+
+extern int output_init(struct output *out, int fd);
+extern void output_free(struct output *out);
+extern char *output_take(struct output *out, size_t *len);
+extern int output_flush(struct output *out);
+extern void output_grow(struct output *out, size_t len);
+extern void output_ref(struct output *out, const void *data, size_t len);
+
+static inline void output_write(struct output *out, const void *data, size_t len) {
+  if (out->len + len > out->size)
+    output_grow(out, len);
+  if (out->len + len <= out->size) {
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    out->total += len;
+  }
+}
+
+static inline void output_putc(struct output *out, char c) {
+  if (out->len == out->size)
+    output_grow(out, 1);
+  if (out->len < out->size) {
+    out->buf[out->len++] = c;
+    out->total++;
+  }
+}
+
+static inline void output_puts(struct output *out, const char *str) {
+  output_write(out, str, strlen(str));
+}
+
+#endif
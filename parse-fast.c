@@ -0,0 +1,537 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* parse tag soup quickly
+ *
+ * Tokenizes the mapped input directly and renders text as it is found,
+ * without building a tree. Only as much of HTML's syntax is recognised as is
+ * needed to find the text: tags, comments, CDATA sections, the raw text of
+ * script-like elements and character references. Misnested markup is not
+ * repaired as it would be by tree construction, so the tagsoup parser
+ * remains the choice where that matters. The input has been converted to
+ * UTF-8.
+ *
+ * With -split, a large document is cut at start tags into parts that are
+ * parsed at once on separate threads, each as if the parser were in its
+ * initial state at the start of the part, and the text of the parts is then
+ * joined in order. A part is parsed again after the part before it, as it
+ * would have been without splitting, if that part did not end exactly at its
+ * start in the initial state, as when the cut fell within a comment, script
+ * or skipped element.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <uchar.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "config.h"
+#include "render.h"
+#include "entities.h"
+#include "parse-fast.h"
+
+/* Tag names this long or longer are not looked up */
+static constexpr size_t max_tag = 32;
+
+/* Smallest part into which to split a document */
+static constexpr size_t min_part = 0x10'0000;
+
+enum content {
+  CONTENT_NORMAL,
+  /* Text up to the end tag, without markup or references */
+  CONTENT_RAW,
+  /* Text up to the end tag, with references but no markup */
+  CONTENT_RCDATA,
+};
+
+struct fast_state {
+  struct render_ctx *rctx;
+  const char *start;
+  const char *end;
+  /* Name of the element whose content is being skipped and the depth of
+   * nesting of elements of that name within it */
+  char skip_tag[max_tag];
+  unsigned int skip_depth;
+  /* Depth of nesting of svg and math elements, within which any element
+   * may close itself */
+  unsigned int foreign_depth;
+};
+
+static const char *void_elements[] = {
+  "area", "base", "br", "col", "embed", "hr", "img", "input", "link",
+  "meta", "param", "source", "track", "wbr",
+};
+
+static const struct {
+  const char *name;
+  enum content content;
+} special_elements[] = {
+  { "script",    CONTENT_RAW },
+  { "style",     CONTENT_RAW },
+  { "xmp",       CONTENT_RAW },
+  { "iframe",    CONTENT_RAW },
+  { "noembed",   CONTENT_RAW },
+  { "noframes",  CONTENT_RAW },
+  { "title",     CONTENT_RCDATA },
+  { "textarea",  CONTENT_RCDATA },
+};
+
+static inline bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+static inline bool is_alpha(char c) {
+  return (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+}
+
+/* Find the next '<' or '&' */
+static const char *find_markup(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i amp = _mm_set1_epi8('&');
+
+  for (; end - p >= 16; p += 16) {
+    __m128i c = _mm_loadu_si128((const __m128i *) p);
+    unsigned int mask = _mm_movemask_epi8(
+      _mm_or_si128(_mm_cmpeq_epi8(c, lt), _mm_cmpeq_epi8(c, amp)));
+
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+
+  for (; p < end && *p != '<' && *p != '&'; p++);
+  return p;
+}
+
+static const char *find_char(const char *p, const char *end, char c) {
+  const char *found = memchr(p, c, end - p);
+
+  return found ? found : end;
+}
+
+static const char *find_str(const char *p, const char *end, const char *str) {
+  const char *found = memmem(p, end - p, str, strlen(str));
+
+  return found ? found : end;
+}
+
+/* Render text as it lies in the input */
+static void render_input(struct fast_state *st, const char *text, size_t len) {
+  render_source(st->rctx, text - st->start, len);
+  render_text_len(st->rctx, (const char8_t *) text, len);
+}
+
+/* Render text decoded from the input, which does not outlive the call */
+static void render_copy(struct render_ctx *rctx, const char *text, size_t len) {
+  bool stable = rctx->text_stable;
+
+  rctx->text_stable = false;
+  render_text_len(rctx, (const char8_t *) text, len);
+  rctx->text_stable = stable;
+}
+
+/* Render the character reference at 'p', or the '&' alone if it does not
+ * start one, returning where to continue */
+static const char *reference(struct fast_state *st, const char *p) {
+  char decoded[ENTITY_MAX_UTF8];
+  size_t len;
+  size_t consumed = entity_decode(p, st->end - p, decoded, &len);
+
+  if (consumed) {
+    render_source(st->rctx, p - st->start, consumed);
+    render_copy(st->rctx, decoded, len);
+    return p + consumed;
+  }
+  render_input(st, p, 1);
+  return p + 1;
+}
+
+/* Render text with character references up to 'end' */
+static void rcdata(struct fast_state *st, const char *p, const char *end) {
+  while (p < end) {
+    const char *amp = find_char(p, end, '&');
+
+    if (amp > p)
+      render_input(st, p, amp - p);
+    if (amp == end)
+      break;
+    p = reference(st, amp);
+  }
+}
+
+/* Copy the tag name at 'p' into 'name' in lower case, or make 'name' empty
+ * if it is too long. Returns the end of the name in the input. */
+static const char *tag_name(const char *p, const char *end, char *name) {
+  size_t len;
+
+  for (len = 0; p < end && !is_space(*p) && *p != '/' && *p != '>'; p++, len++) {
+    if (len < max_tag - 1)
+      name[len] = *p >= 'A' && *p <= 'Z' ? *p | 0x20 : *p;
+  }
+  name[len < max_tag ? len : 0] = '\0';
+  return p;
+}
+
+/* Find the end of a tag's attributes, noting whether it closes itself, and
+ * return the position after the tag */
+static const char *end_of_tag(const char *p, const char *end, bool *self_closing) {
+  bool value = false;
+
+  *self_closing = false;
+  for (; p < end; p++) {
+    switch (*p) {
+    case '>':
+      *self_closing = p[-1] == '/';
+      return p + 1;
+    case '=':
+      value = true;
+      continue;
+    case '"':
+    case '\'':
+      if (value)
+        p = find_char(p + 1, end, *p);
+      break;
+    default:
+      if (is_space(*p))
+        continue;
+    }
+    value = false;
+  }
+  return end;
+}
+
+static bool is_void(const char *name) {
+  for (size_t i = 0; i < sizeof void_elements / sizeof *void_elements; i++)
+    if (!strcmp(name, void_elements[i]))
+      return true;
+  return false;
+}
+
+static bool is_foreign(const char *name) {
+  return !strcmp(name, "svg") || !strcmp(name, "math");
+}
+
+static enum content content_of(const char *name) {
+  for (size_t i = 0; i < sizeof special_elements / sizeof *special_elements; i++)
+    if (!strcmp(name, special_elements[i].name))
+      return special_elements[i].content;
+  return CONTENT_NORMAL;
+}
+
+/* Find the end tag for raw text content */
+static const char *find_end_tag(const char *p, const char *end, const char *name) {
+  size_t len = strlen(name);
+
+  for (; (p = find_char(p, end, '<')) < end; p++) {
+    if (end - p > len + 2 && p[1] == '/' &&
+        !strncasecmp(p + 2, name, len) &&
+        (is_space(p[len + 2]) || p[len + 2] == '/' || p[len + 2] == '>'))
+      return p;
+  }
+  return end;
+}
+
+static const char *start_tag(struct fast_state *st, const char *p) {
+  struct render_ctx *rctx = st->rctx;
+  const struct render_elem *rendering;
+  enum content content;
+  char name[max_tag];
+  bool self_closing;
+  const char *text;
+
+  p = tag_name(p + 1, st->end, name);
+  p = end_of_tag(p, st->end, &self_closing);
+
+  /* As in HTML, '/>' closes only void elements and foreign content */
+  self_closing = is_void(name) ||
+                 (self_closing && (st->foreign_depth || is_foreign(name)));
+  if (!self_closing && is_foreign(name))
+    st->foreign_depth++;
+
+  if (st->skip_depth) {
+    if (!self_closing && !strcmp(name, st->skip_tag))
+      st->skip_depth++;
+    return p;
+  }
+
+  rctx->stats->elements++;
+  rendering = name[0] ? get_rendering((const char8_t *) name) : nullptr;
+  render_element(rctx, (const char8_t *) name, false, rendering);
+
+  if (self_closing) {
+    render_element(rctx, (const char8_t *) name, true, rendering);
+    return p;
+  }
+
+  if ((content = content_of(name)) != CONTENT_NORMAL) {
+    /* Leave the end tag to be handled as usual */
+    text = p;
+    p = find_end_tag(p, st->end, name);
+    if (rendering && rendering->skip) {
+      rctx->stats->skipped++;
+    } else if (p > text) {
+      rctx->stats->texts++;
+      if (content == CONTENT_RAW)
+        render_input(st, text, p - text);
+      else
+        rcdata(st, text, p);
+    }
+  } else if (rendering && rendering->skip) {
+    rctx->stats->skipped++;
+    strcpy(st->skip_tag, name);
+    st->skip_depth = 1;
+  }
+
+  return p;
+}
+
+static const char *end_tag(struct fast_state *st, const char *p) {
+  char name[max_tag];
+  bool self_closing;
+
+  p = tag_name(p + 2, st->end, name);
+  p = end_of_tag(p, st->end, &self_closing);
+
+  if (st->foreign_depth && is_foreign(name))
+    st->foreign_depth--;
+
+  if (st->skip_depth &&
+      (strcmp(name, st->skip_tag) || --st->skip_depth))
+    return p;
+
+  render_element(st->rctx, (const char8_t *) name, true,
+                 name[0] ? get_rendering((const char8_t *) name) : nullptr);
+  return p;
+}
+
+/* Handle the markup starting with '<' at 'p', returning where to continue */
+static const char *markup(struct fast_state *st, const char *p) {
+  struct render_ctx *rctx = st->rctx;
+  const char *end = st->end;
+  const char *text;
+  size_t left = end - p;
+
+  if (left > 1 && is_alpha(p[1]))
+    return start_tag(st, p);
+
+  if (left > 2 && p[1] == '/' && is_alpha(p[2]))
+    return end_tag(st, p);
+
+  if (left >= 4 && !memcmp(p, "<!--", 4)) {
+    text = p + 4;
+    p = find_str(text, end, "-->");
+    if (!st->skip_depth) {
+      rctx->stats->comments++;
+      if (rctx->opt->comment)
+        render_input(st, text, p - text);
+    }
+    return p == end ? end : p + 3;
+  }
+
+  if (left >= 9 && !memcmp(p, "<![CDATA[", 9)) {
+    text = p + 9;
+    p = find_str(text, end, "]]>");
+    if (!st->skip_depth) {
+      rctx->stats->texts++;
+      if (!rctx->opt->cdata_is_comment || rctx->opt->comment)
+        render_input(st, text, p - text);
+    }
+    return p == end ? end : p + 3;
+  }
+
+  /* Doctype, processing instruction or bogus comment */
+  if (left > 1 && (p[1] == '!' || p[1] == '?' || p[1] == '/')) {
+    p = find_char(p, end, '>');
+    return p == end ? end : p + 1;
+  }
+
+  /* Not markup after all */
+  if (!st->skip_depth)
+    render_input(st, p, 1);
+  return p + 1;
+}
+
+/* Parse from 'p' until reaching 'stop', returning where parsing stopped,
+ * which is beyond 'stop' if markup or skipped content straddles it */
+static const char *parse_span(struct fast_state *st, const char *p, const char *stop) {
+  struct render_ctx *rctx = st->rctx;
+  const char *q;
+
+  while (p < stop && !rctx->stopped) {
+    if (st->skip_depth) {
+      if ((q = find_char(p, stop, '<')) == stop)
+        return stop;
+      p = markup(st, q);
+      continue;
+    }
+
+    q = find_markup(p, stop);
+    if (q > p) {
+      rctx->stats->texts++;
+      render_input(st, p, q - p);
+    }
+    if (q == stop)
+      return stop;
+    p = *q == '&' ? reference(st, q) : markup(st, q);
+  }
+  return p;
+}
+
+/* A part of a document, parsed on its own thread */
+struct part {
+  pthread_t thread;
+  bool started;
+  const char *start;
+  const char *stop;
+  const char *reached;
+  struct fast_state st;
+  struct render_ctx rctx;
+  struct output out;
+  struct output title;
+  struct doc_stats stats;
+};
+
+/* Find a start tag following the end of other markup or a line break, where
+ * a part is most likely to begin outside other markup */
+static const char *find_boundary(const char *p, const char *end) {
+  for (; (p = find_char(p, end, '<')) < end - 1; p++)
+    if (is_alpha(p[1]) && (p[-1] == '>' || p[-1] == '\n'))
+      return p;
+  return end;
+}
+
+static void *parse_part(void *arg) {
+  struct part *part = arg;
+
+  part->rctx.text_stable = true;
+  part->reached = parse_span(&part->st, part->start, part->stop);
+  part->rctx.text_stable = false;
+  return nullptr;
+}
+
+/* Parse the document in up to 'n' parts at once, the first on this thread */
+static int parse_parts(struct fast_state *st, int n) {
+  struct render_ctx *rctx = st->rctx;
+  size_t len = st->end - st->start;
+  struct part *parts;
+  const char *p;
+  int num = 1;
+  int i, rc;
+
+  if ((parts = calloc(n, sizeof *parts)) == nullptr) {
+    fprintf(stderr, "could not allocate document parts, %s\n", strerror(errno));
+    return 1;
+  }
+
+  /* Cut the document near equal intervals */
+  parts[0].start = st->start;
+  for (i = 1; i < n; i++) {
+    p = find_boundary(st->start + len / n * i, st->start + len / n * (i + 1));
+    if (p < st->end && p > parts[num - 1].start)
+      parts[num++].start = p;
+  }
+  for (i = 0; i < num; i++)
+    parts[i].stop = i + 1 < num ? parts[i + 1].start : st->end;
+  logv("parsing document in %d parts\n", num);
+
+  for (i = 1; i < num; i++) {
+    struct part *part = parts + i;
+
+    output_init(&part->out, -1);
+    render_init_part(&part->rctx, rctx, &part->out, &part->stats);
+    if (rctx->title) {
+      output_init(&part->title, -1);
+      part->rctx.title = &part->title;
+    }
+    part->st = (struct fast_state) {
+      .rctx = &part->rctx,
+      .start = st->start,
+      .end = st->end,
+    };
+    if ((rc = pthread_create(&part->thread, nullptr, parse_part, part)) != 0)
+      fprintf(stderr, "could not start thread for document part, %s\n", strerror(rc));
+    part->started = rc == 0;
+  }
+
+  rctx->text_stable = true;
+  p = parse_span(st, st->start, parts[0].stop);
+
+  for (i = 1; i < num; i++) {
+    struct part *part = parts + i;
+
+    if (part->started)
+      pthread_join(part->thread, nullptr);
+
+    /* Unless the part before ended exactly where this one starts, in the
+     * initial state, parse this part again continuing from there */
+    if (!part->started || p != part->start || st->skip_depth || st->foreign_depth ||
+        part->out.error || part->title.error) {
+      logv("parsing part %d of document again\n", i);
+      p = parse_span(st, p, part->stop);
+      continue;
+    }
+
+    render_join(rctx, &part->rctx);
+
+    /* The part may hold the first title, or the end of it */
+    if (rctx->title) {
+      output_write(rctx->title, part->title.buf, part->title.len);
+      if (!part->rctx.title)
+        rctx->title = nullptr;
+    }
+    rctx->stats->elements += part->stats.elements;
+    rctx->stats->texts += part->stats.texts;
+    rctx->stats->comments += part->stats.comments;
+    rctx->stats->skipped += part->stats.skipped;
+
+    memcpy(st->skip_tag, part->st.skip_tag, sizeof st->skip_tag);
+    st->skip_depth = part->st.skip_depth;
+    st->foreign_depth = part->st.foreign_depth;
+    p = part->reached;
+  }
+
+  /* The parts' text is referred to until written out */
+  render_sync(rctx);
+  rctx->text_stable = false;
+
+  for (i = 1; i < num; i++) {
+    output_free(&parts[i].out);
+    output_free(&parts[i].title);
+  }
+  free(parts);
+  return 0;
+}
+
+int parse_fast(struct mapped_buffer *input, struct render_ctx *rctx) {
+  struct fast_state st = {
+    .rctx = rctx,
+    .start = input->data,
+    .end = input->data + input->length - 1,
+  };
+  size_t parts = input->length / min_part;
+
+  if (parts > (size_t) rctx->opt->split)
+    parts = rctx->opt->split;
+
+  /* The offset map is made in the order in which text is rendered, and
+   * budgets are for the start of the text */
+  if (parts > 1 && !rctx->map &&
+      rctx->out_limit == SIZE_MAX && !rctx->deadline.tv_sec)
+    return parse_parts(&st, parts);
+
+  rctx->text_stable = true;
+  parse_span(&st, st.start, st.end);
+  render_sync(rctx);
+  rctx->text_stable = false;
+
+  return 0;
+}
@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _PARSE_FAST_H
+#define _PARSE_FAST_H
+
+#include "unhtml.h"
+
+#define FAST_PARSERS &parser_fast,
+
+extern int parse_fast(struct mapped_buffer *input, struct render_ctx *rctx);
+
+static const struct parser_defn parser_fast = {
+  .name       = "fast",
+  .parse_fn   = parse_fast,
+};
+
+#endif
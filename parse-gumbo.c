@@ -5,16 +5,91 @@
  *
  * Uses libgumbo to parse the HTML, walks the resultant tree and renders
  * only text content. The output is in UTF-8.
+ *
+ * Where gumbo takes a custom allocator, its nodes, vectors and strings are
+ * carved out of an arena instead of being allocated one by one, and the
+ * tree is released all at once by emptying the arena, which is kept for
+ * the next document parsed on the same thread.
  */
 
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <uchar.h>
 #include <gumbo.h>
 
 #include "config.h"
 #include "render.h"
+#include "arena.h"
 #include "parse-gumbo.h"
 
-static void walk_tree(GumboNode *node) {
+/* Rendering for each known tag, looked up once the config is loaded */
+static const struct render_elem *tag_rendering[GUMBO_TAG_UNKNOWN];
+
+#ifdef WITH_GUMBO_ARENA
+static pthread_key_t arena_key;
+
+static void *gumbo_alloc(void *userdata, size_t size) {
+  return arena_alloc(userdata, size);
+}
+
+/* Memory is only released when the arena is emptied */
+static void gumbo_free(void *userdata, void *ptr) {
+}
+
+static void free_arena(void *arena) {
+  arena_release(arena);
+  free(arena);
+}
+
+/* The arena for the calling thread */
+static struct arena *get_arena(void) {
+  struct arena *arena = pthread_getspecific(arena_key);
+
+  if (!arena && (arena = calloc(1, sizeof *arena)) &&
+      pthread_setspecific(arena_key, arena) != 0) {
+    free(arena);
+    arena = nullptr;
+  }
+  return arena;
+}
+#endif
+
+void init_gumbo(void) {
+#ifdef WITH_GUMBO_ARENA
+  pthread_key_create(&arena_key, free_arena);
+#endif
+}
+
+void configure_gumbo(void) {
+  for (int tag = 0; tag < GUMBO_TAG_UNKNOWN; tag++)
+    tag_rendering[tag] = get_rendering((const char8_t *) gumbo_normalized_tagname(tag));
+}
+
+static inline GumboVector *node_children(GumboNode *node) {
+  switch (node->type) {
+  case GUMBO_NODE_DOCUMENT:
+    return &node->v.document.children;
+  case GUMBO_NODE_ELEMENT:
+    return &node->v.element.children;
+  default:
+    return nullptr;
+  }
+}
+
+static inline const struct render_elem *node_rendering(GumboNode *node) {
+  return node->v.element.tag < GUMBO_TAG_UNKNOWN ?
+    tag_rendering[node->v.element.tag] : nullptr;
+}
+
+static inline const char8_t *node_tag(GumboNode *node) {
+  return node->v.element.tag < GUMBO_TAG_UNKNOWN ?
+    (char8_t *) gumbo_normalized_tagname(node->v.element.tag) : nullptr;
+}
+
+/* Render a node on the way down the tree, returning the first of its
+ * children to descend to, if any */
+static GumboNode *enter_node(struct render_ctx *rctx, GumboNode *node) {
   /* By default, neither render content nor descend tree further */
   GumboVector *children = nullptr;
   GumboText *text = nullptr;
@@ -23,53 +98,131 @@ static void walk_tree(GumboNode *node) {
 
   switch (node->type) {
   case GUMBO_NODE_CDATA:
-    if (!opt.cdata_is_comment || opt.comment)
+    rctx->stats->texts++;
+    if (!rctx->opt->cdata_is_comment || rctx->opt->comment)
       text = &node->v.text;
     break;
   case GUMBO_NODE_COMMENT:
-    if (opt.comment)
+    rctx->stats->comments++;
+    if (rctx->opt->comment)
       text = &node->v.text;
     break;
   case GUMBO_NODE_TEXT:
   case GUMBO_NODE_WHITESPACE:
+    rctx->stats->texts++;
     text = &node->v.text;
     break;
   case GUMBO_NODE_DOCUMENT:
     children = &node->v.document.children;
     break;
   case GUMBO_NODE_ELEMENT:
+    rctx->stats->elements++;
     children = &node->v.element.children;
-    if (node->v.element.tag < GUMBO_TAG_UNKNOWN) {
-      tag = (char8_t *) gumbo_normalized_tagname(node->v.element.tag);
-      rendering = get_rendering(tag);
-    }
+    tag = node_tag(node);
+    rendering = node_rendering(node);
     break;
   default:
     /* Do nothing */
   }
 
-  if (text)
-    render_text((char8_t *) text->text);
+  if (text) {
+    render_source(rctx, text->start_pos.offset, text->original_text.length);
+    render_text(rctx, (char8_t *) text->text);
+  }
 
   if (children) {
-    render_element(tag, false, rendering);
-    if (!rendering || !rendering->skip)
-      for (int child = 0; child < children->length; child++)
-        walk_tree((GumboNode *) children->data[child]);
-    render_element(tag, true, rendering);
+    render_element(rctx, tag, false, rendering);
+    if (rendering && rendering->skip)
+      rctx->stats->skipped++;
+    else if (children->length)
+      return children->data[0];
+  }
+
+  return nullptr;
+}
+
+/* Render a node on the way back up the tree */
+static void leave_node(struct render_ctx *rctx, GumboNode *node) {
+  switch (node->type) {
+  case GUMBO_NODE_DOCUMENT:
+    render_element(rctx, nullptr, true, nullptr);
+    break;
+  case GUMBO_NODE_ELEMENT:
+    render_element(rctx, node_tag(node), true, node_rendering(node));
+    break;
+  default:
+    /* Do nothing */
   }
 }
 
-int parse_tagsoup(struct mapped_buffer *input) {
+/* Walk the tree without recursion, finding the way back up by the nodes'
+ * parent links, so that the depth of the document makes no difference to
+ * the stack or memory needed. */
+static void walk_tree(struct render_ctx *rctx, GumboNode *root) {
+  GumboNode *node = root;
+  GumboNode *child;
+
+  while (node && !rctx->stopped) {
+    if ((child = enter_node(rctx, node))) {
+      node = child;
+      continue;
+    }
+
+    for (;;) {
+      GumboVector *siblings;
+
+      leave_node(rctx, node);
+      if (node == root)
+        return;
+      siblings = node_children(node->parent);
+      if (node->index_within_parent + 1 < siblings->length) {
+        node = siblings->data[node->index_within_parent + 1];
+        break;
+      }
+      node = node->parent;
+    }
+  }
+}
+
+int parse_tagsoup(struct mapped_buffer *input, struct render_ctx *rctx) {
+  GumboOptions options = kGumboDefaultOptions;
   GumboOutput *doc;
+#ifdef WITH_GUMBO_ARENA
+  struct arena *arena = get_arena();
 
-  doc = gumbo_parse(input->data);
+  if (arena) {
+    options.allocator = gumbo_alloc;
+    options.deallocator = gumbo_free;
+    options.userdata = arena;
+  }
+#endif
+
+  /* According to gumbo.h, the maximum input buffer size is 4GB */
+  if (input->length - 1 > 0xFFFF'FFFFul) {
+    fprintf(stderr, "input too big for the tagsoup parser (>4GB)\n");
+    return 1;
+  }
+
+  doc = gumbo_parse_with_options(&options, input->data, input->length - 1);
   if (doc) {
-    walk_tree(doc->root);
-    gumbo_destroy_output(&kGumboDefaultOptions, doc);
+    stats_enter(rctx->stats, PHASE_WALK);
+    rctx->text_stable = true;
+    walk_tree(rctx, doc->root);
+    render_sync(rctx);
+    rctx->text_stable = false;
+    stats_enter(rctx->stats, PHASE_PARSE);
   } else {
     fprintf(stderr, "html parsing failed\n");
   }
 
+#ifdef WITH_GUMBO_ARENA
+  if (arena) {
+    arena_reset(arena);
+    return 0;
+  }
+#endif
+  if (doc)
+    gumbo_destroy_output(&options, doc);
+
   return 0;
 }
@@ -11,10 +11,14 @@
 
 #define GUMBO_PARSERS &parser_tagsoup,
 
-extern int parse_tagsoup(struct mapped_buffer *input);
+extern void init_gumbo(void);
+extern void configure_gumbo(void);
+extern int parse_tagsoup(struct mapped_buffer *input, struct render_ctx *rctx);
 
 static const struct parser_defn parser_tagsoup = {
   .name       = "tagsoup",
+  .init_fn    = init_gumbo,
+  .config_fn  = configure_gumbo,
   .parse_fn   = parse_tagsoup,
   .imatch_pat = "<!DOCTYPE +html( +SYSTEM +\"about:legacy-compat\")? *>",
 };
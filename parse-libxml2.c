@@ -5,39 +5,311 @@
  *
  * Uses libxml to parse the HTML, walks the resultant tree and renders
  * only text content. The output is in UTF-8.
+ *
+ * Alternatively, in streaming mode, drives libxml's SAX push parser and
+ * renders directly from the callbacks without building a tree.
+ *
+ * Each thread keeps its parser contexts, and with them their dictionaries
+ * of names, from one document to the next. Optionally, all that libxml
+ * allocates while parsing a document comes from a pool, which is emptied
+ * once the document is rendered instead of freeing the tree.
  */
 
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <uchar.h>
 #include <libxml/HTMLparser.h>
+#include <libxml/catalog.h>
 #include <libxml/parser.h>
+#include <libxml/parserInternals.h>
+#include <libxml/xmlmemory.h>
+#include <libxml/SAX2.h>
 
 #include "config.h"
 #include "render.h"
+#include "arena.h"
+#include "charset.h"
 #include "parse-libxml2.h"
 
-static void walk_tree(xmlNode *node) {
+/* Number of names in a context's dictionary beyond which the context is
+ * replaced rather than used for another document */
+static constexpr size_t max_dict_names = 0x10000;
+
+/* Element names from libxml's parser are interned in the document's
+ * dictionary, so a cache keyed by the name pointer saves looking up the
+ * rendering of each element by string. Colliding entries just replace each
+ * other. */
+struct name_cache {
+  struct {
+    const xmlChar *name;
+    const struct render_elem *rendering;
+  } slot[64];
+};
+
+static const struct render_elem *lookup_rendering(struct name_cache *cache,
+                                                  const xmlChar *name) {
+  size_t i = ((uintptr_t) name >> 3) % (sizeof cache->slot / sizeof *cache->slot);
+
+  if (cache->slot[i].name != name) {
+    cache->slot[i].name = name;
+    cache->slot[i].rendering = get_rendering(name);
+  }
+  return cache->slot[i].rendering;
+}
+
+struct walk_state {
+  struct render_ctx *rctx;
+  struct name_cache names;
+};
+
+struct contexts {
+  htmlParserCtxtPtr html;
+  xmlParserCtxtPtr xml;
+};
+
+/* Memory from which libxml allocates while parsing a document, preceded by
+ * a header giving the size of each allocation */
+struct pool {
+  struct arena arena;
+  bool active;
+};
+
+struct pool_header {
+  alignas(max_align_t) size_t size;
+};
+
+static pthread_once_t keys_once = PTHREAD_ONCE_INIT;
+static pthread_key_t contexts_key;
+static pthread_key_t pool_key;
+static thread_local struct pool *thread_pool;
+static bool pool_installed;
+static xmlExternalEntityLoader default_loader;
+static xmlCharEncodingHandlerPtr utf8_handler;
+static xmlCharEncodingHandlerPtr windows_1252_handler;
+
+static void free_contexts(void *data) {
+  struct contexts *ctxs = data;
+
+  if (ctxs->html)
+    htmlFreeParserCtxt(ctxs->html);
+  if (ctxs->xml)
+    xmlFreeParserCtxt(ctxs->xml);
+  free(ctxs);
+}
+
+static void free_pool(void *data) {
+  struct pool *pool = data;
+
+  arena_release(&pool->arena);
+  free(pool);
+}
+
+static void create_keys(void) {
+  pthread_key_create(&contexts_key, free_contexts);
+  pthread_key_create(&pool_key, free_pool);
+}
+
+void init_libxml2(void) {
+  /* Required before parsing on multiple threads */
+  xmlInitParser();
+  pthread_once(&keys_once, create_keys);
+
+  /* Decode UTF-8 and Windows-1252 as the input of the tree parsers is
+   * converted, where libxml would stop at bytes it cannot decode. The
+   * encoders let libxml count the input consumed, for the offset map. */
+  if (!utf8_handler) {
+    utf8_handler = xmlNewCharEncodingHandler("unhtml-utf-8",
+                                             utf8_repair_decode, utf8_encode);
+    windows_1252_handler = xmlNewCharEncodingHandler("unhtml-windows-1252",
+                                                     windows_1252_decode,
+                                                     windows_1252_encode);
+  }
+}
+
+/* The pool hooks serve allocations from the calling thread's pool while it
+ * is parsing a document and from the C library otherwise. Memory is
+ * returned to the pool only when it is emptied. */
+static void *pool_malloc(size_t size) {
+  struct pool *pool = thread_pool;
+  struct pool_header *h;
+
+  if (!pool || !pool->active)
+    return malloc(size);
+  if ((h = arena_alloc(&pool->arena, sizeof *h + size)) == nullptr)
+    return nullptr;
+  h->size = size;
+  return h + 1;
+}
+
+static inline bool in_pool(void *ptr) {
+  return thread_pool && arena_contains(&thread_pool->arena, ptr);
+}
+
+static void pool_free(void *ptr) {
+  if (ptr && !in_pool(ptr))
+    free(ptr);
+}
+
+static void *pool_realloc(void *ptr, size_t size) {
+  struct pool_header *h;
+  void *moved;
+
+  if (!ptr)
+    return pool_malloc(size);
+  if (!in_pool(ptr))
+    return realloc(ptr, size);
+
+  h = (struct pool_header *) ptr - 1;
+  if (size <= h->size)
+    return ptr;
+  if (arena_extend(&thread_pool->arena, h, sizeof *h + h->size, sizeof *h + size)) {
+    h->size = size;
+    return ptr;
+  }
+  if ((moved = pool_malloc(size)) != nullptr)
+    memcpy(moved, ptr, h->size);
+  return moved;
+}
+
+static char *pool_strdup(const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = pool_malloc(len);
+
+  return copy ? memcpy(copy, str, len) : nullptr;
+}
+
+/* Load external entities outside the pool, since libxml reads in its
+ * catalogs, which outlive the document, only when first resolving one */
+static xmlParserInputPtr pool_entity_loader(const char *url, const char *id,
+                                            xmlParserCtxtPtr ctxt) {
+  struct pool *pool = thread_pool;
+  bool active = pool && pool->active;
+  xmlParserInputPtr input;
+
+  if (!active)
+    return default_loader(url, id, ctxt);
+
+  pool->active = false;
+  input = default_loader(url, id, ctxt);
+  /* Any error, already reported, would otherwise be left in the context
+   * and never freed */
+  if (ctxt)
+    xmlCtxtResetLastError(ctxt);
+  pool->active = true;
+  return input;
+}
+
+/* Install the pool hooks if asked for. libxml's own long-lived state, such
+ * as the catalogs, is set up first so that it never comes from a pool. */
+void configure_libxml2(void) {
+  if (!opt.xml_pool || pool_installed)
+    return;
+
+#ifdef LIBXML_CATALOG_ENABLED
+  xmlInitializeCatalog();
+#endif
+  if (xmlMemSetup(pool_free, pool_malloc, pool_realloc, pool_strdup) != 0) {
+    fprintf(stderr, "could not install memory pool for libxml\n");
+    return;
+  }
+  default_loader = xmlGetExternalEntityLoader();
+  xmlSetExternalEntityLoader(pool_entity_loader);
+  pool_installed = true;
+}
+
+/* Start allocating from the thread's pool, if pools are in use, returning
+ * the pool */
+static struct pool *pool_begin(void) {
+  struct pool *pool;
+
+  if (!pool_installed)
+    return nullptr;
+
+  if (!(pool = pthread_getspecific(pool_key))) {
+    if (!(pool = calloc(1, sizeof *pool)))
+      return nullptr;
+    if (pthread_setspecific(pool_key, pool) != 0) {
+      free(pool);
+      return nullptr;
+    }
+  }
+  thread_pool = pool;
+  pool->active = true;
+  return pool;
+}
+
+/* Release everything allocated from the pool since pool_begin() */
+static void pool_end(struct pool *pool) {
+  if (!pool)
+    return;
+
+  /* The last error is kept beyond the document */
+  xmlResetLastError();
+  pool->active = false;
+  arena_reset(&pool->arena);
+}
+
+/* A parser context kept by the thread for reuse, or a new one if it has
+ * collected too many names */
+static xmlParserCtxtPtr get_context(bool html) {
+  struct contexts *ctxs = pthread_getspecific(contexts_key);
+  xmlParserCtxtPtr *ctx;
+
+  if (!ctxs) {
+    if (!(ctxs = calloc(1, sizeof *ctxs)))
+      return nullptr;
+    if (pthread_setspecific(contexts_key, ctxs) != 0) {
+      free(ctxs);
+      return nullptr;
+    }
+  }
+
+  ctx = html ? &ctxs->html : &ctxs->xml;
+  if (*ctx && xmlDictSize((*ctx)->dict) > max_dict_names) {
+    if (html)
+      htmlFreeParserCtxt(*ctx);
+    else
+      xmlFreeParserCtxt(*ctx);
+    *ctx = nullptr;
+  }
+  if (!*ctx)
+    *ctx = html ? htmlNewParserCtxt() : xmlNewParserCtxt();
+  return *ctx;
+}
+
+/* Render a node on the way down the tree, returning the first of its
+ * children to descend to, if any */
+static xmlNode *enter_node(struct walk_state *walk, xmlNode *node) {
   /* By default, neither render content nor descend tree further */
+  struct render_ctx *rctx = walk->rctx;
   bool follow = false;
   bool content = false;
   const struct render_elem *rendering = nullptr;
 
   switch (node->type) {
   case XML_CDATA_SECTION_NODE:
-    if (!opt.cdata_is_comment || opt.comment)
+    rctx->stats->texts++;
+    if (!rctx->opt->cdata_is_comment || rctx->opt->comment)
       content = true;
     break;
   case XML_COMMENT_NODE:
-    if (opt.comment)
+    rctx->stats->comments++;
+    if (rctx->opt->comment)
       content = true;
     break;
   case XML_TEXT_NODE:
+    rctx->stats->texts++;
     content = true;
     break;
   case XML_DOCUMENT_NODE:
     follow = true;
     break;
   case XML_ELEMENT_NODE:
-    rendering = get_rendering(node->name);
+    rctx->stats->elements++;
+    rendering = lookup_rendering(&walk->names, node->name);
     follow = true;
     break;
   default:
@@ -45,85 +317,458 @@ static void walk_tree(xmlNode *node) {
   }
 
   if (content)
-    render_text(node->content);
+    render_text(rctx, node->content);
 
   if (follow) {
-    render_element(node->name, false, rendering);
+    render_element(rctx, node->name, false, rendering);
     if (!rendering || !rendering->skip)
-      for (xmlNode *child = node->children; child; child = child->next)
-        walk_tree(child);
-    render_element(node->name, true, rendering);
+      return node->children;
+    rctx->stats->skipped++;
+  }
+
+  return nullptr;
+}
+
+/* Render a node on the way back up the tree */
+static void leave_node(struct walk_state *walk, xmlNode *node) {
+  switch (node->type) {
+  case XML_DOCUMENT_NODE:
+    render_element(walk->rctx, node->name, true, nullptr);
+    break;
+  case XML_ELEMENT_NODE:
+    render_element(walk->rctx, node->name, true,
+                   lookup_rendering(&walk->names, node->name));
+    break;
+  default:
+    /* Do nothing */
+  }
+}
+
+/* Walk the tree without recursion, finding the way back up by the nodes'
+ * parent links, so that the depth of the document makes no difference to
+ * the stack or memory needed. */
+static void walk_tree(struct walk_state *walk, xmlNode *root) {
+  xmlNode *node = root;
+  xmlNode *child;
+
+  while (node && !walk->rctx->stopped) {
+    if ((child = enter_node(walk, node))) {
+      node = child;
+      continue;
+    }
+
+    for (;;) {
+      leave_node(walk, node);
+      if (node == root)
+        return;
+      if (node->next) {
+        node = node->next;
+        break;
+      }
+      node = node->parent;
+    }
   }
 }
 
-int parse_html(struct mapped_buffer *input) {
+/* libxml2 takes the size of a document in memory as an int */
+static bool too_big(const struct mapped_buffer *input) {
+  if (input->length - 1 <= INT_MAX)
+    return false;
+  fprintf(stderr, "input too big to parse without -stream (>2GB)\n");
+  return true;
+}
+
+int parse_html(struct mapped_buffer *input, struct render_ctx *rctx) {
+  struct pool *pool = pool_begin();
   htmlParserCtxtPtr ctx;
   htmlDocPtr doc;
   xmlNode *root;
   int rc = 1;
   int options =
     HTML_PARSE_NOERROR |
-    HTML_PARSE_NOWARNING;
+    HTML_PARSE_NOWARNING |
+    HTML_PARSE_COMPACT |
+    (opt.huge ? XML_PARSE_HUGE : 0);
+
+  if (too_big(input))
+    goto fail1;
 
-  if ((ctx = htmlNewParserCtxt()) == NULL)
+  /* Anything allocated from the pool goes when it is emptied */
+  if ((ctx = pool ? htmlNewParserCtxt() : get_context(true)) == NULL)
     goto fail1;
 
   if ((doc = htmlCtxtReadMemory(ctx,
                                 input->data,
                                 input->length - 1,
                                 input->uri,
-                                NULL, options)) == NULL)
-    goto fail2;
+                                input->utf8 ? "UTF-8" : NULL,
+                                options)) == NULL)
+    goto fail1;
 
   if ((root = xmlDocGetRootElement(doc)) == NULL)
-    goto fail3;
+    goto fail2;
 
-  walk_tree(root);
+  stats_enter(rctx->stats, PHASE_WALK);
+  rctx->text_stable = true;
+  walk_tree(&(struct walk_state) { .rctx = rctx }, root);
+  render_sync(rctx);
+  rctx->text_stable = false;
+  stats_enter(rctx->stats, PHASE_PARSE);
   rc = 0;
 
-fail3:
-  xmlFreeDoc(doc);
-
 fail2:
-  htmlFreeParserCtxt(ctx);
+  if (!pool)
+    xmlFreeDoc(doc);
 
 fail1:
+  pool_end(pool);
   if (rc != 0)
     fprintf(stderr, "html parsing failed\n");
 
   return rc;
 }
 
-int parse_xml(struct mapped_buffer *input) {
+int parse_xml(struct mapped_buffer *input, struct render_ctx *rctx) {
+  struct pool *pool = pool_begin();
   xmlParserCtxtPtr ctx;
   xmlDocPtr doc;
   xmlNode *root;
   int rc = 1;
-  int options = XML_PARSE_DTDLOAD;
+  int options = XML_PARSE_DTDLOAD | XML_PARSE_COMPACT |
+                (opt.huge ? XML_PARSE_HUGE : 0);
+
+  /* Make what can be made of input cut short */
+  if (rctx->cut_short)
+    options |= XML_PARSE_RECOVER;
 
-  if ((ctx = xmlNewParserCtxt()) == NULL)
+  if (too_big(input))
+    goto fail1;
+
+  if ((ctx = pool ? xmlNewParserCtxt() : get_context(false)) == NULL)
     goto fail1;
 
   if ((doc = xmlCtxtReadMemory(ctx,
                                input->data,
                                input->length - 1,
                                input->uri,
-                               NULL, options)) == NULL)
-    goto fail2;
+                               input->utf8 ? "UTF-8" : NULL,
+                               options)) == NULL)
+    goto fail1;
 
   if ((root = xmlDocGetRootElement(doc)) == NULL)
-    goto fail3;
+    goto fail2;
 
-  walk_tree(root);
+  stats_enter(rctx->stats, PHASE_WALK);
+  rctx->text_stable = true;
+  walk_tree(&(struct walk_state) { .rctx = rctx }, root);
+  render_sync(rctx);
+  rctx->text_stable = false;
+  stats_enter(rctx->stats, PHASE_PARSE);
   rc = 0;
 
-fail3:
-  xmlFreeDoc(doc);
-
 fail2:
-  xmlFreeParserCtxt(ctx);
+  if (!pool)
+    xmlFreeDoc(doc);
+
+fail1:
+  pool_end(pool);
+  if (rc != 0)
+    fprintf(stderr, "xml parsing failed\n");
+
+  return rc;
+}
+
+/* Streaming mode
+ *
+ * The SAX callbacks are passed the parser context so that libxml's default
+ * SAX2 handlers for the document prolog remain usable. Our own state hangs
+ * off the context's _private field.
+ */
+
+/* Amount of input to feed to the push parser at a time */
+static constexpr size_t stream_chunk = 0x10000;
+
+struct sax_state {
+  struct render_ctx *rctx;
+  struct name_cache names;
+  /* Depth within a skipped subtree, counting the skipped element itself */
+  unsigned int skip_depth;
+  /* Length of any byte order mark, which is not given to the parser */
+  size_t bom_len;
+};
+
+static inline struct sax_state *sax_state(void *ctx) {
+  return ((xmlParserCtxtPtr) ctx)->_private;
+}
+
+/* Tell the renderer where text passed to a callback came from, when it is
+ * keeping an offset map. libxml passes text in place where it can, and
+ * otherwise has just consumed it, in which case the offset is only as good
+ * as the assumption that the text is as long as its source. */
+static void sax_source(void *ctx, const xmlChar *ch, size_t len) {
+  xmlParserInputPtr in = ((xmlParserCtxtPtr) ctx)->input;
+  struct render_ctx *rctx = sax_state(ctx)->rctx;
+  long consumed;
+
+  if (!rctx->map || (consumed = xmlByteConsumed(ctx)) < 0)
+    return;
+
+  consumed += sax_state(ctx)->bom_len;
+  if (in && ch >= in->base && ch < in->end)
+    render_source(rctx, consumed + (ch - in->cur), len);
+  else
+    render_source(rctx, (size_t) consumed > len ? consumed - len : 0, len);
+}
+
+static void sax_start(struct sax_state *state, const xmlChar *name) {
+  const struct render_elem *rendering;
+
+  if (state->skip_depth) {
+    state->skip_depth++;
+    return;
+  }
+
+  state->rctx->stats->elements++;
+  rendering = lookup_rendering(&state->names, name);
+  render_element(state->rctx, name, false, rendering);
+  if (rendering && rendering->skip) {
+    state->rctx->stats->skipped++;
+    state->skip_depth = 1;
+  }
+}
+
+static void sax_end(struct sax_state *state, const xmlChar *name) {
+  if (state->skip_depth && --state->skip_depth)
+    return;
+
+  render_element(state->rctx, name, true,
+                 lookup_rendering(&state->names, name));
+}
+
+static void sax_start_element(void *ctx, const xmlChar *name,
+                              const xmlChar **attrs) {
+  sax_start(sax_state(ctx), name);
+}
+
+static void sax_end_element(void *ctx, const xmlChar *name) {
+  sax_end(sax_state(ctx), name);
+}
+
+static void sax_start_element_ns(void *ctx, const xmlChar *localname,
+                                 const xmlChar *prefix, const xmlChar *uri,
+                                 int nb_namespaces, const xmlChar **namespaces,
+                                 int nb_attributes, int nb_defaulted,
+                                 const xmlChar **attributes) {
+  sax_start(sax_state(ctx), localname);
+}
+
+static void sax_end_element_ns(void *ctx, const xmlChar *localname,
+                               const xmlChar *prefix, const xmlChar *uri) {
+  sax_end(sax_state(ctx), localname);
+}
+
+static void sax_characters(void *ctx, const xmlChar *ch, int len) {
+  struct sax_state *state = sax_state(ctx);
+
+  if (!state->skip_depth) {
+    state->rctx->stats->texts++;
+    sax_source(ctx, ch, len);
+    render_text_len(state->rctx, ch, len);
+  }
+}
+
+static void sax_cdata(void *ctx, const xmlChar *value, int len) {
+  struct sax_state *state = sax_state(ctx);
+  const struct options *opt = state->rctx->opt;
+
+  if (state->skip_depth)
+    return;
+
+  state->rctx->stats->texts++;
+  if (!opt->cdata_is_comment || opt->comment) {
+    sax_source(ctx, value, len);
+    render_text_len(state->rctx, value, len);
+  }
+}
+
+static void sax_comment(void *ctx, const xmlChar *value) {
+  struct sax_state *state = sax_state(ctx);
+
+  if (state->skip_depth)
+    return;
+
+  state->rctx->stats->comments++;
+  if (state->rctx->opt->comment) {
+    sax_source(ctx, value, strlen((const char *) value));
+    render_text(state->rctx, value);
+  }
+}
+
+static void sax_ignore(void *ctx, const xmlChar *ch, int len) {
+}
+
+static void sax_reference(void *ctx, const xmlChar *name) {
+}
+
+static void sax_override(xmlSAXHandler *sax) {
+  sax->characters = sax_characters;
+  sax->cdataBlock = sax_cdata;
+  sax->comment = sax_comment;
+  sax->reference = sax_reference;
+}
+
+/* Feed the parser the input up to any limit, stopping it early if rendering
+ * stops, in which case the input is marked as cut short */
+static int feed_stream(xmlParserCtxtPtr ctx,
+                       int (*parse_chunk)(xmlParserCtxtPtr, const char *, int, int),
+                       struct mapped_buffer *input) {
+  struct render_ctx *rctx = sax_state(ctx)->rctx;
+  size_t left = rctx->opt->max_input ? rctx->opt->max_input : SIZE_MAX;
+  size_t bom_len = sax_state(ctx)->bom_len;
+  size_t remaining = input->length - 1 - bom_len;
+  const char *next = input->data + bom_len;
+  bool cut;
+  ssize_t got;
+  int rc;
+
+  do {
+    size_t len;
+
+    /* First the input that has already been read, then whatever remains
+     * unread, as it arrives */
+    if (remaining == 0 && input->stream) {
+      if ((got = refill_stream(input)) == -1)
+        return 1;
+      next = input->data;
+      remaining = got;
+    }
+
+    len = remaining > stream_chunk ? stream_chunk : remaining;
+    if ((cut = len >= left))
+      len = left;
+    left -= len;
+    remaining -= len;
+    cut = cut && (remaining || input->stream);
+
+    rc = parse_chunk(ctx, next, len, cut || (remaining == 0 && !input->stream));
+    next += len;
+
+    if (render_stopped(rctx)) {
+      xmlStopParser(ctx);
+      cut = true;
+    }
+  } while (rc == 0 && !cut && (remaining || input->stream));
+
+  /* Input cut short is not expected to parse cleanly */
+  if (cut) {
+    rctx->cut_short = true;
+    rc = 0;
+  }
+  return rc;
+}
+
+/* Have the push parser decode the input as the tree parsers' input is
+ * converted, though judged from the head of it alone, leaving out any byte
+ * order mark */
+static void set_stream_encoding(xmlParserCtxtPtr ctx, struct mapped_buffer *input,
+                                const char *hint) {
+  char label[CHARSET_MAX_LABEL];
+  xmlCharEncodingHandlerPtr handler;
+  const char *name;
+
+  name = stream_charset(input, hint, &sax_state(ctx)->bom_len, label);
+
+  if (!strcmp(name, "UTF-8")) {
+    handler = utf8_handler;
+  } else if (!strcmp(name, "windows-1252")) {
+    handler = windows_1252_handler;
+  } else if (!(handler = xmlFindCharEncodingHandler(name))) {
+    logv("unknown charset %s, assuming windows-1252\n", name);
+    handler = windows_1252_handler;
+  }
+  if (handler)
+    xmlSwitchToEncoding(ctx, handler);
+}
+
+int parse_html_stream(struct mapped_buffer *input, struct render_ctx *rctx) {
+  struct sax_state state = { .rctx = rctx };
+  struct pool *pool = pool_begin();
+  htmlParserCtxtPtr ctx;
+  xmlSAXHandler sax;
+  int rc = 1;
+  int options =
+    HTML_PARSE_NOERROR |
+    HTML_PARSE_NOWARNING |
+    (opt.huge ? XML_PARSE_HUGE : 0);
+
+  /* As with the tree builder, blank text nodes are dropped */
+  memset(&sax, '\0', sizeof sax);
+  xmlSAX2InitHtmlDefaultSAXHandler(&sax);
+  sax_override(&sax);
+  sax.startElement = sax_start_element;
+  sax.endElement = sax_end_element;
+  sax.ignorableWhitespace = sax_ignore;
+
+  if ((ctx = htmlCreatePushParserCtxt(&sax, NULL, NULL, 0, input->uri,
+                                      XML_CHAR_ENCODING_NONE)) == NULL)
+    goto fail1;
+
+  ctx->_private = &state;
+  htmlCtxtUseOptions(ctx, options);
+  set_stream_encoding(ctx, input, rctx->opt->charset);
+
+  if (feed_stream(ctx, htmlParseChunk, input) == 0)
+    rc = 0;
+
+  if (!pool) {
+    if (ctx->myDoc)
+      xmlFreeDoc(ctx->myDoc);
+    htmlFreeParserCtxt(ctx);
+  }
+
+fail1:
+  pool_end(pool);
+  if (rc != 0)
+    fprintf(stderr, "html parsing failed\n");
+
+  return rc;
+}
+
+int parse_xml_stream(struct mapped_buffer *input, struct render_ctx *rctx) {
+  struct sax_state state = { .rctx = rctx };
+  struct pool *pool = pool_begin();
+  xmlParserCtxtPtr ctx;
+  xmlSAXHandler sax;
+  int rc = 1;
+  int options = XML_PARSE_DTDLOAD | (opt.huge ? XML_PARSE_HUGE : 0);
+
+  memset(&sax, '\0', sizeof sax);
+  xmlSAXVersion(&sax, 2);
+  sax_override(&sax);
+  sax.startElementNs = sax_start_element_ns;
+  sax.endElementNs = sax_end_element_ns;
+  sax.ignorableWhitespace = sax_characters;
+
+  if ((ctx = xmlCreatePushParserCtxt(&sax, NULL, NULL, 0,
+                                     input->uri)) == NULL)
+    goto fail1;
+
+  ctx->_private = &state;
+  xmlCtxtUseOptions(ctx, options);
+  set_stream_encoding(ctx, input, rctx->opt->charset);
+
+  if (feed_stream(ctx, xmlParseChunk, input) == 0 &&
+      (ctx->wellFormed || rctx->cut_short))
+    rc = 0;
+
+  if (!pool) {
+    if (ctx->myDoc)
+      xmlFreeDoc(ctx->myDoc);
+    xmlFreeParserCtxt(ctx);
+  }
 
 fail1:
+  pool_end(pool);
   if (rc != 0)
     fprintf(stderr, "xml parsing failed\n");
 
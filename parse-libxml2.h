@@ -11,18 +11,28 @@
 
 #define LIBXML2_PARSERS &parser_html, &parser_xml,
 
-extern int parse_html(struct mapped_buffer *input);
-extern int parse_xml(struct mapped_buffer *input);
+extern void init_libxml2(void);
+extern void configure_libxml2(void);
+extern int parse_html(struct mapped_buffer *input, struct render_ctx *rctx);
+extern int parse_xml(struct mapped_buffer *input, struct render_ctx *rctx);
+extern int parse_html_stream(struct mapped_buffer *input, struct render_ctx *rctx);
+extern int parse_xml_stream(struct mapped_buffer *input, struct render_ctx *rctx);
 
 static const struct parser_defn parser_html = {
   .name       = "html",
+  .init_fn    = init_libxml2,
+  .config_fn  = configure_libxml2,
   .parse_fn   = parse_html,
+  .stream_fn  = parse_html_stream,
   .imatch_pat = "<!DOCTYPE +HTML +PUBLIC +\"-//W3C//DTD +HTML",
 };
 
 static const struct parser_defn parser_xml = {
   .name       = "xml",
+  .init_fn    = init_libxml2,
+  .config_fn  = configure_libxml2,
   .parse_fn   = parse_xml,
+  .stream_fn  = parse_xml_stream,
   .imatch_pat = "<\\?xml|<!DOCTYPE +html +PUBLIC +\"-//W3C//DTD +XHTML",
 };
 
@@ -1,46 +1,316 @@
 /* SPDX-License-Identifier: MIT */
 /* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
 
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "config.h"
 #include "render.h"
+#include "entities.h"
+
+static inline bool is_space(char8_t c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+#ifdef __SSE2__
+/* Mask of the whitespace characters among 16 bytes */
+static inline unsigned int space_mask(const char8_t *p) {
+  __m128i c = _mm_loadu_si128((const __m128i *) p);
+  __m128i ctrl = _mm_sub_epi8(c, _mm_set1_epi8('\t'));
+  __m128i space = _mm_or_si128(
+    _mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+    _mm_cmpeq_epi8(_mm_min_epu8(ctrl, _mm_set1_epi8('\r' - '\t')), ctrl));
+  return _mm_movemask_epi8(space);
+}
+#endif
 
-enum render_state {
-  STATE_NEWLINE,
-  STATE_NEWLINE2,
-  STATE_NEWLINE3PLUS,
-  STATE_SPACE,
-  STATE_SPACE2PLUS,
-  STATE_TEXT,
-};
+/* Length of the run of characters at the start of the text that are
+ * whitespace, if 'space' is set, or otherwise are not. */
+static size_t span(const char8_t *text, size_t len, bool space) {
+  size_t n = 0;
 
-enum render_state state = STATE_NEWLINE;
+#ifdef __SSE2__
+  for (; n + 16 <= len; n += 16) {
+    unsigned int mask = space_mask(text + n);
 
-void render_element(const char8_t *tag, bool end, const struct render_elem *rendering) {
-  if (opt.render_mode == RENDER_MODE_LITERAL)
+    if (space)
+      mask = ~mask & 0xffff;
+    if (mask)
+      return n + __builtin_ctz(mask);
+  }
+#endif
+
+  for (; n < len && is_space(text[n]) == space; n++);
+  return n;
+}
+
+static inline void owe(struct render_ctx *rctx, enum render_state spacing) {
+  if (rctx->state < spacing)
+    rctx->state = spacing;
+}
+
+static void emit(struct render_ctx *rctx, const char8_t *text, size_t len) {
+  /* Cut the text at the limit, between characters */
+  if (rctx->out->total + len > rctx->out_limit) {
+    size_t room = rctx->out->total < rctx->out_limit ?
+                  rctx->out_limit - rctx->out->total : 0;
+
+    for (; room && (text[room] & 0xc0) == 0x80; room--);
+    len = room;
+    rctx->stopped = true;
+    if (len == 0)
+      return;
+  }
+
+  if (rctx->run_start == SIZE_MAX)
+    rctx->run_start = rctx->out->total;
+  if (rctx->text_stable)
+    output_ref(rctx->out, text, len);
+  else
+    output_write(rctx->out, text, len);
+}
+
+/* Output the spacing owed before more text, unless that would leave no room
+ * for the text within the limit */
+static void pay(struct render_ctx *rctx) {
+  size_t width = rctx->state == STATE_NEWLINE2 ? 2 :
+                 rctx->state == STATE_NEWLINE || rctx->state == STATE_SPACE;
+
+  if (rctx->stopped || rctx->out->total + width >= rctx->out_limit) {
+    rctx->stopped = true;
     return;
+  }
 
-  if (!rendering)
-    rendering = get_rendering(tag);
+  switch (rctx->state) {
+  case STATE_NEWLINE2:
+    output_putc(rctx->out, '\n');
+    [[fallthrough]];
+  case STATE_NEWLINE:
+    output_putc(rctx->out, '\n');
+    break;
+  case STATE_SPACE:
+    output_putc(rctx->out, ' ');
+    break;
+  case STATE_TEXT:
+  case STATE_START:
+    break;
+  }
+  rctx->state = STATE_TEXT;
+}
+
+void render_element(struct render_ctx *rctx, const char8_t *tag, bool end, const struct render_elem *rendering) {
+  if (render_stopped(rctx))
+    return;
+
+  if (rctx->title && tag && !strcasecmp((const char *) tag, "title")) {
+    rctx->in_title = !end;
+    if (end)
+      rctx->title = nullptr;
+  }
+
+  if (rctx->opt->render_mode == RENDER_MODE_LITERAL)
+    return;
 
   if (rendering) {
     switch (rendering->spacing) {
     case SPACING_NONE:
       break;
     case SPACING_PARA:
-      puts("");
+      owe(rctx, STATE_NEWLINE2);
       break;
     case SPACING_NEWLINE:
       if (!end)
-        puts("");
+        owe(rctx, STATE_NEWLINE);
       break;
     case SPACING_SPACE:
       if (!end)
-        putchar(' ');
+        owe(rctx, STATE_SPACE);
       break;
     }
   }
 }
 
-void render_text(const char8_t *text) {
-  fputs((char *) text, stdout);
+static void render_span(struct render_ctx *rctx, const char8_t *text, size_t len) {
+  size_t n;
+
+  if (rctx->opt->render_mode == RENDER_MODE_LITERAL) {
+    emit(rctx, text, len);
+    return;
+  }
+
+  /* Collapse each run of whitespace into a space owed */
+  while (len) {
+    if ((n = span(text, len, true))) {
+      owe(rctx, STATE_SPACE);
+      text += n;
+      len -= n;
+    }
+    if ((n = span(text, len, false))) {
+      pay(rctx);
+      if (rctx->stopped)
+        return;
+      emit(rctx, text, n);
+      text += n;
+      len -= n;
+    }
+  }
+}
+
+/* Decode character references remaining in text that the parser has
+ * already decoded once, as in doubly-escaped content. Spacing is carried
+ * between spans, so decoding a reference at a time collapses whitespace just
+ * as if the whole text had been decoded first. */
+static void render_decoded(struct render_ctx *rctx, const char8_t *text, size_t len) {
+  const char8_t *end = text + len;
+  char utf8[ENTITY_MAX_UTF8];
+  size_t utf8_len;
+  bool stable;
+
+  if (rctx->opt->render_mode == RENDER_MODE_LITERAL &&
+      rctx->out_limit == SIZE_MAX) {
+    entity_decode_span(rctx->out, (const char *) text, len);
+    return;
+  }
+
+  while (text < end && !rctx->stopped) {
+    const char8_t *amp = memchr(text, '&', end - text);
+    size_t n;
+
+    if (!amp) {
+      render_span(rctx, text, end - text);
+      break;
+    }
+    if (amp > text)
+      render_span(rctx, text, amp - text);
+    if ((n = entity_decode((const char *) amp, end - amp, utf8, &utf8_len))) {
+      stable = rctx->text_stable;
+      rctx->text_stable = false;
+      render_span(rctx, (const char8_t *) utf8, utf8_len);
+      rctx->text_stable = stable;
+      text = amp + n;
+    } else {
+      render_span(rctx, amp, 1);
+      text = amp + 1;
+    }
+  }
+}
+
+/* Collect the title with its whitespace collapsed and trimmed */
+static void capture_title(struct render_ctx *rctx, const char8_t *text, size_t len) {
+  size_t n;
+
+  while (len) {
+    if ((n = span(text, len, true))) {
+      rctx->title_space = rctx->title->len != 0;
+      text += n;
+      len -= n;
+    }
+    if ((n = span(text, len, false))) {
+      if (rctx->title_space)
+        output_putc(rctx->title, ' ');
+      rctx->title_space = false;
+      output_write(rctx->title, text, n);
+      text += n;
+      len -= n;
+    }
+  }
+}
+
+void render_text_len(struct render_ctx *rctx, const char8_t *text, size_t len) {
+  size_t before = rctx->out->total;
+
+  if (render_stopped(rctx))
+    return;
+
+  if (rctx->in_title)
+    capture_title(rctx, text, len);
+
+  rctx->run_start = SIZE_MAX;
+  if (rctx->opt->decode_entities)
+    render_decoded(rctx, text, len);
+  else
+    render_span(rctx, text, len);
+
+  /* Any spacing paid before the text is not part of the run */
+  if (rctx->map && rctx->src_len && rctx->out->total != before)
+    offset_map_run(rctx->map,
+                   (rctx->run_start == SIZE_MAX ? before : rctx->run_start) -
+                   rctx->map_start,
+                   rctx->src_offset, rctx->src_len);
+}
+
+void render_text(struct render_ctx *rctx, const char8_t *text) {
+  render_text_len(rctx, text, strlen((const char *) text));
+}
+
+/* Write out any text that was referred to rather than copied, before it
+ * goes away */
+void render_sync(struct render_ctx *rctx) {
+  enum phase phase;
+
+  if (rctx->out->num_segs) {
+    phase = stats_enter(rctx->stats, PHASE_FLUSH);
+    output_flush(rctx->out);
+    stats_enter(rctx->stats, phase);
+  }
+}
+
+/* Follow the text rendered so far with that of a part of the document
+ * rendered separately, which is referred to until render_sync() */
+void render_join(struct render_ctx *rctx, const struct render_ctx *part) {
+  const char *text = part->out->buf;
+  size_t len = part->out->len;
+  enum render_state lead = STATE_TEXT;
+  size_t n = 0;
+
+  if (rctx->opt->render_mode == RENDER_MODE_LITERAL) {
+    output_ref(rctx->out, text, len);
+    return;
+  }
+
+  /* Any spacing paid before the part's first text is owed here instead */
+  if (len && text[0] == ' ') {
+    lead = STATE_SPACE;
+    n = 1;
+  } else if (len && text[0] == '\n') {
+    n = len > 1 && text[1] == '\n' ? 2 : 1;
+    lead = n == 2 ? STATE_NEWLINE2 : STATE_NEWLINE;
+  }
+
+  if (n == len) {
+    owe(rctx, part->state);
+    return;
+  }
+
+  owe(rctx, lead);
+  pay(rctx);
+  output_ref(rctx->out, text + n, len - n);
+  rctx->state = part->state;
+}
+
+/* Whether rendering has stopped, having reached the limit of the output or
+ * passed the deadline */
+bool render_stopped(struct render_ctx *rctx) {
+  struct timespec now;
+
+  if (rctx->stopped || rctx->deadline.tv_sec == 0)
+    return rctx->stopped;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec > rctx->deadline.tv_sec ||
+      (now.tv_sec == rctx->deadline.tv_sec &&
+       now.tv_nsec >= rctx->deadline.tv_nsec))
+    rctx->stopped = true;
+  return rctx->stopped;
+}
+
+/* End the output for a document with a newline */
+void render_finish(struct render_ctx *rctx) {
+  if (rctx->opt->render_mode != RENDER_MODE_LITERAL &&
+      rctx->state != STATE_START &&
+      rctx->out->total < rctx->out_limit)
+    output_putc(rctx->out, '\n');
 }
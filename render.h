@@ -5,10 +5,91 @@
 #define _RENDER_H
 
 #include "unhtml.h"
+#include "output.h"
+#include "stats.h"
+#include "offset-map.h"
+#include <stdint.h>
+#include <time.h>
 #include <uchar.h>
 #include <libxml/xmlstring.h>
 
-extern void render_element(const char8_t *tag, bool end, const struct render_elem *rendering);
-extern void render_text(const char8_t *text);
+/* Spacing owed before the next text in smart-space mode, in increasing
+ * order of precedence. Spacing is only output once more text follows, so
+ * that runs of it collapse to the strongest. */
+enum render_state {
+  STATE_TEXT,
+  STATE_SPACE,
+  STATE_NEWLINE,
+  STATE_NEWLINE2,
+  /* Nothing yet output, so no spacing owed */
+  STATE_START,
+};
+
+/* Per-document rendering state, so that documents may be rendered
+ * concurrently on different threads */
+struct render_ctx {
+  const struct options *opt;
+  struct output *out;
+  struct doc_stats *stats;
+  enum render_state state;
+  /* Set while text passed to render_text() remains valid until
+   * render_sync() is called, so need not be copied */
+  bool text_stable;
+  /* Where to collect the text of the document's title, if wanted, until
+   * the end of the first title element */
+  struct output *title;
+  bool in_title;
+  bool title_space;
+  /* Where to record the source of each run of text, if wanted, with the
+   * output offset of the start of the document */
+  struct offset_map *map;
+  size_t map_start;
+  /* Span of input from which the next text comes, as told by the parser,
+   * and the output offset at which that text starts */
+  size_t src_offset;
+  size_t src_len;
+  size_t run_start;
+  /* Output offset at which to stop and the time by which to, if any, after
+   * which nothing more is rendered and the parser should stop */
+  size_t out_limit;
+  struct timespec deadline;
+  bool stopped;
+  /* The parser was given only part of the input, which therefore need not
+   * be well-formed */
+  bool cut_short;
+};
+
+static inline void render_init(struct render_ctx *rctx, const struct options *o,
+                               struct output *out, struct doc_stats *stats) {
+  *rctx = (struct render_ctx) {
+    .opt = o,
+    .out = out,
+    .stats = stats,
+    .state = STATE_START,
+    .out_limit = SIZE_MAX,
+  };
+}
+
+/* Tell the renderer where in the input the next text comes from */
+static inline void render_source(struct render_ctx *rctx, size_t offset, size_t len) {
+  rctx->src_offset = offset;
+  rctx->src_len = len;
+}
+
+/* Start rendering a part of a document separately, for render_join() to
+ * follow the text before it with, owing spacing as if after text */
+static inline void render_init_part(struct render_ctx *part, const struct render_ctx *rctx,
+                                    struct output *out, struct doc_stats *stats) {
+  render_init(part, rctx->opt, out, stats);
+  part->state = STATE_TEXT;
+}
+
+extern void render_element(struct render_ctx *rctx, const char8_t *tag, bool end, const struct render_elem *rendering);
+extern void render_text(struct render_ctx *rctx, const char8_t *text);
+extern void render_text_len(struct render_ctx *rctx, const char8_t *text, size_t len);
+extern void render_sync(struct render_ctx *rctx);
+extern void render_finish(struct render_ctx *rctx);
+extern void render_join(struct render_ctx *rctx, const struct render_ctx *part);
+extern bool render_stopped(struct render_ctx *rctx);
 
 #endif
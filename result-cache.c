@@ -0,0 +1,423 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Result cache
+ *
+ * The text rendered from a document may be kept on disk, keyed by a hash of
+ * the input and of everything else that affects the text: the parser, the
+ * rendering options, the output format and the configuration. Input seen
+ * before is then output from the cache without being parsed.
+ *
+ * Each entry is a file named after its key, within a subdirectory named
+ * after the key's first byte, and is mapped to be output. An entry also
+ * records the length of the input and a second, independent hash of it and
+ * the rest of the key, which must match for it to be used. Entries are
+ * written to a temporary file and renamed into place, so that any number of
+ * processes may share the cache. Using an entry refreshes its modification
+ * time. The processes keep a shared count of what they have written and,
+ * every so often, the one that notices the count pass a threshold removes
+ * the least recently used entries until the cache is back within its limit.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "unhtml.h"
+#include "config.h"
+#include "result-cache.h"
+
+static const char entry_magic[8] = "UNHTMLR";
+static constexpr uint32_t entry_format = 2;
+
+/* Entries used within this many seconds of their last use are not touched
+ * again, as LRU order need not be any more precise */
+static constexpr time_t touch_interval = 60;
+
+/* Temporary files this many seconds old are left over from a writer that
+ * failed and may be removed */
+static constexpr time_t stale_temp = 3600;
+
+/* Size of the blocks in which entries are assumed to take up space, to
+ * count what is written in the same terms as the space the cache uses */
+static constexpr size_t block_size = 4096;
+
+/* Fraction of the limit written between checks of the cache's size */
+static constexpr size_t check_fraction = 16;
+
+/* Fraction of the limit freed beyond the limit itself when pruning, so that
+ * pruning is not needed again straight away */
+static constexpr size_t prune_fraction = 8;
+
+struct entry_header {
+  char magic[sizeof entry_magic];
+  uint32_t format;
+  uint32_t reserved;
+  /* Of the input the entry was made from, as in struct cache_key */
+  uint64_t input_len;
+  uint64_t check;
+  uint64_t title_len;
+  uint64_t text_len;
+};
+
+/* Name of an entry: two hex digits of subdirectory, a slash and 32 hex
+ * digits of key */
+static constexpr size_t entry_name_len = 35;
+
+struct entry_ref {
+  struct timespec mtime;
+  size_t size;
+  char name[entry_name_len + 1];
+};
+
+static struct {
+  const char *dir;
+  size_t max_size;
+  /* File holding the shared count of bytes written and the lock taken to
+   * prune the cache */
+  int state_fd;
+  uint64_t *written;
+  pthread_mutex_t prune_lock;
+} cache = { .state_fd = -1, .prune_lock = PTHREAD_MUTEX_INITIALIZER };
+
+int result_cache_open(const char *dir, size_t max_size) {
+  struct stat st;
+  char *path = nullptr;
+  void *map;
+
+  if (asprintf(&path, "%s/state", dir) == -1) {
+    fprintf(stderr, "could not allocate path, %s\n", strerror(errno));
+    return 1;
+  }
+  if (make_parents(path) != 0)
+    goto fail;
+
+  if ((cache.state_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) == -1 ||
+      fstat(cache.state_fd, &st) == -1 ||
+      (st.st_size < sizeof *cache.written &&
+       ftruncate(cache.state_fd, sizeof *cache.written) == -1) ||
+      (map = mmap(nullptr, sizeof *cache.written, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, cache.state_fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "could not open cache state %s, %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  cache.dir = dir;
+  cache.max_size = max_size;
+  cache.written = map;
+  logv("using result cache %s\n", dir);
+  free(path);
+  return 0;
+
+fail:
+  if (cache.state_fd != -1)
+    close(cache.state_fd);
+  cache.state_fd = -1;
+  free(path);
+  return 1;
+}
+
+void result_cache_close(void) {
+  if (!cache.dir)
+    return;
+
+  munmap(cache.written, sizeof *cache.written);
+  close(cache.state_fd);
+  cache.dir = nullptr;
+  cache.written = nullptr;
+  cache.state_fd = -1;
+}
+
+/* The key covers the input and all that affects the text made from it */
+void result_cache_key(struct cache_key *key, const struct mapped_buffer *input,
+                      const struct options *o, const char *parser) {
+  struct digest context;
+  char desc[256];
+  int len;
+
+  len = snprintf(desc, sizeof desc,
+                 "%s parser=%s render=%s comment=%d cdata=%d decode=%d format=%s charset=%s"
+                 " max-output=%zu max-input=%zu",
+                 STRINGIFY(UNHTML_VERSION), parser,
+                 render_mode_names[o->render_mode], o->comment,
+                 o->cdata_is_comment, o->decode_entities,
+                 output_format_names[o->format], o->charset ?: "auto",
+                 o->max_output, o->max_input);
+  hash_digest(&context, desc, len, &config.digest);
+  hash_digest(&key->digest, input->data, input->length - 1, &context);
+  key->input_len = input->length - 1;
+  key->check = hash_fnv1a(&config.digest, sizeof config.digest, fnv1a_basis);
+  key->check = hash_fnv1a(desc, len, key->check);
+  key->check = hash_fnv1a(input->data, input->length - 1, key->check);
+}
+
+static void entry_name(char *name, const struct cache_key *key) {
+  snprintf(name, entry_name_len + 1, "%02x/%016llx%016llx",
+           (unsigned int) (key->digest.hi >> 56),
+           (unsigned long long) key->digest.hi,
+           (unsigned long long) key->digest.lo);
+}
+
+bool result_cache_lookup(const struct cache_key *key, struct cached_result *result) {
+  const struct entry_header *header;
+  char name[entry_name_len + 1];
+  struct timespec now;
+  char *path = nullptr;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if (!cache.dir)
+    return false;
+
+  entry_name(name, key);
+  if (asprintf(&path, "%s/%s", cache.dir, name) == -1)
+    return false;
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (fd == -1)
+    return false;
+
+  if (fstat(fd, &st) == -1 || st.st_size < sizeof *header ||
+      (map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  header = map;
+  if (memcmp(header->magic, entry_magic, sizeof header->magic) ||
+      header->format != entry_format ||
+      header->title_len > st.st_size - sizeof *header ||
+      header->text_len != st.st_size - sizeof *header - header->title_len) {
+    logv("ignoring bad cache entry %s\n", name);
+    munmap(map, st.st_size);
+    close(fd);
+    return false;
+  }
+
+  if (header->input_len != key->input_len || header->check != key->check) {
+    logv("ignoring cache entry %s made from other input\n", name);
+    munmap(map, st.st_size);
+    close(fd);
+    return false;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (now.tv_sec - st.st_mtim.tv_sec >= touch_interval)
+    futimens(fd, nullptr);
+  close(fd);
+
+  logvv("using cache entry %s\n", name);
+  *result = (struct cached_result) {
+    .map = map,
+    .mapped = st.st_size,
+    .title = (const char *) (header + 1),
+    .title_len = header->title_len,
+    .text = (const char *) (header + 1) + header->title_len,
+    .text_len = header->text_len,
+  };
+  return true;
+}
+
+void result_cache_release(struct cached_result *result) {
+  if (result->map)
+    munmap(result->map, result->mapped);
+  result->map = nullptr;
+}
+
+static int entry_compar(const void *a, const void *b) {
+  const struct entry_ref *aa = a;
+  const struct entry_ref *bb = b;
+
+  if (aa->mtime.tv_sec != bb->mtime.tv_sec)
+    return aa->mtime.tv_sec < bb->mtime.tv_sec ? -1 : 1;
+  if (aa->mtime.tv_nsec != bb->mtime.tv_nsec)
+    return aa->mtime.tv_nsec < bb->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+/* List the entries in one subdirectory, removing stale temporary files */
+static int scan_subdir(unsigned int sub, struct entry_ref **entries,
+                       size_t *num, size_t *total, time_t now) {
+  struct dirent *ent;
+  char *path = nullptr;
+  struct stat st;
+  DIR *d;
+
+  if (asprintf(&path, "%s/%02x", cache.dir, sub) == -1)
+    return 1;
+  d = opendir(path);
+  free(path);
+  if (!d)
+    return errno == ENOENT ? 0 : 1;
+
+  while ((ent = readdir(d))) {
+    struct entry_ref *grown;
+
+    if (ent->d_name[0] == '.' ||
+        fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+        !S_ISREG(st.st_mode))
+      continue;
+
+    if (strlen(ent->d_name) != entry_name_len - 3) {
+      if (strchr(ent->d_name, '.') && now - st.st_mtim.tv_sec > stale_temp)
+        unlinkat(dirfd(d), ent->d_name, 0);
+      continue;
+    }
+
+    if ((*num & (*num - 1)) == 0) {
+      if ((grown = reallocarray(*entries, *num ? *num << 1 : 256,
+                                sizeof **entries)) == nullptr) {
+        closedir(d);
+        return 1;
+      }
+      *entries = grown;
+    }
+    (*entries)[*num] = (struct entry_ref) {
+      .mtime = st.st_mtim,
+      .size = st.st_blocks * 512,
+    };
+    snprintf((*entries)[*num].name, 4, "%02x/", sub);
+    memcpy((*entries)[*num].name + 3, ent->d_name, entry_name_len - 3 + 1);
+    *total += (*entries)[(*num)++].size;
+  }
+
+  closedir(d);
+  return 0;
+}
+
+/* Remove the least recently used entries while the cache is over its
+ * limit. Only one thread of one process prunes at a time. */
+static void prune(void) {
+  struct entry_ref *entries = nullptr;
+  size_t num = 0, total = 0, removed = 0;
+  size_t low = cache.max_size - cache.max_size / prune_fraction;
+  struct timespec now;
+
+  if (pthread_mutex_trylock(&cache.prune_lock) != 0)
+    return;
+  if (flock(cache.state_fd, LOCK_EX | LOCK_NB) == -1) {
+    pthread_mutex_unlock(&cache.prune_lock);
+    return;
+  }
+
+  __atomic_store_n(cache.written, 0, __ATOMIC_RELAXED);
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  for (unsigned int sub = 0; sub < 256; sub++) {
+    if (scan_subdir(sub, &entries, &num, &total, now.tv_sec) != 0) {
+      logv("could not scan result cache, %s\n", strerror(errno));
+      goto finish;
+    }
+  }
+
+  if (total > cache.max_size) {
+    qsort(entries, num, sizeof *entries, entry_compar);
+    for (size_t i = 0; i < num && total > low; i++) {
+      char *path = nullptr;
+
+      if (asprintf(&path, "%s/%s", cache.dir, entries[i].name) == -1)
+        break;
+      if (unlink(path) == 0 || errno == ENOENT) {
+        total -= entries[i].size;
+        removed++;
+      }
+      free(path);
+    }
+    logv("removed %zu entries from result cache\n", removed);
+  }
+
+finish:
+  free(entries);
+  flock(cache.state_fd, LOCK_UN);
+  pthread_mutex_unlock(&cache.prune_lock);
+}
+
+/* Write an entry to a temporary file and rename it into place, so that
+ * readers only ever see complete entries */
+void result_cache_store(const struct cache_key *key,
+                        const char *title, size_t title_len,
+                        const char *text, size_t text_len) {
+  struct entry_header header = {
+    .format = entry_format,
+    .input_len = key->input_len,
+    .check = key->check,
+    .title_len = title_len,
+    .text_len = text_len,
+  };
+  struct iovec iov[] = {
+    { &header, sizeof header },
+    { (void *) title, title_len },
+    { (void *) text, text_len },
+  };
+  size_t size = sizeof header + title_len + text_len;
+  size_t threshold = cache.max_size / check_fraction ? : 1;
+  char name[entry_name_len + 1];
+  char *path = nullptr, *tmp = nullptr;
+  ssize_t written = 0;
+  uint64_t count;
+  int fd;
+
+  if (!cache.dir)
+    return;
+
+  memcpy(header.magic, entry_magic, sizeof header.magic);
+  entry_name(name, key);
+  if (asprintf(&path, "%s/%s", cache.dir, name) == -1 ||
+      asprintf(&tmp, "%s.XXXXXX", path) == -1)
+    goto finish;
+
+  if (make_parents(tmp) != 0 || (fd = mkstemp(tmp)) == -1) {
+    logv("could not create cache entry %s, %s\n", tmp, strerror(errno));
+    goto finish;
+  }
+
+  for (int i = 0; written != -1 && i < sizeof iov / sizeof *iov;) {
+    if (iov[i].iov_len == 0) {
+      i++;
+      continue;
+    }
+    written = writev(fd, iov + i, sizeof iov / sizeof *iov - i);
+    if (written == -1 && errno == EINTR)
+      written = 0;
+    /* Skip whatever was written, which may end part way into a segment */
+    for (; written > 0 && i < sizeof iov / sizeof *iov; i++) {
+      if (written < iov[i].iov_len) {
+        iov[i].iov_base = (char *) iov[i].iov_base + written;
+        iov[i].iov_len -= written;
+        written = 0;
+        break;
+      }
+      written -= iov[i].iov_len;
+    }
+  }
+
+  if (close(fd) == 0 && written != -1 && rename(tmp, path) == 0) {
+    logvv("wrote cache entry %s\n", name);
+  } else {
+    logv("could not write cache entry %s, %s\n", name, strerror(errno));
+    unlink(tmp);
+    goto finish;
+  }
+
+  /* Whoever prunes resets the count */
+  count = __atomic_add_fetch(cache.written,
+                             (size + block_size - 1) & ~(block_size - 1),
+                             __ATOMIC_RELAXED);
+  if (count >= threshold)
+    prune();
+
+finish:
+  free(tmp);
+  free(path);
+}
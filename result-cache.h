@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _RESULT_CACHE_H
+#define _RESULT_CACHE_H
+
+#include "unhtml.h"
+#include "hash.h"
+
+/* What a result is cached under. The digest names the entry and the rest is
+ * checked against it, in case the digests of different input collide. */
+struct cache_key {
+  struct digest digest;
+  uint64_t input_len;
+  uint64_t check;
+};
+
+/* A cached result, mapped from its entry */
+struct cached_result {
+  void *map;
+  size_t mapped;
+  const char *title;
+  size_t title_len;
+  const char *text;
+  size_t text_len;
+};
+
+extern int result_cache_open(const char *dir, size_t max_size);
+extern void result_cache_close(void);
+extern void result_cache_key(struct cache_key *key, const struct mapped_buffer *input,
+                             const struct options *o, const char *parser);
+extern bool result_cache_lookup(const struct cache_key *key, struct cached_result *result);
+extern void result_cache_release(struct cached_result *result);
+extern void result_cache_store(const struct cache_key *key,
+                               const char *title, size_t title_len,
+                               const char *text, size_t text_len);
+
+#endif
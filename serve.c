@@ -0,0 +1,864 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Daemon mode
+ *
+ * Serves requests to extract the text of documents over a Unix domain
+ * socket, so that the parsers are initialised and the configuration loaded
+ * once for any number of documents. The main thread runs an event loop that
+ * accepts connections and reads requests without blocking. Each complete
+ * request is passed to a pool of worker threads, one of which renders the
+ * document and writes the response before handing the connection back to
+ * the loop for its next request. On SIGHUP, the configuration is reloaded
+ * once the requests being rendered have completed.
+ *
+ * Each request and response is preceded by a header of two 32-bit unsigned
+ * integers in network byte order:
+ *
+ *   request    length of options, length of document; options, document
+ *   response   status, length of text; text
+ *
+ * The options are a series of NUL-terminated name=value pairs that apply
+ * to that request only. A status other than OK, or TRUNCATED when a budget
+ * cut the text short, means the text is an error message rather than the
+ * text of the document.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "unhtml.h"
+#include "load.h"
+#include "config.h"
+#include "output.h"
+#include "charset.h"
+#include "container.h"
+#include "serve.h"
+
+enum status {
+  STATUS_OK = 0,
+  STATUS_FAILED,
+  STATUS_BAD_REQUEST,
+  STATUS_TRUNCATED,
+};
+
+/* Most request options accepted, in bytes */
+static constexpr size_t max_options = 0x1000;
+
+static constexpr int listen_backlog = 64;
+
+/* Most connections open at once */
+static constexpr size_t max_conns = 1024;
+
+/* Longest wait for a client to take more of a response, in milliseconds,
+ * before giving up on it */
+static constexpr int send_timeout = 30'000;
+
+/* Size of reads of the response in the client */
+static constexpr size_t client_chunk = 0x10000;
+
+struct conn {
+  int fd;
+  /* Request being read: the header, then the options, then the document */
+  uint32_t header[2];
+  size_t have;
+  char *options;
+  struct mapped_buffer doc;
+  /* Bytes allocated for the request that have yet to be read */
+  size_t pending;
+  bool closing;
+  struct conn *next;
+};
+
+struct server {
+  size_t max_buf;
+  struct config_dir *confdirs;
+  int listen_fd;
+  /* Connections open and bytes allocated for requests being read, which
+   * only the event loop changes */
+  size_t num_conns;
+  size_t pending;
+  /* Wakes the event loop for signals, as the signal number, and for
+   * connections handed back by workers, as zero */
+  int wake[2];
+  /* Held for reading while rendering and for writing while reloading */
+  pthread_rwlock_t config_lock;
+
+  /* Worker pool state */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct conn *queue;
+  struct conn **queue_tail;
+  struct conn *returned;
+  bool stopping;
+};
+
+/* Connections being read by the event loop */
+struct conn_set {
+  struct conn **conns;
+  struct pollfd *fds;
+  size_t num;
+  size_t size;
+};
+
+enum read_result {
+  READ_MORE,
+  READ_DONE,
+  READ_CLOSE,
+};
+
+static int wake_fd = -1;
+
+static void on_signal(int sig) {
+  int saved = errno;
+  unsigned char c = sig;
+
+  write(wake_fd, &c, 1);
+  errno = saved;
+}
+
+/* Write the whole of the vector to a socket, waiting a while if it is
+ * full */
+static int send_fully(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+    if (sent == -1 && errno == EINTR)
+      continue;
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+      int ready = poll(&pfd, 1, send_timeout);
+
+      if (ready == 0)
+        errno = ETIMEDOUT;
+      if (ready == 0 || (ready == -1 && errno != EINTR))
+        return 1;
+      continue;
+    }
+    if (sent == -1)
+      return 1;
+
+    while (iovcnt && sent >= iov->iov_len) {
+      sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt) {
+      iov->iov_base = (char *) iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+  return 0;
+}
+
+/* Read exactly 'len' bytes from a blocking socket */
+static int recv_fully(int fd, void *buf, size_t len) {
+  while (len) {
+    ssize_t got = read(fd, buf, len);
+
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return 1;
+    buf = (char *) buf + got;
+    len -= got;
+  }
+  return 0;
+}
+
+static int send_response(int fd, enum status status, const char *text, size_t len) {
+  uint32_t header[2] = { htonl(status), htonl(len) };
+  struct iovec iov[2] = {
+    { .iov_base = header, .iov_len = sizeof header },
+    { .iov_base = (void *) text, .iov_len = len },
+  };
+
+  return send_fully(fd, iov, len ? 2 : 1);
+}
+
+static int send_error(int fd, enum status status, const char *message) {
+  return send_response(fd, status, message, strlen(message));
+}
+
+static int open_socket(const char *path, struct sockaddr_un *addr) {
+  int fd;
+
+  if (strlen(path) >= sizeof addr->sun_path) {
+    fprintf(stderr, "socket path too long, %s\n", path);
+    return -1;
+  }
+  *addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+  strcpy(addr->sun_path, path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    fprintf(stderr, "could not create socket, %s\n", strerror(errno));
+  return fd;
+}
+
+/* Apply the request's options over those the server was started with */
+static int apply_options(struct options *o, const char *options, size_t len,
+                         char *error, size_t error_len) {
+  const char *end = options + len;
+  const char *name;
+  char *num_end;
+
+  /* The whole document is already in memory */
+  o->stream = false;
+
+  for (name = options; name < end; name += strlen(name) + 1) {
+    const char *value = strchr(name, '=');
+    size_t name_len;
+
+    if (!value) {
+      snprintf(error, error_len, "malformed option: %s", name);
+      return 1;
+    }
+    name_len = value++ - name;
+
+#define IS(n) (name_len == sizeof n - 1 && !strncmp(name, n, name_len))
+    if (IS("parser")) {
+      if (!strcmp(value, "auto")) {
+        o->parser = -1;
+      } else if ((o->parser = find_parser(value)) == -1) {
+        snprintf(error, error_len, "no such parser: %s", value);
+        return 1;
+      }
+    } else if (IS("render")) {
+      for (o->render_mode = 0;
+           o->render_mode < RENDER_MODE_MAX &&
+             strcmp(value, render_mode_names[o->render_mode]);
+           o->render_mode++);
+      if (o->render_mode == RENDER_MODE_MAX) {
+        snprintf(error, error_len, "no such render mode: %s", value);
+        return 1;
+      }
+    } else if (IS("format")) {
+      for (o->format = 0;
+           o->format < OUTPUT_FORMAT_MAX &&
+             strcmp(value, output_format_names[o->format]);
+           o->format++);
+      if (o->format == OUTPUT_FORMAT_MAX) {
+        snprintf(error, error_len, "no such output format: %s", value);
+        return 1;
+      }
+    } else if (IS("container")) {
+      for (o->container = 0;
+           o->container < CONTAINER_MAX &&
+             strcmp(value, container_names[o->container]);
+           o->container++);
+      if (o->container == CONTAINER_MAX)
+        goto bad_value;
+    } else if (IS("record-separator")) {
+      o->record_separator = value;
+      o->record_separator_len = strlen(value);
+    } else if (IS("cdata") && !strcmp(value, "comment")) {
+      o->cdata_is_comment = true;
+    } else if (IS("cdata") && !strcmp(value, "text")) {
+      o->cdata_is_comment = false;
+    } else if (IS("comment") && (!strcmp(value, "0") || !strcmp(value, "1"))) {
+      o->comment = *value == '1';
+    } else if (IS("decode-entities") && (!strcmp(value, "0") || !strcmp(value, "1"))) {
+      o->decode_entities = *value == '1';
+    } else if (IS("charset")) {
+      if (strlen(value) >= CHARSET_MAX_LABEL)
+        goto bad_value;
+      o->charset = strcmp(value, "auto") ? value : nullptr;
+    } else if (IS("max-output")) {
+      o->max_output = strtoull(value, &num_end, 10);
+      if (*num_end)
+        goto bad_value;
+    } else if (IS("max-input")) {
+      o->max_input = strtoull(value, &num_end, 10);
+      if (*num_end)
+        goto bad_value;
+    } else if (IS("deadline")) {
+      o->deadline = strtol(value, &num_end, 10);
+      if (*num_end || o->deadline < 0)
+        goto bad_value;
+    } else {
+      snprintf(error, error_len, "bad option: %s", name);
+      return 1;
+    }
+#undef IS
+  }
+
+  return 0;
+
+bad_value:
+  snprintf(error, error_len, "bad value: %s", name);
+  return 1;
+}
+
+static void free_request(struct conn *c) {
+  free(c->options);
+  c->options = nullptr;
+  if (c->doc.data)
+    free_map(&c->doc);
+  c->doc = (struct mapped_buffer) { .fd = -1 };
+  c->have = 0;
+}
+
+/* Account for the request having been read in full or abandoned */
+static void release_request(struct server *srv, struct conn *c) {
+  srv->pending -= c->pending;
+  c->pending = 0;
+}
+
+static void free_conn(struct server *srv, struct conn *c) {
+  release_request(srv, c);
+  srv->num_conns--;
+  free_request(c);
+  close(c->fd);
+  free(c);
+}
+
+/* Render the document of a complete request and send the response */
+static void handle_request(struct server *srv, struct conn *c) {
+  struct options o = opt;
+  struct doc_stats stats;
+  struct output out;
+  enum container container;
+  enum status status = STATUS_OK;
+  char error[256];
+  char *text = nullptr;
+  size_t len = 0;
+
+  stats_begin(&stats, opt.stats != STATS_NONE);
+
+  if (apply_options(&o, c->options, ntohl(c->header[0]),
+                    error, sizeof error) != 0) {
+    logv("%s\n", error);
+    status = STATUS_BAD_REQUEST;
+  } else if (output_init(&out, -1) != 0) {
+    snprintf(error, sizeof error, "could not allocate output buffer");
+    status = STATUS_FAILED;
+  } else {
+    container = o.container == CONTAINER_AUTO ?
+                detect_container(&c->doc) : o.container;
+    pthread_rwlock_rdlock(&srv->config_lock);
+    if ((container == CONTAINER_NONE ?
+           process_input(&c->doc, srv->max_buf, &o, &out, &stats) :
+           process_container(&c->doc, container, srv->max_buf, &o, &out,
+                             &stats)) != 0 ||
+        out.error) {
+      snprintf(error, sizeof error, "could not process document");
+      status = STATUS_FAILED;
+    } else if (stats.truncated) {
+      status = STATUS_TRUNCATED;
+    }
+    pthread_rwlock_unlock(&srv->config_lock);
+    text = output_take(&out, &len);
+    output_free(&out);
+  }
+
+  stats_add(&stats, opt.serve, status == STATUS_TRUNCATED ? STATUS_OK : status);
+
+  if ((status == STATUS_OK || status == STATUS_TRUNCATED ?
+         send_response(c->fd, status, text, len) :
+         send_error(c->fd, status, error)) != 0) {
+    logv("could not send response, %s\n", strerror(errno));
+    c->closing = true;
+  }
+
+  free(text);
+  free_request(c);
+}
+
+static void *worker(void *arg) {
+  struct server *srv = arg;
+  struct conn *c;
+
+  pthread_mutex_lock(&srv->lock);
+  for (;;) {
+    while (!srv->queue && !srv->stopping)
+      pthread_cond_wait(&srv->cond, &srv->lock);
+
+    /* Finish the requests already queued before stopping */
+    if ((c = srv->queue) == nullptr)
+      break;
+    if ((srv->queue = c->next) == nullptr)
+      srv->queue_tail = &srv->queue;
+    pthread_mutex_unlock(&srv->lock);
+
+    handle_request(srv, c);
+
+    pthread_mutex_lock(&srv->lock);
+    c->next = srv->returned;
+    srv->returned = c;
+    write(srv->wake[1], "", 1);
+  }
+  pthread_mutex_unlock(&srv->lock);
+
+  return nullptr;
+}
+
+static void queue_request(struct server *srv, struct conn *c) {
+  pthread_mutex_lock(&srv->lock);
+  c->next = nullptr;
+  *srv->queue_tail = c;
+  srv->queue_tail = &c->next;
+  pthread_cond_signal(&srv->cond);
+  pthread_mutex_unlock(&srv->lock);
+}
+
+/* Check the header just read and allocate for the rest of the request */
+static int start_request(struct server *srv, struct conn *c) {
+  size_t options_len = ntohl(c->header[0]);
+  size_t doc_len = ntohl(c->header[1]);
+
+  if (options_len > max_options) {
+    send_error(c->fd, STATUS_BAD_REQUEST, "options too long");
+    return 1;
+  }
+  if (doc_len >= srv->max_buf) {
+    send_error(c->fd, STATUS_BAD_REQUEST, "document too big");
+    return 1;
+  }
+  /* Bound the memory held for clients that are slow to send */
+  if (srv->pending + doc_len >= srv->max_buf) {
+    send_error(c->fd, STATUS_FAILED, "server busy");
+    return 1;
+  }
+
+  if ((c->options = calloc(1, options_len + 1)) == nullptr ||
+      map_alloc(&c->doc, srv->max_buf, doc_len) != 0) {
+    send_error(c->fd, STATUS_FAILED, "out of memory");
+    return 1;
+  }
+  c->pending = options_len + doc_len;
+  srv->pending += c->pending;
+  return 0;
+}
+
+/* Read as much of the request as is available */
+static enum read_result read_request(struct server *srv, struct conn *c) {
+  for (;;) {
+    size_t options_len = ntohl(c->header[0]);
+    size_t doc_len = ntohl(c->header[1]);
+    size_t body = c->have - sizeof c->header;
+    char *dst;
+    size_t want;
+    ssize_t got;
+
+    if (c->have < sizeof c->header) {
+      dst = (char *) c->header + c->have;
+      want = sizeof c->header - c->have;
+    } else if (body < options_len) {
+      dst = c->options + body;
+      want = options_len - body;
+    } else if (body < options_len + doc_len) {
+      dst = c->doc.data + body - options_len;
+      want = options_len + doc_len - body;
+    } else {
+      return READ_DONE;
+    }
+
+    got = read(c->fd, dst, want);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return READ_MORE;
+    if (got == -1) {
+      logv("error reading request, %s\n", strerror(errno));
+      return READ_CLOSE;
+    }
+    if (got == 0) {
+      if (c->have)
+        logv("connection closed part way through request\n");
+      return READ_CLOSE;
+    }
+
+    c->have += got;
+    if (c->have == sizeof c->header && start_request(srv, c) != 0)
+      return READ_CLOSE;
+  }
+}
+
+static int add_conn(struct conn_set *set, struct conn *c) {
+  if (set->num == set->size) {
+    size_t size = set->size ? set->size << 1 : 16;
+    struct conn **conns;
+    struct pollfd *fds;
+
+    /* Leave room for the wake pipe and the listening socket */
+    if ((conns = reallocarray(set->conns, size, sizeof *conns)) == nullptr)
+      return 1;
+    set->conns = conns;
+    if ((fds = reallocarray(set->fds, size + 2, sizeof *fds)) == nullptr)
+      return 1;
+    set->fds = fds;
+    set->size = size;
+  }
+  set->conns[set->num++] = c;
+  return 0;
+}
+
+static void accept_conns(struct server *srv, struct conn_set *set) {
+  struct conn *c;
+  int fd;
+
+  while ((fd = accept4(srv->listen_fd, nullptr, nullptr,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    if (srv->num_conns >= max_conns) {
+      logv("too many connections\n");
+      close(fd);
+      continue;
+    }
+    if ((c = calloc(1, sizeof *c)) == nullptr) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->doc.fd = -1;
+    srv->num_conns++;
+    if (add_conn(set, c) != 0) {
+      fprintf(stderr, "could not allocate connection, %s\n", strerror(errno));
+      free_conn(srv, c);
+    }
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    logv("error accepting connection, %s\n", strerror(errno));
+}
+
+/* Take back connections whose requests the workers have completed */
+static void return_conns(struct server *srv, struct conn_set *set) {
+  struct conn *c, *next;
+
+  pthread_mutex_lock(&srv->lock);
+  c = srv->returned;
+  srv->returned = nullptr;
+  pthread_mutex_unlock(&srv->lock);
+
+  for (; c; c = next) {
+    next = c->next;
+    if (c->closing || add_conn(set, c) != 0)
+      free_conn(srv, c);
+  }
+}
+
+static void reload_config(struct server *srv) {
+  logv("reloading config\n");
+  pthread_rwlock_wrlock(&srv->config_lock);
+  free_config();
+  if (load_config(srv->confdirs) != 0)
+    fprintf(stderr, "could not reload config\n");
+  configure_parsers();
+  pthread_rwlock_unlock(&srv->config_lock);
+}
+
+/* Handle what woke the event loop, returning false to stop */
+static bool handle_wake(struct server *srv, struct conn_set *set) {
+  unsigned char buf[64];
+  bool running = true;
+  ssize_t got;
+
+  while ((got = read(srv->wake[0], buf, sizeof buf)) > 0) {
+    for (ssize_t i = 0; i < got; i++) {
+      switch (buf[i]) {
+      case 0:
+        break;
+      case SIGHUP:
+        reload_config(srv);
+        break;
+      default:
+        logv("stopping on signal %d\n", buf[i]);
+        running = false;
+      }
+    }
+  }
+
+  return_conns(srv, set);
+  return running;
+}
+
+static int event_loop(struct server *srv, struct conn_set *set) {
+  bool running = true;
+
+  while (running) {
+    size_t i;
+
+    set->fds[0] = (struct pollfd) { .fd = srv->wake[0], .events = POLLIN };
+    set->fds[1] = (struct pollfd) { .fd = srv->listen_fd, .events = POLLIN };
+    for (i = 0; i < set->num; i++)
+      set->fds[i + 2] = (struct pollfd) { .fd = set->conns[i]->fd, .events = POLLIN };
+
+    if (poll(set->fds, set->num + 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "error waiting for connections, %s\n", strerror(errno));
+      return 1;
+    }
+
+    /* Connections leave the set by being replaced with the last, which
+     * has already been seen if working backwards */
+    for (i = set->num; i-- > 0;) {
+      struct conn *c = set->conns[i];
+      enum read_result result;
+
+      if (!set->fds[i + 2].revents)
+        continue;
+
+      if ((result = read_request(srv, c)) == READ_MORE)
+        continue;
+
+      set->conns[i] = set->conns[--set->num];
+      if (result == READ_DONE) {
+        release_request(srv, c);
+        queue_request(srv, c);
+      } else {
+        free_conn(srv, c);
+      }
+    }
+
+    if (set->fds[1].revents)
+      accept_conns(srv, set);
+
+    if (set->fds[0].revents)
+      running = handle_wake(srv, set);
+  }
+
+  return 0;
+}
+
+static void stop_workers(struct server *srv, pthread_t *threads, int started) {
+  pthread_mutex_lock(&srv->lock);
+  srv->stopping = true;
+  pthread_cond_broadcast(&srv->cond);
+  pthread_mutex_unlock(&srv->lock);
+
+  while (started--)
+    pthread_join(threads[started], nullptr);
+}
+
+int serve(size_t max_buf, struct config_dir *confdirs) {
+  struct server srv = {
+    .max_buf = max_buf,
+    .confdirs = confdirs,
+    .listen_fd = -1,
+    .wake = { -1, -1 },
+  };
+  struct sigaction action = { .sa_handler = on_signal, .sa_flags = SA_RESTART };
+  pthread_rwlockattr_t lock_attr;
+  struct conn_set set = {};
+  struct sockaddr_un addr;
+  struct stat statbuf;
+  pthread_t *threads = nullptr;
+  int started = 0;
+  int rc = 1;
+
+  srv.queue_tail = &srv.queue;
+  pthread_mutex_init(&srv.lock, nullptr);
+  pthread_cond_init(&srv.cond, nullptr);
+
+  /* Let a reload in waiting hold off new requests, so that it is not
+   * starved by a steady stream of them */
+  pthread_rwlockattr_init(&lock_attr);
+  pthread_rwlockattr_setkind_np(&lock_attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&srv.config_lock, &lock_attr);
+  pthread_rwlockattr_destroy(&lock_attr);
+
+  if ((srv.listen_fd = open_socket(opt.serve, &addr)) == -1)
+    goto finish;
+
+  /* Replace the socket left behind by a previous server */
+  if (lstat(opt.serve, &statbuf) == 0 && S_ISSOCK(statbuf.st_mode))
+    unlink(opt.serve);
+
+  if (bind(srv.listen_fd, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+      listen(srv.listen_fd, listen_backlog) == -1) {
+    fprintf(stderr, "could not listen on %s, %s\n", opt.serve, strerror(errno));
+    goto finish;
+  }
+
+  if (fcntl(srv.listen_fd, F_SETFL, O_NONBLOCK) == -1 ||
+      pipe2(srv.wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+    fprintf(stderr, "could not set up event loop, %s\n", strerror(errno));
+    goto unlink;
+  }
+
+  /* The wake pipe and listening socket are polled ahead of connections */
+  if ((set.fds = calloc(2, sizeof *set.fds)) == nullptr) {
+    fprintf(stderr, "could not allocate connections, %s\n", strerror(errno));
+    goto unlink;
+  }
+
+  wake_fd = srv.wake[1];
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGHUP, &action, nullptr);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  if ((threads = calloc(opt.jobs, sizeof *threads)) == nullptr) {
+    fprintf(stderr, "could not allocate threads, %s\n", strerror(errno));
+    goto unlink;
+  }
+
+  for (started = 0; started < opt.jobs; started++) {
+    if ((rc = pthread_create(threads + started, nullptr, worker, &srv)) != 0) {
+      fprintf(stderr, "could not start worker thread, %s\n", strerror(rc));
+      break;
+    }
+  }
+
+  logv("serving on %s with %d workers\n", opt.serve, started);
+  rc = started ? event_loop(&srv, &set) : 1;
+
+  stop_workers(&srv, threads, started);
+  return_conns(&srv, &set);
+  for (size_t i = 0; i < set.num; i++)
+    free_conn(&srv, set.conns[i]);
+
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  wake_fd = -1;
+
+unlink:
+  unlink(opt.serve);
+
+finish:
+  free(threads);
+  free(set.conns);
+  free(set.fds);
+  if (srv.wake[0] != -1)
+    close(srv.wake[0]);
+  if (srv.wake[1] != -1)
+    close(srv.wake[1]);
+  if (srv.listen_fd != -1)
+    close(srv.listen_fd);
+  pthread_rwlock_destroy(&srv.config_lock);
+  pthread_cond_destroy(&srv.cond);
+  pthread_mutex_destroy(&srv.lock);
+  return rc;
+}
+
+/* Pass the options given on the command line as request options, so that
+ * the text is rendered as if by this process */
+static size_t client_options(char *buf, size_t size) {
+  /* The separator cannot be sent if it holds a NUL */
+  if (memchr(opt.record_separator, '\0', opt.record_separator_len))
+    return size;
+
+  return snprintf(buf, size,
+                  "parser=%s%c"
+                  "render=%s%c"
+                  "format=%s%c"
+                  "container=%s%c"
+                  "record-separator=%.*s%c"
+                  "comment=%d%c"
+                  "cdata=%s%c"
+                  "decode-entities=%d%c"
+                  "charset=%s%c"
+                  "max-output=%zu%c"
+                  "max-input=%zu%c"
+                  "deadline=%ld%c",
+                  opt.parser < 0 ? "auto" : parser_name(opt.parser), '\0',
+                  render_mode_names[opt.render_mode], '\0',
+                  output_format_names[opt.format], '\0',
+                  container_names[opt.container], '\0',
+                  (int) opt.record_separator_len, opt.record_separator, '\0',
+                  opt.comment, '\0',
+                  opt.cdata_is_comment ? "comment" : "text", '\0',
+                  opt.decode_entities, '\0',
+                  opt.charset ?: "auto", '\0',
+                  opt.max_output, '\0',
+                  opt.max_input, '\0',
+                  opt.deadline, '\0');
+}
+
+int serve_client(size_t max_buf) {
+  struct mapped_buffer input;
+  struct sockaddr_un addr;
+  struct output out;
+  char options[max_options];
+  char *chunk = nullptr;
+  uint32_t header[2];
+  bool text;
+  size_t options_len;
+  size_t len;
+  int fd = -1;
+  int rc;
+
+  if (opt.file)
+    rc = map_file(&input, max_buf, opt.file);
+  else
+    rc = map_stream(&input, max_buf, stdin);
+  if (rc != 0)
+    return rc;
+  rc = 1;
+
+  if ((options_len = client_options(options, sizeof options)) >= sizeof options) {
+    fprintf(stderr, "options cannot be sent to the server\n");
+    goto finish;
+  }
+  header[0] = htonl(options_len);
+  header[1] = htonl(input.length - 1);
+
+  if ((fd = open_socket(opt.client, &addr)) == -1)
+    goto finish;
+
+  if (connect(fd, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    fprintf(stderr, "could not connect to %s, %s\n", opt.client, strerror(errno));
+    goto finish;
+  }
+
+  if (send_fully(fd, (struct iovec[]) {
+                   { .iov_base = header, .iov_len = sizeof header },
+                   { .iov_base = options, .iov_len = options_len },
+                   { .iov_base = input.data, .iov_len = input.length - 1 },
+                 }, 3) != 0) {
+    fprintf(stderr, "could not send request, %s\n", strerror(errno));
+    goto finish;
+  }
+
+  if (recv_fully(fd, header, sizeof header) != 0) {
+    fprintf(stderr, "no response from %s\n", opt.client);
+    goto finish;
+  }
+
+  text = ntohl(header[0]) == STATUS_OK || ntohl(header[0]) == STATUS_TRUNCATED;
+  if (ntohl(header[0]) == STATUS_TRUNCATED)
+    any_truncated = true;
+
+  if ((chunk = malloc(client_chunk)) == nullptr ||
+      output_init(&out, text ? STDOUT_FILENO : STDERR_FILENO) != 0)
+    goto finish;
+
+  for (len = ntohl(header[1]); len;) {
+    size_t want = len < client_chunk ? len : client_chunk;
+
+    if (recv_fully(fd, chunk, want) != 0) {
+      fprintf(stderr, "response from %s cut short\n", opt.client);
+      break;
+    }
+    output_write(&out, chunk, want);
+    len -= want;
+  }
+
+  if (!text)
+    output_putc(&out, '\n');
+  if (output_flush(&out) == 0 && len == 0 && text)
+    rc = 0;
+  output_free(&out);
+
+finish:
+  free(chunk);
+  if (fd != -1)
+    close(fd);
+  free_map(&input);
+  return rc;
+}
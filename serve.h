@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _SERVE_H
+#define _SERVE_H
+
+#include "unhtml.h"
+#include "config.h"
+
+extern int serve(size_t max_buf, struct config_dir *confdirs);
+extern int serve_client(size_t max_buf);
+
+#endif
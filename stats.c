@@ -0,0 +1,318 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+/* Statistics
+ *
+ * Each document is measured separately, so that documents may be processed
+ * concurrently, and its measurements then added to totals for the run. The
+ * time spent in each phase is taken both from the monotonic clock and from
+ * the calling thread's CPU clock. For a batch, the totals are accompanied by
+ * histograms of document time and size and a list of the slowest documents.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "unhtml.h"
+#include "stats.h"
+
+static constexpr int max_parsers = 8;
+static constexpr int num_slowest = 10;
+static constexpr int time_buckets = 32;
+static constexpr int size_buckets = 48;
+
+static const char *phase_names[PHASE_MAX] = {
+  [PHASE_MAX_INPUT_BUFFER] = "max_input_buffer",
+  [PHASE_INIT_PARSERS]     = "init_parsers",
+  [PHASE_LOAD_CONFIG]      = "load_config",
+  [PHASE_MAP]              = "map",
+  [PHASE_MATCH]            = "parser_match",
+  [PHASE_PARSE]            = "parse",
+  [PHASE_WALK]             = "walk",
+  [PHASE_FLUSH]            = "flush",
+  [PHASE_CACHE]            = "cache",
+  [PHASE_CHARSET]          = "charset",
+};
+
+static struct {
+  pthread_mutex_t lock;
+  struct timespec start;
+  struct doc_stats total;
+  unsigned long docs;
+  unsigned long failed;
+  unsigned long truncated;
+  struct {
+    const char *name;
+    unsigned long docs;
+  } parsers[max_parsers];
+  /* Documents by wall time in microseconds and by size in bytes, each
+   * bucket counting those up to twice the size of the previous one */
+  unsigned long time_hist[time_buckets];
+  unsigned long size_hist[size_buckets];
+  /* Slowest documents, slowest first */
+  struct {
+    char *file;
+    double wall;
+  } slowest[num_slowest];
+  int num_slowest;
+} run = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int bucket(double value, int buckets) {
+  int i;
+
+  for (i = 0; i < buckets - 1 && value > (double) (1ull << i); i++);
+  return i;
+}
+
+/* Mark the start of the run */
+void stats_start(void) {
+  clock_gettime(CLOCK_MONOTONIC, &run.start);
+}
+
+void stats_begin(struct doc_stats *st, bool timing) {
+  *st = (struct doc_stats) {
+    .timing = timing,
+    .current = PHASE_NONE,
+  };
+}
+
+void stats_switch(struct doc_stats *st, enum phase phase) {
+  struct timespec wall, cpu;
+
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  if (st->current != PHASE_NONE) {
+    st->phase[st->current].wall += elapsed(&st->wall_mark, &wall);
+    st->phase[st->current].cpu += elapsed(&st->cpu_mark, &cpu);
+  }
+  st->current = phase;
+  st->wall_mark = wall;
+  st->cpu_mark = cpu;
+}
+
+static void keep_slowest(const char *file, double wall) {
+  int i;
+
+  if (run.num_slowest == num_slowest &&
+      wall <= run.slowest[num_slowest - 1].wall)
+    return;
+
+  if (run.num_slowest == num_slowest)
+    free(run.slowest[--run.num_slowest].file);
+
+  for (i = run.num_slowest; i > 0 && run.slowest[i - 1].wall < wall; i--)
+    run.slowest[i] = run.slowest[i - 1];
+  run.slowest[i].file = strdup(file);
+  run.slowest[i].wall = wall;
+  run.num_slowest++;
+}
+
+/* Add the measurements of a document to the totals for the run, or those
+ * of start-up if 'file' is null */
+void stats_add(const struct doc_stats *st, const char *file, int rc) {
+  double wall = 0;
+  int i;
+
+  if (opt.stats == STATS_NONE)
+    return;
+
+  pthread_mutex_lock(&run.lock);
+
+  for (i = 0; i < PHASE_MAX; i++) {
+    run.total.phase[i].wall += st->phase[i].wall;
+    run.total.phase[i].cpu += st->phase[i].cpu;
+    wall += st->phase[i].wall;
+  }
+
+  if (file) {
+    run.docs++;
+    if (rc != 0)
+      run.failed++;
+    else if (st->truncated)
+      run.truncated++;
+    run.total.bytes_in += st->bytes_in;
+    run.total.bytes_out += st->bytes_out;
+    run.total.elements += st->elements;
+    run.total.texts += st->texts;
+    run.total.comments += st->comments;
+    run.total.skipped += st->skipped;
+
+    if (st->parser) {
+      for (i = 0; i < max_parsers && run.parsers[i].name &&
+                  strcmp(run.parsers[i].name, st->parser); i++);
+      if (i < max_parsers) {
+        run.parsers[i].name = st->parser;
+        run.parsers[i].docs++;
+      }
+    }
+
+    run.time_hist[bucket(wall * 1e6, time_buckets)]++;
+    run.size_hist[bucket(st->bytes_in, size_buckets)]++;
+    keep_slowest(file, wall);
+  }
+
+  pthread_mutex_unlock(&run.lock);
+}
+
+static void json_string(FILE *f, const char *str) {
+  fputc('"', f);
+  for (; *str; str++) {
+    unsigned char c = *str;
+
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\u%04x", c);
+    else
+      fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+static void report_text(FILE *f, double total_wall, long max_rss) {
+  int i;
+
+  fprintf(f,
+          "documents          %lu (%lu failed, %lu truncated)\n"
+          "bytes in           %zu\n"
+          "bytes out          %zu\n"
+          "elements           %lu\n"
+          "text nodes         %lu\n"
+          "comments           %lu\n"
+          "skipped subtrees   %lu\n"
+          "peak rss           %ld KB\n"
+          "elapsed            %.6f s\n",
+          run.docs, run.failed, run.truncated,
+          run.total.bytes_in, run.total.bytes_out,
+          run.total.elements, run.total.texts, run.total.comments,
+          run.total.skipped, max_rss, total_wall);
+
+  for (i = 0; i < max_parsers && run.parsers[i].name; i++)
+    fprintf(f, "parser %-11s %lu\n", run.parsers[i].name, run.parsers[i].docs);
+
+  fprintf(f, "%-18s %10s %10s\n", "phase", "wall s", "cpu s");
+  for (i = 0; i < PHASE_MAX; i++)
+    fprintf(f, "%-18s %10.6f %10.6f\n", phase_names[i],
+            run.total.phase[i].wall, run.total.phase[i].cpu);
+
+  if (!opt.batch && !opt.serve)
+    return;
+
+  fprintf(f, "documents by time\n");
+  for (i = 0; i < time_buckets; i++)
+    if (run.time_hist[i])
+      fprintf(f, "  <= %10llu us %10lu\n", 1ull << i, run.time_hist[i]);
+
+  fprintf(f, "documents by size\n");
+  for (i = 0; i < size_buckets; i++)
+    if (run.size_hist[i])
+      fprintf(f, "  <= %10llu B  %10lu\n", 1ull << i, run.size_hist[i]);
+
+  fprintf(f, "slowest documents\n");
+  for (i = 0; i < run.num_slowest; i++)
+    fprintf(f, "  %10.6f s  %s\n", run.slowest[i].wall, run.slowest[i].file);
+}
+
+static void report_json(FILE *f, double total_wall, long max_rss) {
+  const char *sep;
+  int i;
+
+  fprintf(f,
+          "{\"documents\":%lu,\"failed\":%lu,\"truncated\":%lu,"
+          "\"bytes_in\":%zu,\"bytes_out\":%zu,"
+          "\"elements\":%lu,\"texts\":%lu,\"comments\":%lu,\"skipped\":%lu,"
+          "\"peak_rss_kb\":%ld,\"elapsed_s\":%.6f,",
+          run.docs, run.failed, run.truncated,
+          run.total.bytes_in, run.total.bytes_out,
+          run.total.elements, run.total.texts, run.total.comments,
+          run.total.skipped, max_rss, total_wall);
+
+  fprintf(f, "\"parsers\":{");
+  for (i = 0; i < max_parsers && run.parsers[i].name; i++) {
+    fputs(i ? "," : "", f);
+    json_string(f, run.parsers[i].name);
+    fprintf(f, ":%lu", run.parsers[i].docs);
+  }
+
+  fprintf(f, "},\"phases\":{");
+  for (i = 0; i < PHASE_MAX; i++)
+    fprintf(f, "%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f}", i ? "," : "",
+            phase_names[i], run.total.phase[i].wall, run.total.phase[i].cpu);
+  fputc('}', f);
+
+  if (opt.batch || opt.serve) {
+    fprintf(f, ",\"time_histogram_us\":[");
+    for (i = 0, sep = ""; i < time_buckets; i++) {
+      if (run.time_hist[i]) {
+        fprintf(f, "%s{\"le\":%llu,\"documents\":%lu}", sep, 1ull << i, run.time_hist[i]);
+        sep = ",";
+      }
+    }
+
+    fprintf(f, "],\"size_histogram_bytes\":[");
+    for (i = 0, sep = ""; i < size_buckets; i++) {
+      if (run.size_hist[i]) {
+        fprintf(f, "%s{\"le\":%llu,\"documents\":%lu}", sep, 1ull << i, run.size_hist[i]);
+        sep = ",";
+      }
+    }
+
+    fprintf(f, "],\"slowest\":[");
+    for (i = 0; i < run.num_slowest; i++) {
+      fputs(i ? ",{\"file\":" : "{\"file\":", f);
+      json_string(f, run.slowest[i].file ? run.slowest[i].file : "");
+      fprintf(f, ",\"wall_s\":%.6f}", run.slowest[i].wall);
+    }
+    fputc(']', f);
+  }
+
+  fputs("}\n", f);
+}
+
+/* Write out the statistics for the run to stderr or the stats file */
+int stats_report(void) {
+  struct timespec now;
+  struct rusage usage = {};
+  FILE *f = stderr;
+  int rc = 0;
+
+  if (opt.stats == STATS_NONE)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  getrusage(RUSAGE_SELF, &usage);
+
+  if (opt.stats_file && (f = fopen(opt.stats_file, "w")) == nullptr) {
+    fprintf(stderr, "could not open stats file %s, %s\n",
+            opt.stats_file, strerror(errno));
+    rc = 1;
+    goto finish;
+  }
+
+  if (opt.stats == STATS_JSON)
+    report_json(f, elapsed(&run.start, &now), usage.ru_maxrss);
+  else
+    report_text(f, elapsed(&run.start, &now), usage.ru_maxrss);
+
+  if (f != stderr && fclose(f) == EOF) {
+    fprintf(stderr, "error writing stats file %s, %s\n",
+            opt.stats_file, strerror(errno));
+    rc = 1;
+  }
+
+finish:
+  for (int i = 0; i < run.num_slowest; i++)
+    free(run.slowest[i].file);
+  run.num_slowest = 0;
+  return rc;
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: MIT */
+/* SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk> */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stddef.h>
+#include <time.h>
+
+enum stats_format : int {
+  STATS_NONE = 0,
+  STATS_TEXT,
+  STATS_JSON,
+};
+
+/* Phases of the run to which time is attributed */
+enum phase : int {
+  PHASE_MAX_INPUT_BUFFER,
+  PHASE_INIT_PARSERS,
+  PHASE_LOAD_CONFIG,
+  PHASE_MAP,
+  PHASE_MATCH,
+  PHASE_PARSE,
+  PHASE_WALK,
+  PHASE_FLUSH,
+  PHASE_CACHE,
+  PHASE_CHARSET,
+  PHASE_MAX,
+  PHASE_NONE = PHASE_MAX,
+};
+
+struct phase_time {
+  double wall;
+  double cpu;
+};
+
+/* Measurements of a single document, or of start-up */
+struct doc_stats {
+  bool timing;
+  enum phase current;
+  struct timespec wall_mark;
+  struct timespec cpu_mark;
+  struct phase_time phase[PHASE_MAX];
+  const char *parser;
+  size_t bytes_in;
+  size_t bytes_out;
+  unsigned long elements;
+  unsigned long texts;
+  unsigned long comments;
+  unsigned long skipped;
+  /* The text was cut short by a budget */
+  bool truncated;
+};
+
+extern void stats_start(void);
+extern void stats_begin(struct doc_stats *st, bool timing);
+extern void stats_switch(struct doc_stats *st, enum phase phase);
+extern void stats_add(const struct doc_stats *st, const char *file, int rc);
+extern int stats_report(void);
+
+/* Attribute the time from now on to 'phase', returning the phase to which
+ * time was being attributed until now */
+static inline enum phase stats_enter(struct doc_stats *st, enum phase phase) {
+  enum phase prev = st->current;
+
+  if (st->timing)
+    stats_switch(st, phase);
+  return prev;
+}
+
+#endif
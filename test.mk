@@ -4,15 +4,15 @@
 # Command to unvoke unhtml as if it were installed
 TEST_INVOKE_UNHTML=$(name) -confdir default
 
-.PHONY: check debug clean-tests check-testfiles check-xml
+.PHONY: check debug clean-tests check-testfiles check-xml check-scripts
 
-check: check-xml check-testfiles
+check: check-xml check-testfiles check-scripts
 
 debug: LOOSE_DIFF:=diff -u
 debug: check
 
 check-xml:
-	xmllint -noout $(wildcard default/*.xml)
+	xmllint -noout $(wildcard default/*.xml extra/*.xml)
 
 # Test suite follows pattern from predecessor unhtml-2.3.9:
 #   <https://salsa.debian.org/debian/unhtml/-/blob/upstream/2.3.9/tests/Makefile?ref_type=tags>
@@ -20,9 +20,15 @@ check-xml:
 #
 # The 'check' target tolerates differences in amount of whitespace.
 # The 'debug' target shows any difference at all.
+# Extra options for a test may be given in a matching .args file, and an
+# exit status other than 0 expected in a matching .status file.
+# The source directory in file URIs is replaced with @srcdir@.
 
+$(testfiles)%.tmp: status=$(or $(shell cat $(testfiles)$*.status 2>/dev/null),0)
 $(testfiles)%.tmp: $(testfiles)%.html $(name)
-	./$(TEST_INVOKE_UNHTML) $< > $@
+	./$(TEST_INVOKE_UNHTML) $(shell cat $(testfiles)$*.args 2>/dev/null) $< > $@; \
+	rc=$$?; test $$rc = $(status) || { echo "$<: exit status $$rc, expected $(status)"; false; }
+	sed -i 's|file://$(CURDIR)/|file://@srcdir@/|g' $@
 
 $(testfiles)%.result: $(testfiles)%.out $(testfiles)%.tmp
 	@$(LOOSE_DIFF) $^ && echo $(patsubst %.result,%,$@) > $@ || truncate -s 0 $@
@@ -36,3 +42,14 @@ check-testfiles: clean-tests $(name) $(patsubst %.html,%.result,$(wildcard $(tes
 	@$(if $(filter-out $(foreach r,$(results),$(file <$r)),$(tests)), \
   echo "At least one test failed"; false,true) && a=$$?; \
 	$(RM) $(results) && return $a
+
+# Tests of features that take more than one run of unhtml are shell scripts,
+# testfiles/*.sh, run with the command to invoke it in $UNHTML and an empty
+# scratch directory in $TESTDIR, failing with a non-zero exit status.
+check-scripts: $(name)
+	@rc=0; for t in $(wildcard $(testfiles)*.sh); do \
+	  dir=$$(mktemp -d) && \
+	  UNHTML="$(CURDIR)/$(name) -confdir $(CURDIR)/default" TESTDIR=$$dir \
+	    sh $$t || { echo "$$t failed"; rc=1; }; \
+	  rm -rf $$dir; \
+	done; exit $$rc
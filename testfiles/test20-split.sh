@@ -0,0 +1,32 @@
+# SPDX-License-Identifier: MIT
+# SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk>
+
+# Splitting a document must not change its text, including where parts start
+# within a comment or a script and so are parsed again after the part before
+
+set -e
+
+awk 'BEGIN {
+  print "<!DOCTYPE html>\n<html><head><title>Split</title></head><body>"
+  for (s = 0; s < 5; s++) {
+    if (s == 1) print "<!--"
+    if (s == 3) print "<script>"
+    for (i = 0; i < (s % 2 ? 40000 : 20000); i++)
+      if (s == 1) print "<p>commented out " i "</p>"
+      else if (s == 3) print "<div>in a script " i "</div>"
+      else print "<p>paragraph " s " line " i " &amp; <b>bold</b></p>"
+    if (s == 1) print "-->"
+    if (s == 3) print "</script>"
+  }
+  print "</body></html>"
+}' > $TESTDIR/doc.html
+
+for render in literal smart-space; do
+  $UNHTML -parser fast -render $render $TESTDIR/doc.html > $TESTDIR/whole.txt
+  $UNHTML -parser fast -render $render -split 4 -verbose $TESTDIR/doc.html \
+    > $TESTDIR/split.txt 2> $TESTDIR/log
+  cmp $TESTDIR/whole.txt $TESTDIR/split.txt
+done
+
+# The parts starting within the comment and the script
+test $(grep -c "parsing part . of document again" $TESTDIR/log) = 2
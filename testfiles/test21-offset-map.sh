@@ -0,0 +1,64 @@
+# SPDX-License-Identifier: MIT
+# SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk>
+
+# Each run in the offset map must point at input bytes that are the same as
+# the output at which it says they were rendered
+
+set -e
+
+cat > $TESTDIR/doc.html <<'END'
+<!DOCTYPE html>
+<html><head><title>Offsets</title></head>
+<body>
+<h1>Where text comes from</h1>
+<p>First paragraph, with <b>bold</b> and <i>italic</i> words.</p>
+<ul><li>café</li><li>日本語</li></ul>
+<!-- not text --><p>Last one.</p>
+</body></html>
+END
+
+# Print the output offset, input offset and input length of each run
+runs() {
+  od -An -v -tu1 $1 | LC_ALL=C awk '
+    BEGIN { m = 1 }
+    {
+      for (i = 1; i <= NF; i++) {
+        v += $i % 128 * m
+        m *= 128
+        if ($i < 128) {
+          f[n++ % 3] = v
+          v = 0
+          m = 1
+          if (n % 3 == 0) {
+            if (f[2] == 0) {
+              out = inp = 0
+            } else {
+              out += f[0]
+              inp += f[1] % 2 ? -(f[1] + 1) / 2 : f[1] / 2
+              print out, inp, f[2]
+            }
+          }
+        }
+      }
+    }'
+}
+
+slice() {
+  tail -c +$(($2 + 1)) $1 | head -c $3 | od -An -tx1
+}
+
+for parser in html xml fast; do
+  for stream in "" -stream; do
+    $UNHTML -parser $parser $stream -offset-map $TESTDIR/map \
+      $TESTDIR/doc.html > $TESTDIR/out
+    runs $TESTDIR/map > $TESTDIR/runs
+    test $(wc -l < $TESTDIR/runs) -ge 10
+    while read out in len; do
+      if [ "$(slice $TESTDIR/out $out $len)" != \
+           "$(slice $TESTDIR/doc.html $in $len)" ]; then
+        echo "$parser$stream: run at $out from $in of $len differs" >&2
+        exit 1
+      fi
+    done < $TESTDIR/runs
+  done
+done
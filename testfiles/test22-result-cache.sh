@@ -0,0 +1,55 @@
+# SPDX-License-Identifier: MIT
+# SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk>
+
+# Text kept in the result cache must be output as it was rendered, text
+# rendered differently must be kept apart, an entry must not be used for
+# other input and failures must not be kept
+
+set -e
+
+export XDG_CACHE_HOME=$TESTDIR
+cache="-cache $TESTDIR/results -verbose -verbose"
+
+printf '<p>one &amp; two</p>\n<p>caf\303\251</p>\n' > $TESTDIR/doc.html
+printf '<a><b></a>\n' > $TESTDIR/bad.xml
+
+entries() {
+  find $TESTDIR/results -path '*/??/*' -type f | wc -l
+}
+
+# Miss, then hit
+$UNHTML $cache $TESTDIR/doc.html > $TESTDIR/miss.txt 2> $TESTDIR/log
+grep -q "wrote cache entry" $TESTDIR/log
+$UNHTML $cache $TESTDIR/doc.html > $TESTDIR/hit.txt 2> $TESTDIR/log
+grep -q "using cache entry" $TESTDIR/log
+cmp $TESTDIR/miss.txt $TESTDIR/hit.txt
+$UNHTML $TESTDIR/doc.html | cmp - $TESTDIR/hit.txt
+test $(entries) = 1
+
+# Other rendering options miss
+$UNHTML $cache -render smart-space $TESTDIR/doc.html > $TESTDIR/smart.txt \
+  2> $TESTDIR/log
+grep -q "wrote cache entry" $TESTDIR/log
+if cmp -s $TESTDIR/smart.txt $TESTDIR/hit.txt; then exit 1; fi
+test $(entries) = 2
+
+# An entry made from other input, as if their digests collided, is not used
+printf '<p>other</p>\n' > $TESTDIR/other.html
+$UNHTML $cache $TESTDIR/other.html > /dev/null 2> $TESTDIR/log
+other=$(sed -n 's/.*wrote cache entry //p' $TESTDIR/log)
+$UNHTML $cache -render smart-space $TESTDIR/doc.html > /dev/null 2> $TESTDIR/log
+mine=$TESTDIR/results/$(sed -n 's/.*using cache entry //p' $TESTDIR/log)
+cp $TESTDIR/results/$other $mine
+$UNHTML $cache -render smart-space $TESTDIR/doc.html > $TESTDIR/collided.txt \
+  2> $TESTDIR/log
+grep -q "made from other input" $TESTDIR/log
+cmp $TESTDIR/smart.txt $TESTDIR/collided.txt
+test $(entries) = 3
+
+# Failure, not kept, so parsed again
+for i in 1 2; do
+  $UNHTML $cache -parser xml $TESTDIR/bad.xml > /dev/null 2> $TESTDIR/log
+  grep -q "xml parsing failed" $TESTDIR/log
+  if grep -q "cache entry" $TESTDIR/log; then exit 1; fi
+done
+test $(entries) = 3
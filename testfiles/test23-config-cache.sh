@@ -0,0 +1,63 @@
+# SPDX-License-Identifier: MIT
+# SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk>
+
+# The compiled configuration must be used while it is fresh and compiled
+# again once any configuration file is modified, added or removed, or the
+# cache itself is corrupt
+
+set -e
+
+export XDG_CACHE_HOME=$TESTDIR
+unhtml="$UNHTML -confdir $TESTDIR/conf -verbose"
+mkdir $TESTDIR/conf
+
+printf '<p>one <span>two</span> three</p>\n' > $TESTDIR/doc.html
+
+rules() {
+  cat > $TESTDIR/conf/20-test.xml <<END
+<?xml version="1.0" encoding="utf-8"?>
+<config xmlns="tag:sw.cdefg.uk,2024:unhtml/config">
+  <elements op="add">
+    <element tag="span" $1/>
+  </elements>
+</config>
+END
+}
+
+# Run, check which way the configuration was loaded and keep the output
+run() {
+  $unhtml $TESTDIR/doc.html > $TESTDIR/$1.txt 2> $TESTDIR/log
+  grep -q "$2" $TESTDIR/log
+}
+
+rules 'spacing="para"'
+run first "wrote config cache"
+run fresh "using config cache"
+cmp $TESTDIR/first.txt $TESTDIR/fresh.txt
+
+# Modified
+rules 'skip="skip"'
+run modified "is stale"
+grep -q "wrote config cache" $TESTDIR/log
+if cmp -s $TESTDIR/first.txt $TESTDIR/modified.txt; then exit 1; fi
+run fresh "using config cache"
+cmp $TESTDIR/modified.txt $TESTDIR/fresh.txt
+
+# Corrupt, with the last tag no longer terminated within the file
+cache=$(echo $TESTDIR/unhtml/config-*.cache)
+size=$(wc -c < $cache)
+printf xxxxxxxx | dd of=$cache bs=1 seek=$((size - 8)) conv=notrunc 2> /dev/null
+run corrupt "is stale"
+cmp $TESTDIR/modified.txt $TESTDIR/corrupt.txt
+
+# Touched only
+touch -d 2001-01-01 $TESTDIR/conf/20-test.xml
+run touched "is stale"
+cmp $TESTDIR/modified.txt $TESTDIR/touched.txt
+
+# Added and removed
+cp $TESTDIR/conf/20-test.xml $TESTDIR/conf/30-test.xml
+run added "is stale"
+rm $TESTDIR/conf/20-test.xml $TESTDIR/conf/30-test.xml
+run removed "is stale"
+$unhtml -no-config-cache $TESTDIR/doc.html 2> /dev/null | cmp - $TESTDIR/removed.txt
@@ -0,0 +1,66 @@
+# SPDX-License-Identifier: MIT
+# SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk>
+
+# Text from the server must be that output when processing directly, with
+# the client's options and exit status, including for containers
+
+set -e
+
+cp $(dirname $0)/test2-html4.html $TESTDIR/test2.html
+cp $(dirname $0)/test6-*.html $TESTDIR/test6.html
+cp $(dirname $0)/test11-warc.html $TESTDIR/warc
+cp $(dirname $0)/test12-mbox.html $TESTDIR/mbox
+printf '<a><b></a>\n' > $TESTDIR/bad.xml
+sock=$TESTDIR/sock
+
+$UNHTML -serve $sock -jobs 2 2> $TESTDIR/log &
+server=$!
+trap 'kill $server 2> /dev/null || true' EXIT
+
+for i in $(seq 50); do
+  [ -S $sock ] && break
+  sleep 0.1
+done
+
+# Output and exit status of processing directly and through the server
+compare() {
+  direct=0
+  client=0
+  $UNHTML "$@" > $TESTDIR/direct.txt 2> /dev/null || direct=$?
+  $UNHTML -client $sock "$@" > $TESTDIR/client.txt 2> /dev/null || client=$?
+  if [ $direct != $client ] ||
+     ! cmp -s $TESTDIR/direct.txt $TESTDIR/client.txt; then
+    echo "differs from direct: $*" >&2
+    exit 1
+  fi
+}
+
+compare $TESTDIR/test2.html
+compare -render smart-space $TESTDIR/test2.html
+compare -render smart-space -max-output 20 $TESTDIR/test2.html
+compare -parser xml $TESTDIR/test6.html
+compare -parser xml $TESTDIR/bad.xml
+
+# Containers, each record rendered separately
+compare $TESTDIR/warc
+compare -format ndjson $TESTDIR/warc
+compare -separator '--%f--' $TESTDIR/mbox
+compare -container none $TESTDIR/warc
+
+# Several requests at once
+clients=
+for i in 1 2 3 4; do
+  $UNHTML -client $sock $TESTDIR/test2.html > $TESTDIR/client$i.txt &
+  clients="$clients $!"
+done
+for pid in $clients; do
+  wait $pid
+done
+$UNHTML $TESTDIR/test2.html > $TESTDIR/direct.txt
+for i in 1 2 3 4; do
+  cmp $TESTDIR/direct.txt $TESTDIR/client$i.txt
+done
+
+kill $server
+wait $server || true
+trap - EXIT
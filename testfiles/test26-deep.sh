@@ -0,0 +1,28 @@
+# SPDX-License-Identifier: MIT
+# SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk>
+
+# A document nested far more deeply than any stack could recurse must be
+# rendered on a small stack, by the xml parser only with -huge
+
+set -e
+
+awk 'BEGIN {
+  for (i = 0; i < 100000; i++) printf "<div>"
+  printf "deep"
+  for (i = 0; i < 100000; i++) printf "</div>"
+  print ""
+}' > $TESTDIR/deep.html
+
+ulimit -s 256
+
+for args in "-parser fast" "-parser html -huge" "-parser html -huge -stream" \
+            "-parser xml -huge" "-parser xml -huge -stream"; do
+  $UNHTML $args $TESTDIR/deep.html > $TESTDIR/out
+  test "$(cat $TESTDIR/out)" = deep || {
+    echo "deep document with $args" >&2
+    exit 1
+  }
+done
+
+$UNHTML -parser xml $TESTDIR/deep.html > $TESTDIR/out 2> $TESTDIR/log
+grep -q "xml parsing failed" $TESTDIR/log
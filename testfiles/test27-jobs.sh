@@ -0,0 +1,42 @@
+# SPDX-License-Identifier: MIT
+# SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk>
+
+# A batch processed by several workers must give the same output as one
+# processed in turn, in the same order unless -unordered is given
+
+set -e
+
+# Documents of very different sizes, so that workers finish out of order
+mkdir $TESTDIR/docs
+for i in $(seq 10 49); do
+  awk -v i=$i 'BEGIN {
+    print "<!DOCTYPE html>\n<html><head><title>Doc " i "</title></head><body>"
+    for (n = 0; n < (i % 7) * (i % 7) * 2000 + 1; n++)
+      print "<p>document " i " line " n " &amp; <b>bold</b></p>"
+    print "</body></html>"
+  }' > $TESTDIR/docs/$i.html
+done
+
+$UNHTML -batch $TESTDIR/docs/*.html > $TESTDIR/seq.txt
+$UNHTML -batch -jobs 4 $TESTDIR/docs/*.html > $TESTDIR/jobs.txt
+cmp $TESTDIR/seq.txt $TESTDIR/jobs.txt
+
+# Split output at the separators, which start lines since each document ends
+# with a newline, and compare the documents as sets
+records() {
+  rm -rf $TESTDIR/records
+  mkdir $TESTDIR/records
+  awk -v dir=$TESTDIR/records '
+    BEGIN { n = 0 }
+    /^@@$/ { close(dir "/" n); n++; next }
+    { print > (dir "/" n) }' $1
+  test $(ls $TESTDIR/records | wc -l) = 40
+  for f in $TESTDIR/records/*; do cksum < $f; done | sort
+}
+
+$UNHTML -batch -separator '@@\n' $TESTDIR/docs/*.html > $TESTDIR/seq.txt
+records $TESTDIR/seq.txt > $TESTDIR/seq.sum
+$UNHTML -batch -jobs 4 -unordered -separator '@@\n' $TESTDIR/docs/*.html \
+  > $TESTDIR/unordered.txt
+records $TESTDIR/unordered.txt > $TESTDIR/unordered.sum
+cmp $TESTDIR/seq.sum $TESTDIR/unordered.sum
@@ -0,0 +1,63 @@
+# SPDX-License-Identifier: MIT
+# SPDX-FileCopyrightText: (c) Copyright 2024 Andrew Bower <andrew@bower.uk>
+
+# Batches named on the command line, in a list or by walking a directory,
+# with their text separated on stdout or mirrored beneath an output directory
+
+set -e
+
+cd $TESTDIR
+
+doc() {
+  mkdir -p $(dirname $1)
+  echo "<p>Doc $2</p>" > $1
+}
+
+doc tree/b.html b
+doc tree/a.html a
+doc tree/c/d.html d
+doc tree/c/e.htm e
+doc tree/skip/f.html f
+doc outside/g.html g
+echo "Doc h" > tree/notes.md
+ln -s ../outside/g.html tree/link.html
+ln -s ../outside tree/linkdir
+
+# In order of name, following the link to a file but not that to a directory
+$UNHTML -recursive -include '*.html' -exclude skip -separator '== %f\n' tree \
+  > tree.txt
+{
+  printf 'Doc a\n== tree/b.html\nDoc b\n'
+  printf '== tree/c/d.html\nDoc d\n== tree/link.html\nDoc g\n'
+} | cmp - tree.txt
+
+# Without patterns, every file found
+$UNHTML -recursive -separator '== %f\n' tree/ > all.txt
+test $(grep -c '^==' all.txt) = 6
+grep -q '^== tree/c/e.htm$' all.txt
+grep -q '^== tree/notes.md$' all.txt
+grep -q '^== tree/skip/f.html$' all.txt
+
+# Named on the command line or in a list, in the order given
+$UNHTML -batch -separator '== %f\n' tree/c/d.html tree/a.html > batch.txt
+printf 'Doc d\n== tree/a.html\nDoc a\n' | cmp - batch.txt
+printf 'tree/c/d.html\n\ntree/a.html\n' > list
+$UNHTML -files-from list -separator '== %f\n' | cmp batch.txt -
+printf 'tree/c/d.html\0tree/a.html\0' |
+  $UNHTML -files-from - -separator '== %f\n' | cmp batch.txt -
+
+# Mirrored beneath an output directory
+$UNHTML -recursive -include '*.html' -exclude skip -outdir out tree
+find out -type f | sort > outfiles
+printf 'out/tree/a.txt\nout/tree/b.txt\nout/tree/c/d.txt\nout/tree/link.txt\n' |
+  cmp - outfiles
+for f in a b c/d link; do
+  $UNHTML tree/$f.html | cmp - out/tree/$f.txt
+done
+
+# But never outside it
+if $UNHTML -batch -outdir out/x ../${PWD##*/}/tree/a.html 2> log; then
+  exit 1
+fi
+grep -q "refusing to write output outside out/x for \.\./.*/tree/a.html" log
+test ! -e out/x
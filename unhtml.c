@@ -20,8 +20,18 @@
 #include "unhtml.h"
 #include "load.h"
 #include "config.h"
+#include "render.h"
+#include "output.h"
+#include "batch.h"
+#include "serve.h"
+#include "container.h"
+#include "json.h"
+#include "offset-map.h"
+#include "result-cache.h"
+#include "charset.h"
 #include "parse-gumbo.h"
 #include "parse-libxml2.h"
+#include "parse-fast.h"
 
 enum opt:int {
   OPT_VERSION = 0x1000,
@@ -32,29 +42,96 @@ enum opt:int {
   OPT_VERBOSE,
   OPT_CONFDIR,
   OPT_RENDER,
+  OPT_STREAM,
+  OPT_BATCH,
+  OPT_FILES_FROM,
+  OPT_SEPARATOR,
+  OPT_OUTDIR,
+  OPT_JOBS,
+  OPT_UNORDERED,
+  OPT_NO_CONFIG_CACHE,
+  OPT_STATS,
+  OPT_STATS_FILE,
+  OPT_DECODE_ENTITIES,
+  OPT_SERVE,
+  OPT_CLIENT,
+  OPT_CONTAINER,
+  OPT_FORMAT,
+  OPT_OFFSET_MAP,
+  OPT_XML_POOL,
+  OPT_HUGE,
+  OPT_RECURSIVE,
+  OPT_INCLUDE,
+  OPT_EXCLUDE,
+  OPT_READ_AHEAD,
+  OPT_CACHE,
+  OPT_CACHE_SIZE,
+  OPT_CHARSET,
+  OPT_SPLIT,
+  OPT_MAX_OUTPUT,
+  OPT_MAX_INPUT,
+  OPT_DEADLINE,
 };
 
 struct options opt;
 
+/* Set once the text of any document has been cut short */
+bool any_truncated;
+
 const char *render_mode_names[RENDER_MODE_MAX] = {
   [RENDER_MODE_LITERAL]     = "literal",
   [RENDER_MODE_SMART_SPACE] = "smart-space",
 };
 
+const char *output_format_names[OUTPUT_FORMAT_MAX] = {
+  [OUTPUT_FORMAT_TEXT]   = "text",
+  [OUTPUT_FORMAT_NDJSON] = "ndjson",
+};
+
+const char *container_names[CONTAINER_MAX] = {
+  [CONTAINER_AUTO] = "auto",
+  [CONTAINER_NONE] = "none",
+  [CONTAINER_WARC] = "warc",
+  [CONTAINER_MBOX] = "mbox",
+};
+
 const struct parser_defn *parser_defs[] = {
 LIBXML2_PARSERS
 GUMBO_PARSERS
+FAST_PARSERS
 };
 static constexpr size_t num_parsers = sizeof parser_defs/sizeof *parser_defs;
 static struct parser parsers[num_parsers];
 
 static const char *version_str = STRINGIFY(UNHTML_VERSION);
 
+static const char *default_separator = "\f\n";
+
+static const char *default_record_separator = "\f%f\n";
+
+static constexpr long max_jobs = 1024;
+
+static constexpr int default_read_ahead = 16;
+
+static constexpr long max_read_ahead = 4096;
+
+static constexpr size_t default_cache_size = 0x4000'0000;
+
+static struct offset_map offset_map;
+
+/* Amount of input within which to look for hints as to the document type */
+static constexpr size_t match_window = 1024;
+
 static void usage(FILE *out) {
   fprintf(out,
           "usage: %s -version              show version information\n"
           "       %s -help                 show help\n"
-          "       %s [OPTIONS] [FILENAME]  process FILENAME or stdin\n\n"
+          "       %s [OPTIONS] [FILENAME]  process FILENAME or stdin\n"
+          "       %s [OPTIONS] -batch FILENAME...\n"
+          "       %s [OPTIONS] -files-from=LIST\n"
+          "       %s [OPTIONS] -recursive DIRECTORY...\n"
+          "       %s [OPTIONS] -serve=SOCKET\n"
+          "       %s [OPTIONS] -client=SOCKET [FILENAME]\n\n"
           "OPTIONS\n"
           "  -verbose          show verbose output\n"
           "  -comment          include comments\n"
@@ -62,10 +139,44 @@ static void usage(FILE *out) {
           "  -cdata=text       treat CDATA sections as text (default)\n"
           "  -parser=PARSER    use PARSER parser\n"
           "  -confdir=CONFDIR  set configuration search path; subsequently prepend to it\n"
+          "  -no-config-cache  neither use nor update the compiled configuration cache\n"
+          "  -xml-pool         allocate libxml's memory for each document from a pool\n"
+          "  -huge             lift libxml's limits on nesting and sizes, for trusted input\n"
           "  -render=MODE      set rendering mode\n"
+          "  -decode-entities  decode character references left in the text\n"
+          "  -charset=CHARSET  read input as CHARSET, as if given in a Content-Type header\n"
+          "  -container=TYPE   read records from a warc or mbox container, auto or none\n"
+          "  -format=FORMAT    output text (default) or ndjson, a JSON object per document\n"
+          "  -stream           render while parsing, without building a tree\n"
+          "  -offset-map=FILE  write where each run of text came from in the input to FILE\n"
+          "  -max-output=SIZE  stop once SIZE bytes of a document's text are output\n"
+          "  -max-input=SIZE   render only the first SIZE bytes of each document\n"
+          "  -deadline=MS      stop rendering a document MS milliseconds after starting it\n"
+          "  -cache=DIR        reuse text rendered from the same input before, kept in DIR\n"
+          "  -cache-size=SIZE  limit the cache to SIZE bytes, or with suffix K, M or G\n"
+          "  -batch            process each FILENAME in turn\n"
+          "  -files-from=LIST  process files named in LIST, one per line or NUL-separated\n"
+          "  -recursive        process the files beneath each DIRECTORY\n"
+          "  -include=GLOB     with -recursive, process only files whose names match GLOB\n"
+          "  -exclude=GLOB     with -recursive, skip files and directories matching GLOB\n"
+          "  -read-ahead=N     in batch mode, read up to N files ahead (default 16)\n"
+          "  -separator=SEP    output SEP between documents in batch mode\n"
+          "  -outdir=DIR       in batch mode, write each document's text under DIR\n"
+          "  -jobs=N           in batch or serve mode, process N documents at a time\n"
+          "  -unordered        with -jobs, output documents as they complete\n"
+          "  -split=N          with the fast parser, parse a large document in N parts at once\n"
+          "  -stats[=FORMAT]   report statistics as text (default) or json\n"
+          "  -stats-file=FILE  write statistics to FILE instead of stderr\n"
+          "  -serve=SOCKET     serve requests on the Unix domain socket SOCKET\n"
+          "  -client=SOCKET    have the server on SOCKET process FILENAME or stdin\n"
           ,
           program_invocation_short_name,
           program_invocation_short_name,
+          program_invocation_short_name,
+          program_invocation_short_name,
+          program_invocation_short_name,
+          program_invocation_short_name,
+          program_invocation_short_name,
           program_invocation_short_name);
 }
 
@@ -95,6 +206,10 @@ int find_parser(const char *name) {
   return i == num_parsers ? -1 : i;
 }
 
+const char *parser_name(int parser) {
+  return parser_defs[parser]->name;
+}
+
 void init_parsers(void) {
   int i;
   memset(&parsers, '\0', sizeof parsers);
@@ -103,6 +218,8 @@ void init_parsers(void) {
     int rc;
 
     p->def = parser_defs[i];
+    if (p->def->init_fn)
+      p->def->init_fn();
     if (p->def->imatch_pat) {
       rc = regcomp(&p->match_re, p->def->imatch_pat, REG_EXTENDED | REG_ICASE);
       if (rc != 0)
@@ -113,7 +230,15 @@ void init_parsers(void) {
   }
 }
 
-void parser_match(struct mapped_buffer *input) {
+/* Let parsers prepare for the configuration just loaded */
+void configure_parsers(void) {
+  for (int i = 0; i < num_parsers; i++) {
+    if (parser_defs[i]->config_fn)
+      parser_defs[i]->config_fn();
+  }
+}
+
+int parser_match(struct mapped_buffer *input) {
   int i;
 
   for (i = 0; i < num_parsers; i++) {
@@ -125,8 +250,8 @@ void parser_match(struct mapped_buffer *input) {
     /* Require the DOCTYPE or <?xml> prolog to be within the first 1KB of
      * the input. These should occur before any other content anyway but
      * comments can often be found beforehand so let's match liberally. */
-    if (matches[0].rm_eo > 1024)
-      matches[0].rm_eo = 1024;
+    if (matches[0].rm_eo > match_window)
+      matches[0].rm_eo = match_window;
 
     if (p->has_matcher &&
         regexec(&p->match_re,
@@ -137,12 +262,12 @@ void parser_match(struct mapped_buffer *input) {
   }
 
   if (i != num_parsers) {
-    opt.parser = i;
     logv("selected '%s' parser based on content\n",
          parsers[i].def->name);
+    return i;
   } else {
-    opt.parser = -1;
     logv("no parser matched, using default\n");
+    return -1;
   }
 }
 
@@ -154,6 +279,77 @@ void free_parsers(void) {
   memset(parsers, '\0', sizeof parsers);
 }
 
+/* Decode backslash escapes in place, returning the decoded length, which may
+ * include NULs. */
+static size_t unescape(char *str) {
+  char *in, *out;
+
+  for (in = out = str; *in; in++, out++) {
+    if (*in != '\\' || !in[1]) {
+      *out = *in;
+      continue;
+    }
+    switch (*++in) {
+    case 'n':
+      *out = '\n';
+      break;
+    case 't':
+      *out = '\t';
+      break;
+    case 'f':
+      *out = '\f';
+      break;
+    case '0':
+      *out = '\0';
+      break;
+    default:
+      *out = *in;
+    }
+  }
+  return out - str;
+}
+
+/* Parse a size in bytes with an optional binary suffix, returning zero if
+ * it is not valid */
+static size_t parse_size(const char *str) {
+  char *end;
+  unsigned long long size = strtoull(str, &end, 10);
+  int shift = 0;
+
+  if (end == str || *str == '-')
+    return 0;
+  switch (*end) {
+  case 'G':
+  case 'g':
+    shift += 10;
+    [[fallthrough]];
+  case 'M':
+  case 'm':
+    shift += 10;
+    [[fallthrough]];
+  case 'K':
+  case 'k':
+    shift += 10;
+    end++;
+    break;
+  }
+  if (*end || size > SIZE_MAX >> shift)
+    return 0;
+  return size << shift;
+}
+
+static int add_pattern(const char ***patterns, int *num, const char *pattern) {
+  const char **grown = reallocarray(*patterns, *num + 1, sizeof *grown);
+
+  if (grown == nullptr) {
+    fprintf(stderr, "could not allocate pattern, %s\n", strerror(errno));
+    return 1;
+  }
+  grown[(*num)++] = pattern;
+  *patterns = grown;
+  return 0;
+}
+
 static void parse_options(int argc, char *argv[]) {
   const struct option options[] = {
     { "version", no_argument,       0, OPT_VERSION },
@@ -164,13 +360,51 @@ static void parse_options(int argc, char *argv[]) {
     { "verbose", no_argument,       0, OPT_VERBOSE },
     { "confdir", required_argument, 0, OPT_CONFDIR },
     { "render",  required_argument, 0, OPT_RENDER },
+    { "stream",  no_argument,       0, OPT_STREAM },
+    { "batch",   no_argument,       0, OPT_BATCH },
+    { "files-from", required_argument, 0, OPT_FILES_FROM },
+    { "separator", required_argument, 0, OPT_SEPARATOR },
+    { "outdir",  required_argument, 0, OPT_OUTDIR },
+    { "jobs",    required_argument, 0, OPT_JOBS },
+    { "unordered", no_argument,     0, OPT_UNORDERED },
+    { "no-config-cache", no_argument, 0, OPT_NO_CONFIG_CACHE },
+    { "stats",   optional_argument, 0, OPT_STATS },
+    { "stats-file", required_argument, 0, OPT_STATS_FILE },
+    { "decode-entities", no_argument, 0, OPT_DECODE_ENTITIES },
+    { "serve",   required_argument, 0, OPT_SERVE },
+    { "client",  required_argument, 0, OPT_CLIENT },
+    { "container", required_argument, 0, OPT_CONTAINER },
+    { "format",  required_argument, 0, OPT_FORMAT },
+    { "offset-map", required_argument, 0, OPT_OFFSET_MAP },
+    { "xml-pool", no_argument,      0, OPT_XML_POOL },
+    { "huge",    no_argument,       0, OPT_HUGE },
+    { "recursive", no_argument,     0, OPT_RECURSIVE },
+    { "include", required_argument, 0, OPT_INCLUDE },
+    { "exclude", required_argument, 0, OPT_EXCLUDE },
+    { "read-ahead", required_argument, 0, OPT_READ_AHEAD },
+    { "cache",   required_argument, 0, OPT_CACHE },
+    { "cache-size", required_argument, 0, OPT_CACHE_SIZE },
+    { "charset", required_argument, 0, OPT_CHARSET },
+    { "split",   required_argument, 0, OPT_SPLIT },
+    { "max-output", required_argument, 0, OPT_MAX_OUTPUT },
+    { "max-input", required_argument, 0, OPT_MAX_INPUT },
+    { "deadline", required_argument, 0, OPT_DEADLINE },
     { nullptr }
   };
+  bool separator = false;
   int option_index;
   int c;
 
   memset(&opt, '\0', sizeof opt);
   opt.parser = -1;
+  opt.jobs = 1;
+  opt.split = 1;
+  opt.read_ahead = default_read_ahead;
+  opt.cache_size = default_cache_size;
+  opt.separator = default_separator;
+  opt.separator_len = strlen(default_separator);
+  opt.record_separator = default_record_separator;
+  opt.record_separator_len = strlen(default_record_separator);
 
   do {
     c = getopt_long_only(argc, argv, "", options, &option_index);
@@ -229,6 +463,153 @@ static void parse_options(int argc, char *argv[]) {
       if (opt.render_mode == RENDER_MODE_MAX)
         opt.error = true;
       break;
+    case OPT_STREAM:
+      opt.stream = true;
+      break;
+    case OPT_BATCH:
+      opt.batch = true;
+      break;
+    case OPT_FILES_FROM:
+      opt.files_from = optarg;
+      opt.batch = true;
+      break;
+    case OPT_SEPARATOR:
+      opt.separator_len = unescape(optarg);
+      opt.separator = optarg;
+      opt.record_separator_len = opt.separator_len;
+      opt.record_separator = optarg;
+      separator = true;
+      break;
+    case OPT_OUTDIR:
+      opt.outdir = optarg;
+      break;
+    case OPT_JOBS:
+      {
+        char *end;
+        long jobs = strtol(optarg, &end, 10);
+        if (*end || jobs < 1 || jobs > max_jobs)
+          opt.error = true;
+        else
+          opt.jobs = jobs;
+      }
+      break;
+    case OPT_UNORDERED:
+      opt.unordered = true;
+      break;
+    case OPT_NO_CONFIG_CACHE:
+      opt.no_config_cache = true;
+      break;
+    case OPT_STATS:
+      if (!optarg || !strcmp(optarg, "text"))
+        opt.stats = STATS_TEXT;
+      else if (!strcmp(optarg, "json"))
+        opt.stats = STATS_JSON;
+      else
+        opt.error = true;
+      break;
+    case OPT_DECODE_ENTITIES:
+      opt.decode_entities = true;
+      break;
+    case OPT_STATS_FILE:
+      opt.stats_file = optarg;
+      if (!opt.stats)
+        opt.stats = STATS_TEXT;
+      break;
+    case OPT_SERVE:
+      opt.serve = optarg;
+      break;
+    case OPT_CLIENT:
+      opt.client = optarg;
+      break;
+    case OPT_CONTAINER:
+      for (opt.container = 0;
+           opt.container < CONTAINER_MAX &&
+             strcmp(optarg, container_names[opt.container]);
+           opt.container++);
+      if (opt.container == CONTAINER_MAX)
+        opt.error = true;
+      break;
+    case OPT_FORMAT:
+      for (opt.format = 0;
+           opt.format < OUTPUT_FORMAT_MAX &&
+             strcmp(optarg, output_format_names[opt.format]);
+           opt.format++);
+      if (opt.format == OUTPUT_FORMAT_MAX)
+        opt.error = true;
+      break;
+    case OPT_OFFSET_MAP:
+      opt.offset_map = optarg;
+      break;
+    case OPT_XML_POOL:
+      opt.xml_pool = true;
+      break;
+    case OPT_HUGE:
+      opt.huge = true;
+      break;
+    case OPT_RECURSIVE:
+      opt.recursive = true;
+      opt.batch = true;
+      break;
+    case OPT_INCLUDE:
+      if (add_pattern(&opt.include, &opt.num_include, optarg) != 0)
+        opt.error = true;
+      break;
+    case OPT_EXCLUDE:
+      if (add_pattern(&opt.exclude, &opt.num_exclude, optarg) != 0)
+        opt.error = true;
+      break;
+    case OPT_READ_AHEAD:
+      {
+        char *end;
+        long files = strtol(optarg, &end, 10);
+        if (*end || files < 0 || files > max_read_ahead)
+          opt.error = true;
+        else
+          opt.read_ahead = files;
+      }
+      break;
+    case OPT_CACHE:
+      opt.cache = optarg;
+      break;
+    case OPT_CACHE_SIZE:
+      if ((opt.cache_size = parse_size(optarg)) == 0)
+        opt.error = true;
+      break;
+    case OPT_SPLIT:
+      {
+        char *end;
+        long parts = strtol(optarg, &end, 10);
+        if (*end || parts < 1 || parts > max_jobs)
+          opt.error = true;
+        else
+          opt.split = parts;
+      }
+      break;
+    case OPT_MAX_OUTPUT:
+      if ((opt.max_output = parse_size(optarg)) == 0)
+        opt.error = true;
+      break;
+    case OPT_MAX_INPUT:
+      if ((opt.max_input = parse_size(optarg)) == 0)
+        opt.error = true;
+      break;
+    case OPT_DEADLINE:
+      {
+        char *end;
+        long ms = strtol(optarg, &end, 10);
+        if (*end || ms < 1)
+          opt.error = true;
+        else
+          opt.deadline = ms;
+      }
+      break;
+    case OPT_CHARSET:
+      /* No longer label is known */
+      if (strlen(optarg) >= CHARSET_MAX_LABEL)
+        opt.error = true;
+      else
+        opt.charset = strcmp(optarg, "auto") ? optarg : nullptr;
+      break;
     case -1:
       /* EOF */
       break;
@@ -240,6 +621,38 @@ static void parse_options(int argc, char *argv[]) {
   if (c != -1)
     opt.error = true;
 
+  /* Each JSON object is a line of its own, so needs no separator */
+  if (opt.format == OUTPUT_FORMAT_NDJSON && !separator)
+    opt.separator_len = opt.record_separator_len = 0;
+
+  if (opt.serve && (opt.client || opt.batch || opt.outdir || opt.unordered ||
+                    optind < argc))
+    opt.error = true;
+
+  if ((opt.num_include || opt.num_exclude) && !opt.recursive)
+    opt.error = true;
+
+  /* The map follows the order in which documents are rendered */
+  if (opt.offset_map && (opt.serve || opt.client || opt.jobs > 1 || opt.split > 1))
+    opt.error = true;
+
+  if (opt.serve)
+    return;
+
+  if (opt.client && opt.batch)
+    opt.error = true;
+
+  if (opt.batch) {
+    opt.files = argv + optind;
+    opt.num_files = argc - optind;
+    if (opt.num_files == 0 && !opt.files_from)
+      opt.error = true;
+    return;
+  }
+
+  if (opt.outdir || opt.jobs > 1 || opt.unordered)
+    opt.error = true;
+
   if (optind < argc)
     opt.file = argv[optind++];
 
@@ -250,6 +663,9 @@ static void parse_options(int argc, char *argv[]) {
 static void free_options(void) {
   struct config_dir **cdp, *cd;
 
+  free(opt.include);
+  free(opt.exclude);
+
   for (cdp = &opt.confdirs; (cd = *cdp);) {
     *cdp = cd->next;
     if (cd->name_needs_free)
@@ -276,20 +692,270 @@ static size_t max_input_buffer(void) {
   max_buf = max_mem.rlim_cur == RLIM_INFINITY ? SIZE_MAX : max_mem.rlim_cur;
   max_buf >>= 2;
 
-  /* According to gumbo.h, the maximum input buffer size is 4GB */
-  if (max_buf > 0xFFFF'FFFFul)
-    max_buf = 0xFFFF'FFFFul;
-
   return max_buf;
 }
 
-int main(int argc, char *argv[]) {
+/* Write the JSON object describing a document and holding its text */
+static void write_record(struct output *out, const struct mapped_buffer *input,
+                         const char *parser, size_t bytes_in, bool truncated,
+                         const char *title, size_t title_len,
+                         const char *text, size_t text_len) {
+  char counts[96];
+
+  output_puts(out, "{\"uri\":");
+  if (input->uri)
+    json_escape(out, input->uri, strlen(input->uri));
+  else
+    output_puts(out, "null");
+  output_puts(out, ",\"parser\":");
+  json_escape(out, parser, strlen(parser));
+  output_write(out, counts,
+               snprintf(counts, sizeof counts,
+                        ",\"bytes_in\":%zu,\"bytes_out\":%zu%s,\"title\":",
+                        bytes_in, text_len,
+                        truncated ? ",\"truncated\":true" : ""));
+  if (title_len)
+    json_escape(out, title, title_len);
+  else
+    output_puts(out, "null");
+  output_puts(out, ",\"text\":");
+  json_escape(out, text, text_len);
+  output_puts(out, "}\n");
+}
+
+/* Output the text of a document from the result cache */
+static int output_cached(struct output *out, const struct mapped_buffer *input,
+                         const struct options *o, const char *parser,
+                         struct cached_result *cached) {
+  int rc = 0;
+
+  if (o->format == OUTPUT_FORMAT_NDJSON) {
+    write_record(out, input, parser, input->consumed + input->length - 1, false,
+                 cached->title, cached->title_len,
+                 cached->text, cached->text_len);
+  } else {
+    /* The entry stays mapped only until the text is written */
+    output_ref(out, cached->text, cached->text_len);
+    rc = output_flush(out);
+  }
+  result_cache_release(cached);
+  return rc;
+}
+
+/* Choose a parser for the input, which is already mapped or at least has its
+ * head read, and render it according to the options 'o' */
+int process_input(struct mapped_buffer *input, size_t max_buf,
+                  const struct options *o, struct output *out,
+                  struct doc_stats *stats) {
+  struct render_ctx rctx;
+  struct output title, text;
+  struct cached_result cached;
+  struct mapped_buffer utf8, prefix;
+  struct mapped_buffer *doc = input;
+  struct timespec deadline;
+  struct cache_key key;
+  size_t out_start = out->total;
+  bool ndjson = o->format == OUTPUT_FORMAT_NDJSON;
+  bool stream, cache;
+  bool converted = false;
+  bool truncated = false;
+  int parser;
+  int parsed;
+  int rc = 0;
+
+  /* The time allowed runs from when the document is taken up */
+  if (o->deadline) {
+    long nsec;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    nsec = deadline.tv_nsec + o->deadline % 1000 * 1'000'000;
+    deadline.tv_sec += o->deadline / 1000 + nsec / 1'000'000'000;
+    deadline.tv_nsec = nsec % 1'000'000'000;
+  }
+
+  /* Attempt to determine HTML type */
+  parser = o->parser;
+  if (parser < 0) {
+    stats_enter(stats, PHASE_MATCH);
+    parser = parser_match(input);
+  }
+
+  /* Choose default parser */
+  if (parser < 0) {
+    parser = 0;
+  }
+
+  stats->parser = parser_defs[parser]->name;
+
+  /* Only libxml's SAX interface tells where in the input text comes from */
+  stream = (o->stream || o->offset_map) && parser_defs[parser]->stream_fn;
+
+  /* Text is looked up by the whole of the input, and the offset map needs
+   * it to be parsed */
+  cache = opt.cache && !stream && !o->offset_map;
+
+  stats_enter(stats, PHASE_MAP);
+  if (!stream &&
+      (rc = map_stream_rest(input, max_buf)) != 0)
+    goto finish;
+
+  if (cache) {
+    stats_enter(stats, PHASE_CACHE);
+    result_cache_key(&key, input, o, stats->parser);
+    if (result_cache_lookup(&key, &cached)) {
+      rc = output_cached(out, input, o, stats->parser, &cached);
+      goto finish;
+    }
+  }
+
+  /* Only so much of the input is parsed, cut back to the start of any
+   * UTF-8 sequence split by the limit; the streaming parser stops itself */
+  if (!stream && o->max_input && input->length - 1 > o->max_input) {
+    size_t len = o->max_input;
+
+    for (int i = 0; i < 3 && len && (input->data[len] & 0xc0) == 0x80; i++)
+      len--;
+    prefix = *input;
+    prefix.length = len + 1;
+    doc = &prefix;
+    truncated = true;
+  }
+
+  /* Parsers are given UTF-8, except when streaming, as libxml then decodes
+   * the input itself, and for the offset map, which refers to the input */
+  if (!stream && !o->offset_map) {
+    stats_enter(stats, PHASE_CHARSET);
+    if ((rc = charset_to_utf8(doc, max_buf, o->charset, &utf8, &converted)) != 0)
+      goto finish;
+    doc = &utf8;
+  }
+
+  render_init(&rctx, o, out, stats);
+  rctx.cut_short = truncated;
+
+  /* Collect the text, and the title, in memory to write them out as JSON
+   * or to keep them in the cache */
+  if (ndjson || cache) {
+    output_init(&title, -1);
+    output_init(&text, -1);
+    rctx.out = &text;
+    if (ndjson)
+      rctx.title = &title;
+  }
+
+  if (o->max_output)
+    rctx.out_limit = rctx.out->total + o->max_output;
+  if (o->deadline)
+    rctx.deadline = deadline;
+
+  if (o->offset_map) {
+    rctx.map = &offset_map;
+    rctx.map_start = rctx.out->total;
+    offset_map_begin(&offset_map);
+  }
+
+  stats_enter(stats, PHASE_PARSE);
+
+  if (stream) {
+    parsed = parser_defs[parser]->stream_fn(input, &rctx);
+  } else {
+    if (o->stream)
+      logv("'%s' parser does not support streaming\n",
+           parser_defs[parser]->name);
+    parsed = parser_defs[parser]->parse_fn(doc, &rctx);
+  }
+
+  if (!ndjson)
+    render_finish(&rctx);
+
+  if ((truncated = rctx.stopped || rctx.cut_short))
+    __atomic_store_n(&any_truncated, true, __ATOMIC_RELAXED);
+
+  if (ndjson || cache) {
+    if (title.error || text.error) {
+      rc = 1;
+    } else {
+      /* Nothing is kept or recorded of a document that failed to parse,
+       * and text cut short by a budget is not the document's text */
+      if (cache && parsed == 0 && !truncated) {
+        stats_enter(stats, PHASE_CACHE);
+        result_cache_store(&key, title.buf, title.len, text.buf, text.len);
+      }
+      if (!ndjson)
+        output_write(out, text.buf, text.len);
+      else if (parsed == 0)
+        write_record(out, input, stats->parser,
+                     input->consumed + input->length - 1, truncated,
+                     title.buf, title.len, text.buf, text.len);
+    }
+    output_free(&title);
+    output_free(&text);
+  }
+
+finish:
+  if (converted) {
+    utf8.uri = nullptr;
+    free_map(&utf8);
+  }
+  stats_enter(stats, PHASE_NONE);
+  /* Stats may gather several documents from a container */
+  stats->truncated |= truncated;
+  stats->bytes_in = input->consumed + (input->length ? input->length - 1 : 0);
+  stats->bytes_out = out->total - out_start;
+  return rc;
+}
+
+int process_document(const char *file, size_t max_buf, struct output *out,
+                     struct doc_stats *stats) {
   struct mapped_buffer input;
-  size_t max_buf;
+  enum container container;
   int rc;
 
+  stats_enter(stats, PHASE_MAP);
+  if (file) {
+    rc = map_file(&input, max_buf, file);
+  } else if (opt.stream) {
+    /* Read just enough to choose a parser and leave the rest unread in
+     * case the parser can take it as it arrives. */
+    rc = map_stream_head(&input, max_buf, stdin, match_window);
+  } else {
+    rc = map_stream(&input, max_buf, stdin);
+  }
+
+  if (rc != 0) {
+    stats_enter(stats, PHASE_NONE);
+    return rc;
+  }
+
+  container = opt.container == CONTAINER_AUTO ?
+              detect_container(&input) : opt.container;
+
+  if (container == CONTAINER_NONE) {
+    rc = process_input(&input, max_buf, &opt, out, stats);
+  } else if ((rc = map_stream_rest(&input, max_buf)) == 0) {
+    rc = process_container(&input, container, max_buf, &opt, out, stats);
+    stats_enter(stats, PHASE_NONE);
+  }
+
+  free_map(&input);
+  return rc;
+}
+
+int main(int argc, char *argv[]) {
+  struct doc_stats startup, stats;
+  struct config_dir *confdirs;
+  struct output out;
+  size_t max_buf;
+  int rc = 0;
+
+  /* Options are not yet parsed, so always time start-up */
+  stats_start();
+  stats_begin(&startup, true);
+  stats_enter(&startup, PHASE_MAX_INPUT_BUFFER);
   max_buf = max_input_buffer();
+  stats_enter(&startup, PHASE_INIT_PARSERS);
   init_parsers();
+  stats_enter(&startup, PHASE_NONE);
   parse_options(argc, argv);
 
   if (opt.error) {
@@ -315,33 +981,63 @@ int main(int argc, char *argv[]) {
   if (opt.help || opt.version)
     goto finish;
 
-  load_config(opt.confdirs ? opt.confdirs : get_defconf());
+  /* The server has the configuration loaded already */
+  if (opt.client) {
+    rc = serve_client(max_buf);
+    goto finish;
+  }
+
+  confdirs = opt.confdirs ? opt.confdirs : get_defconf();
+  stats_enter(&startup, PHASE_LOAD_CONFIG);
+  load_config(confdirs);
+  configure_parsers();
+  stats_enter(&startup, PHASE_NONE);
+  stats_add(&startup, nullptr, 0);
 
-  if (opt.file) {
-    rc = map_file(&input, max_buf, opt.file);
-  } else {
-    rc = map_stream(&input, max_buf, stdin);
+  if (opt.cache && (rc = result_cache_open(opt.cache, opt.cache_size)) != 0)
+    goto report;
+
+  if (opt.serve) {
+    rc = serve(max_buf, confdirs);
+    goto report;
   }
 
-  if (rc != 0)
-    return EXIT_FAILURE;
+  if ((rc = output_init(&out, STDOUT_FILENO)) != 0)
+    goto finish;
 
-  /* Attempt to determine HTML type */
-  if (opt.parser < 0) {
-    parser_match(&input);
+  if (opt.offset_map && (rc = offset_map_open(&offset_map, opt.offset_map)) != 0) {
+    output_free(&out);
+    goto finish;
   }
 
-  /* Choose default parser */
-  if (opt.parser < 0) {
-    opt.parser = 0;
+  if (opt.batch) {
+    rc = process_batch(max_buf, &out);
+    if (output_flush(&out) != 0)
+      rc = 1;
+  } else {
+    stats_begin(&stats, opt.stats != STATS_NONE);
+    rc = process_document(opt.file, max_buf, &out, &stats);
+    stats_enter(&stats, PHASE_FLUSH);
+    if (output_flush(&out) != 0)
+      rc = 1;
+    stats_enter(&stats, PHASE_NONE);
+    stats_add(&stats, opt.file ? opt.file : "-", rc);
   }
+  output_free(&out);
 
-  rc = parser_defs[opt.parser]->parse_fn(&input);
+  if (opt.offset_map && offset_map_close(&offset_map) != 0)
+    rc = 1;
 
-  free_map(&input);
+report:
+  result_cache_close();
   free_parsers();
 
+  if (stats_report() != 0)
+    rc = 1;
+
 finish:
   free_options();
-  return EXIT_SUCCESS;
+  if (rc != 0)
+    return EXIT_FAILURE;
+  return any_truncated ? EXIT_TRUNCATED : EXIT_SUCCESS;
 }
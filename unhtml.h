@@ -15,9 +15,11 @@
 #define UNHTML "unhtml"
 
 #include <regex.h>
+#include <stdio.h>
 #include <stdarg.h>
 
 #include "load.h"
+#include "stats.h"
 
 enum render_mode {
   RENDER_MODE_LITERAL = 0,
@@ -25,9 +27,28 @@ enum render_mode {
   RENDER_MODE_MAX,
 };
 
+enum output_format {
+  OUTPUT_FORMAT_TEXT = 0,
+  OUTPUT_FORMAT_NDJSON,
+  OUTPUT_FORMAT_MAX,
+};
+
+enum container {
+  CONTAINER_AUTO = 0,
+  CONTAINER_NONE,
+  CONTAINER_WARC,
+  CONTAINER_MBOX,
+  CONTAINER_MAX,
+};
+
+struct render_ctx;
+
 struct parser_defn {
   const char *name;
-  int (*parse_fn)(struct mapped_buffer *input);
+  void (*init_fn)(void);
+  void (*config_fn)(void);
+  int (*parse_fn)(struct mapped_buffer *input, struct render_ctx *rctx);
+  int (*stream_fn)(struct mapped_buffer *input, struct render_ctx *rctx);
   const char *imatch_pat;
 };
 
@@ -43,14 +64,69 @@ struct options {
   bool error;
   bool version;
   bool help;
+  bool stream;
+  bool decode_entities;
   int verbosity;
   const char *file;
+  bool batch;
+  const char *files_from;
+  char **files;
+  int num_files;
+  bool recursive;
+  const char **include;
+  int num_include;
+  const char **exclude;
+  int num_exclude;
+  int read_ahead;
+  const char *separator;
+  size_t separator_len;
+  const char *record_separator;
+  size_t record_separator_len;
+  enum container container;
+  const char *outdir;
+  int jobs;
+  int split;
+  bool unordered;
   int parser;
   struct config_dir *confdirs;
+  bool no_config_cache;
+  bool xml_pool;
+  bool huge;
   enum render_mode render_mode;
+  enum output_format format;
+  enum stats_format stats;
+  const char *stats_file;
+  const char *serve;
+  const char *client;
+  const char *offset_map;
+  const char *cache;
+  size_t cache_size;
+  const char *charset;
+  size_t max_output;
+  size_t max_input;
+  long deadline;
 };
 
+/* Exit status when the text of a document was cut short by a budget */
+#define EXIT_TRUNCATED 2
+
 extern struct options opt;
+extern bool any_truncated;
+extern const char *render_mode_names[RENDER_MODE_MAX];
+extern const char *output_format_names[OUTPUT_FORMAT_MAX];
+extern const char *container_names[CONTAINER_MAX];
+
+extern int find_parser(const char *name);
+extern const char *parser_name(int parser);
+extern void configure_parsers(void);
+
+struct output;
+
+extern int process_input(struct mapped_buffer *input, size_t max_buf,
+                         const struct options *o, struct output *out,
+                         struct doc_stats *stats);
+extern int process_document(const char *file, size_t max_buf, struct output *out,
+                            struct doc_stats *stats);
 
 static inline void logv(const char *fmt, ...) {
   va_list args;